@@ -17,9 +17,17 @@
 #define ADM_LIMIT 0.98
 #define ADM_TARGET 0.95
 
+// Online tuning of the MM threshold (cache_thresh) from the DRAM cache miss rate
+#define MM_MISS_TARGET 0.1 // DRAM cache miss rate kept under
+#define MM_MISS_HYST 0.25 // cache_thresh only grows again below (1 - MM_MISS_HYST) of the target
+#define MM_TUNE_STEP 0.05 // cache_thresh change per interval (share of the DRAM cache size)
+#define CACHE_THRESH_MIN 0.25
+#define MM_TUNE_MIN_EV 1 // DRAM cache accesses (M/s) below which the miss rate is not acted upon
+
 // BW info (for checking pcm output)
 #define MM_BW_MAX 50000
 #define ADM_BW_MAX 20000
+#define MM_EV_MAX 1000 // M/s
 
 // PID info
 #define MAX_PIDS 5
@@ -32,8 +40,13 @@
 #define SWITCH_MODE 3
 #define NVRAM_CLEAR 4
 #define NVRAM_WRITE_MODE 5
+#define MM_CONFLICT_MODE 6
 #define MAX_N_FIND MAX_N_PER_PACKET * MAX_PACKETS - 1 // Amount of pages that fit in exactly MAX_PACKETS netlink packets making space for retval struct (end struct)
 #define MAX_N_SWITCH (MAX_N_FIND-1) / 2 // Amount of switches that fit in exactly MAX_PACKETS netlink packets making space for separator and end struct
+#define MM_MAX_REMAP 1024 // Conflicting hot MM pages remapped per request
+#define MM_COLOR_BITS 20 // log2 of the hash table slots holding the colors of hot MM pages
+#define MM_REMAP_TRIES 8 // Frames allocated per remapped page looking for a free color
+#define MM_AGED_MAX_MS 2000 // Conflicts are only looked for if a placement walk aged MM pages this recently (two memcheck intervals)
 
 
 // Node definition
@@ -69,6 +82,7 @@ typedef struct req {
     int op_code;
     int pid_n; // Stores pid for BIND/UNBIND and the number of pages for FIND
     int mode;
+    unsigned long n_colors; // DRAM cache size of a MM node in pages (MM_CONFLICT_MODE)
 } req_t;
 
 //Client-ctl comms:
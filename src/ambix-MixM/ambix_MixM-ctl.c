@@ -39,6 +39,8 @@ struct msghdr msg_out, msg_in;
 volatile int exit_sig = 0;
 volatile int switch_act = 1;
 volatile int thresh_act = 1;
+volatile int tune_act = 1;
+volatile int remap_act = 1;
 
 // In microseconds
 int memcheck_interval = MEMCHECK_INTERVAL * 1000;
@@ -123,7 +125,8 @@ HELPER FUNCTIONS
 int check_memdata(memdata_t *md) {
     if ((md == NULL) || !BETWEEN(md->sys_dramReads, 0, MM_BW_MAX) || !BETWEEN(md->sys_dramWrites, 0, MM_BW_MAX)
             || !BETWEEN(md->sys_pmmReads, 0, ADM_BW_MAX) || !BETWEEN(md->sys_pmmWrites, 0, ADM_BW_MAX)
-            || !BETWEEN(md->sys_pmmAppBW, 0, ADM_BW_MAX) || !BETWEEN(md->sys_pmmMemBW, 0, ADM_BW_MAX)) {
+            || !BETWEEN(md->sys_pmmAppBW, 0, ADM_BW_MAX) || !BETWEEN(md->sys_pmmMemBW, 0, ADM_BW_MAX)
+            || !BETWEEN(md->sys_mmHits, 0, MM_EV_MAX) || !BETWEEN(md->sys_mmMisses, 0, MM_EV_MAX)) {
         return 0;
     }
 
@@ -147,6 +150,16 @@ memdata_t *read_memdata() {
     return md;
 }
 
+// DRAM cache miss rate, -1 if there were too few accesses for it to mean anything
+float mm_miss_rate(memdata_t *md) {
+    float accesses = md->sys_mmHits + md->sys_mmMisses;
+
+    if (accesses < MM_TUNE_MIN_EV) {
+        return -1;
+    }
+    return md->sys_mmMisses / accesses;
+}
+
 time_t get_memdata_mtime() {
     struct stat st;
     if (stat(PCM_FILE_NAME, &st) != -1) {
@@ -207,6 +220,13 @@ int free_space_tot_pages(int mode) {
     return free_space_tot_bytes(mode, &sz) / page_size;
 }
 
+// DRAM cache size of a MM node in pages, assuming all MM nodes are alike
+unsigned long mm_colors() {
+    long long sz = 0;
+    free_space_node(DRAM_NODES[0], &sz);
+    return sz / ratio / page_size;
+}
+
 
 
 /*
@@ -487,6 +507,7 @@ int send_find(int n_pages, int mode) {
     req.op_code = FIND_OP;
     req.pid_n = n_pages;
     req.mode = mode;
+    req.n_colors = (mode == MM_CONFLICT_MODE) ? mm_colors() : 0;
 
     send_req(req, &candidates);
 
@@ -494,6 +515,9 @@ int send_find(int n_pages, int mode) {
 
     while (candidates[++n_found].pid_retval > 0);
 
+    if (mode == MM_CONFLICT_MODE) {
+        return candidates[n_found].addr; // the module remaps them itself
+    }
     if (n_found == 0) {
         return 0;
     }
@@ -524,6 +548,25 @@ PLACEMENT FUNCTIONS
 */
 
 
+// Keeps the DRAM cache miss rate under MM_MISS_TARGET: misses above it lower the share of the MM node Ambix fills,
+// misses well below it raise that share again while it is what limits MM usage
+void tune_mm_thresh(float miss_rate, float mm_usage) {
+    float prev_thresh = cache_thresh;
+
+    if (miss_rate > MM_MISS_TARGET) {
+        cache_thresh = fmax(cache_thresh - MM_TUNE_STEP, CACHE_THRESH_MIN);
+    }
+    else if ((miss_rate < MM_MISS_TARGET * (1 - MM_MISS_HYST)) && (mm_usage >= mm_target)) {
+        cache_thresh = fmin(cache_thresh + MM_TUNE_STEP, ratio);
+    }
+
+    if (cache_thresh != prev_thresh) {
+        mm_thresh = cache_thresh/ratio;
+        mm_target = mm_thresh - 0.01;
+        printf("Set Memory Mode Threshold: %f\n", mm_thresh);
+    }
+}
+
 void *memcheck_placement(void *args) {
     long long mm_sz = 0;
     long long adm_sz = 0;
@@ -538,14 +581,14 @@ void *memcheck_placement(void *args) {
         int thresh_migrated = 0;
         int sleep_interval = memcheck_interval;
 
-        if (thresh_act || switch_act) {
+        if (thresh_act || switch_act || tune_act) {
             mm_usage = free_space_tot_per(DRAM_MODE, &mm_sz);
             adm_usage = free_space_tot_per(NVRAM_MODE, &adm_sz);
             printf("Current MM Usage: %0.2f%%\n", mm_usage * 100);
             printf("Current ADM Usage: %0.2f%%\n", adm_usage * 100);
         }
 
-        if (switch_act) {
+        if (switch_act || tune_act || remap_act) {
             time_t memdata_lmod = get_memdata_mtime();
             if (memdata_lmod == 0 || (memdata_lmod == prev_memdata_lmod)) {
                 printf("MEMCHECK: Old or invalid memdata values. Ignoring...\n");
@@ -557,8 +600,27 @@ void *memcheck_placement(void *args) {
                     printf("MEMCHECK: Unexpected memdata values.\n");
                 }
                 else {
+                    float miss_rate = mm_miss_rate(md);
+                    if (miss_rate >= 0) {
+                        printf("MM cache miss rate: %0.2f%% (%0.2f MB/s)\n", miss_rate * 100, md->sys_pmmMemBW);
+                        if (tune_act) {
+                            tune_mm_thresh(miss_rate, mm_usage);
+                        }
+                    }
+
+                    // Part of the misses may come from hot pages sharing a cache set, which no threshold fixes
+                    if (remap_act && (miss_rate > MM_MISS_TARGET)) {
+                        pthread_mutex_lock(&placement_lock);
+                        int n_remapped = send_find(MM_MAX_REMAP, MM_CONFLICT_MODE);
+                        pthread_mutex_unlock(&placement_lock);
+
+                        if (n_remapped > 0) {
+                            printf("MM: Remapped %d conflicting pages.\n", n_remapped);
+                        }
+                    }
+
                     float pmm_bw = md->sys_pmmAppBW;
-                    if (pmm_bw > ADM_BW_THRESH) {
+                    if (switch_act && (pmm_bw > ADM_BW_THRESH)) {
 
                         pthread_mutex_lock(&placement_lock);
                         send_find(0, NVRAM_CLEAR);
@@ -612,7 +674,7 @@ void *memcheck_placement(void *args) {
                     printf("MM->ADM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
                 }
             }
-            else if (!switch_act && (adm_usage > ADM_LIMIT) && (mm_usage < MM_TARGET)) {
+            else if (!switch_act && (adm_usage > ADM_LIMIT) && (mm_usage < mm_target)) {
                 long long n_bytes = fmin((adm_usage - ADM_TARGET) * adm_sz,
                                     (mm_target - mm_usage) * mm_sz);
                 n_pages = n_bytes / page_size;
@@ -716,7 +778,7 @@ void *process_stdin(void *args) {
             "\tunbind [pid]\n"
             "\tDEBUG: send [n] [dram|nvram|dramwr]\n"
             "\tDEBUG: switch [n]\n"
-            "\tDEBUG: toggle [switch|thresh|all]\n"
+            "\tDEBUG: toggle [switch|thresh|tune|remap|all]\n"
             "\tDEBUG: set [ratio|cacheThresh] [n]\n"
             "\tDEBUG: clear\n"
             "\texit\n");
@@ -842,6 +904,26 @@ void *process_stdin(void *args) {
                     printf("Threshold component turned OFF\n");
                 }
             }
+            else if (!strcmp(substring, "tune\n")) {
+                tune_act = 1 - tune_act;
+
+                if (tune_act) {
+                    printf("Memory Mode Threshold tuning turned ON\n");
+                }
+                else {
+                    printf("Memory Mode Threshold tuning turned OFF\n");
+                }
+            }
+            else if (!strcmp(substring, "remap\n")) {
+                remap_act = 1 - remap_act;
+
+                if (remap_act) {
+                    printf("MM conflict remapping turned ON\n");
+                }
+                else {
+                    printf("MM conflict remapping turned OFF\n");
+                }
+            }
             else if (!strcmp(substring, "all\n")) {
                 switch_act = 1 - switch_act;
                 thresh_act = 1 - thresh_act;
@@ -905,7 +987,7 @@ void *process_stdin(void *args) {
                     "\tunbind [pid]\n"
                     "\tDEBUG: send [n] [dram|nvram|dramwr]\n"
                     "\tDEBUG: switch [n]\n"
-                    "\tDEBUG: toggle [switch|thresh|all]\n"
+                    "\tDEBUG: toggle [switch|thresh|tune|remap|all]\n"
                     "\tDEBUG: set [ratio|cacheThresh] [n]\n"
                     "\tDEBUG: clear\n"
                     "\texit\n");
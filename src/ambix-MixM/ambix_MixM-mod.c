@@ -11,10 +11,13 @@
 #pragma GCC diagnostic ignored "-Wdeclaration-after-statement"
 
 #include <linux/delay.h>
+#include <linux/hash.h>
 #include <linux/init.h>  // Macros used to mark up functions e.g., __init __exit
 #include <linux/kernel.h>  // Contains types, macros, functions for the kernel
 #include <linux/kthread.h>
 #include <linux/mempolicy.h>
+#include <linux/migrate.h>
+#include <linux/mm_inline.h>
 #include <linux/module.h>  // Core header for loading LKMs into the kernel
 #include <net/sock.h>
 #include <linux/netlink.h>
@@ -28,6 +31,7 @@
 #include <linux/signal.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 
 #include <linux/pagewalk.h>
 #include <linux/mmzone.h> // Contains conversion between pfn and node id (NUMA node)
@@ -63,6 +67,12 @@ int n_found = 0;
 int n_backup = 0;
 int n_switch_backup = 0;
 
+unsigned long *color_slots; // colors of the hot MM pages seen by the last conflict walk (+1, 0 if free)
+unsigned long mm_colors = 0; // DRAM cache size of a MM node, in pages
+unsigned long mm_aged_at = 0; // jiffies of the last placement walk that aged MM pages (pte_callback_mem)
+int mm_aged = 0; // whether one ran at all
+LIST_HEAD(rejected_frames); // frames of a taken color allocated while remapping, freed afterwards
+
 
 
 /*
@@ -154,6 +164,30 @@ static int refresh_pids(void) {
     return 0;
 }
 
+/*
+ * The DRAM cache in front of a MM node is direct-mapped by physical address: two pages of the node
+ * thrash each other if their frames are equal modulo the cache size (same color).
+ * Colors share slots of a hash table, a slot holding another color is not a known conflict.
+ */
+static unsigned long *color_slot(unsigned long pfn, unsigned long *key) {
+    *key = (pfn % mm_colors) * MAX_NUMNODES + pfn_to_nid(pfn) + 1;
+    return &color_slots[hash_long(*key, MM_COLOR_BITS)];
+}
+
+// Claims the color of pfn for a hot page, returns 0 if another hot page already has it
+static int claim_color(unsigned long pfn) {
+    unsigned long key;
+    unsigned long *slot = color_slot(pfn, &key);
+
+    if (*slot == key) {
+        return 0;
+    }
+    if (*slot == 0) {
+        *slot = key;
+    }
+    return 1;
+}
+
 
 
 /*
@@ -412,6 +446,29 @@ static int pte_callback_nvram_clear(pte_t *ptep, unsigned long addr, unsigned lo
     return 0;
 }
 
+// Hot MM pages whose color another hot page already has (accessed since a placement walk last aged them)
+static int pte_callback_mm_conflict(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+
+    // If page is not present, write protected, or not in a MM node
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
+        return 0;
+    }
+
+    if (!pte_young(*ptep)) {
+        return 0;
+    }
+
+    if (!claim_color(pte_pfn(*ptep)) && (n_found < n_to_find)) {
+        // Remap to a frame of a free color
+        found_addrs[n_found].addr = addr;
+        found_addrs[n_found++].pid_retval = curr_pid;
+    }
+
+    // Aging is left to the placement walks, clearing the bit here would make hot pages look cold to them
+    return 0;
+}
+
 /*static int pte_callback_count_dram(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
 
@@ -530,6 +587,8 @@ static int mem_walk(int n, int mode) {
 
     if (dram_walk) {
         last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
+        mm_aged_at = jiffies;
+        mm_aged = 1;
     }
     else {
         last_pid_nvram = do_page_walk(mem_walk_ops, last_pid_nvram, last_addr_nvram);
@@ -632,6 +691,8 @@ static int switch_walk(int n) {
 
     mem_walk_ops.pte_entry = pte_callback_mem;
     last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
+    mm_aged_at = jiffies;
+    mm_aged = 1;
     int dram_found = n_found - nvram_found - 1;
     // found equal number of dram and nvram entries
     if (dram_found == nvram_found) {
@@ -696,6 +757,140 @@ static int switch_walk(int n) {
     return 0;
 }
 
+/*
+ * Walks every bound process entirely so that all hot pages claim their color, collecting up to n conflicting ones.
+ * The walk does not age pages (see pte_callback_mm_conflict), so a young bit means accessed since a placement
+ * walk last cleared it: without one in the last MM_AGED_MAX_MS, cold pages would look hot and be remapped.
+ */
+static int conflict_walk(int n, unsigned long n_colors) {
+    struct mm_struct *mm;
+    struct mm_walk_ops mem_walk_ops = {.pte_entry = pte_callback_mm_conflict};
+    int i;
+
+    if (n_colors == 0) {
+        pr_info("PLACEMENT: DRAM cache size not given.\n");
+        return -1;
+    }
+    if (!mm_aged || time_after(jiffies, mm_aged_at + msecs_to_jiffies(MM_AGED_MAX_MS))) {
+        pr_info_ratelimited("PLACEMENT: No recent placement walk, MM access bits too old to find conflicts.\n");
+        return 0; // nothing found
+    }
+    mm_colors = n_colors;
+    memset(color_slots, 0, sizeof(unsigned long) * (1UL << MM_COLOR_BITS));
+    n_to_find = n;
+
+    for (i=0; i < n_pids; i++) {
+        mm = task_items[i]->mm;
+        curr_pid = task_items[i]->pid;
+
+        down_read(&mm->mmap_lock);
+        walk_page_range(mm, 0, MAX_ADDRESS, &mem_walk_ops, NULL);
+        up_read(&mm->mmap_lock);
+    }
+
+    return 0;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+CONFLICT REMAPPING
+
+-------------------------------------------------------------------------------
+*/
+
+
+
+extern int isolate_lru_page(struct page *page); // mm/internal.h, exported by the patched kernel
+
+// migrate_pages() allocation callback: a frame of the same node whose color no hot page has, if one turns up
+static struct page *alloc_free_color_page(struct page *page, unsigned long nid) {
+    struct page *new_page;
+    int i;
+
+    for (i = 0; i < MM_REMAP_TRIES; i++) {
+        new_page = __alloc_pages_node(nid, (GFP_HIGHUSER_MOVABLE | __GFP_THISNODE | __GFP_NOMEMALLOC |
+                                      __GFP_NORETRY | __GFP_NOWARN) & ~__GFP_RECLAIM, 0);
+        if (new_page == NULL) {
+            return NULL;
+        }
+        if (claim_color(page_to_pfn(new_page))) {
+            return new_page;
+        }
+        list_add(&new_page->lru, &rejected_frames);
+    }
+
+    return NULL;
+}
+
+// Moves the page mapped at addr to a frame of another color on its node, returns 1 if it was moved
+static int remap_page(struct mm_struct *mm, unsigned long addr) {
+    LIST_HEAD(page_list);
+    struct vm_area_struct *vma;
+    struct page *page;
+    int nid;
+
+    down_read(&mm->mmap_lock);
+    vma = find_vma(mm, addr);
+    if ((vma == NULL) || (addr < vma->vm_start) || !vma_migratable(vma)) {
+        up_read(&mm->mmap_lock);
+        return 0;
+    }
+    page = follow_page(vma, addr, FOLL_GET | FOLL_DUMP);
+    if (IS_ERR_OR_NULL(page)) {
+        up_read(&mm->mmap_lock);
+        return 0;
+    }
+    // THPs split by the walk are still compound pages mapped by PTEs: follow_page() returns one of their tail pages
+    if (PageCompound(page) || is_zone_device_page(page) || isolate_lru_page(page)) {
+        put_page(page);
+        up_read(&mm->mmap_lock);
+        return 0;
+    }
+    nid = page_to_nid(page);
+    list_add_tail(&page->lru, &page_list);
+    mod_node_page_state(page_pgdat(page), NR_ISOLATED_ANON + page_is_file_lru(page), 1);
+    put_page(page); // isolate_lru_page() holds its own reference
+    up_read(&mm->mmap_lock);
+
+    // One page per call: a failed allocation makes migrate_pages() give up on the rest of the list
+    if (migrate_pages(&page_list, alloc_free_color_page, NULL, nid, MIGRATE_SYNC, MR_SYSCALL)) {
+        if (!list_empty(&page_list)) {
+            putback_movable_pages(&page_list);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Remaps the pages found by conflict_walk(), returns how many were moved
+static int remap_conflicts(void) {
+    struct page *frame, *tmp;
+    int n_remapped = 0;
+    int i, j = 0;
+
+    for (i = 0; i < n_found; i++) {
+        // found_addrs is grouped by pid, in task_items order
+        while ((j < n_pids) && (task_items[j]->pid != found_addrs[i].pid_retval)) {
+            j++;
+        }
+        if (j == n_pids) {
+            break;
+        }
+        n_remapped += remap_page(task_items[j]->mm, found_addrs[i].addr);
+        cond_resched();
+    }
+
+    list_for_each_entry_safe(frame, tmp, &rejected_frames, lru) {
+        list_del(&frame->lru);
+        __free_page(frame);
+    }
+
+    return n_remapped;
+}
+
 
 
 /*
@@ -763,10 +958,13 @@ MESSAGE/REQUEST PROCESSING
 BIND [pid]
 UNBIND [pid]
 FIND [tier] [n]
+FIND [MM_CONFLICT_MODE] [n] [DRAM cache pages]: replies with the conflicting pages found, the end entry's addr holds
+how many were remapped
 
 */
 static void process_req(req_t *req) {
     int ret = -1;
+    int n_remapped = 0;
     n_found = 0;
     if (req != NULL) {
         switch (req->op_code) {
@@ -789,6 +987,12 @@ static void process_req(req_t *req) {
                             n = int_min(MAX_N_SWITCH, req->pid_n);
                             ret = switch_walk(n);
                             break;
+                        case MM_CONFLICT_MODE:
+                            n = int_min(MM_MAX_REMAP, req->pid_n);
+                            if ((ret = conflict_walk(n, req->n_colors)) == 0) {
+                                n_remapped = remap_conflicts();
+                            }
+                            break;
                         default:
                             pr_info("PLACEMENT: Unrecognized mode.\n");
                     }
@@ -808,6 +1012,7 @@ static void process_req(req_t *req) {
         }
     }
 
+    found_addrs[n_found].addr = n_remapped; // MM_CONFLICT_MODE
     found_addrs[n_found++].pid_retval = ret;
 }
 
@@ -890,6 +1095,7 @@ static int __init _on_module_init(void) {
     backup_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_FIND, GFP_KERNEL);
     switch_backup_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_SWITCH, GFP_KERNEL);
     nlmh_array = kmalloc(sizeof(struct nlmsghdr *) * MAX_PACKETS, GFP_KERNEL);
+    color_slots = vmalloc(sizeof(unsigned long) * (1UL << MM_COLOR_BITS));
 
     struct netlink_kernel_cfg cfg = {
         .input = placement_nl_process_msg,
@@ -913,6 +1119,7 @@ static void __exit _on_module_exit(void) {
     kfree(backup_addrs);
     kfree(switch_backup_addrs);
     kfree(nlmh_array);
+    vfree(color_slots);
 }
 
 module_init(_on_module_init);
@@ -13,6 +13,7 @@ typedef struct memdata {
     float sys_pmmReads, sys_pmmWrites;
     float sys_pmmAppBW, sys_pmmMemBW;
     uint64_t total_rDram, total_wDram, total_rOptane, total_wOptane;
+    float sys_mmHits, sys_mmMisses; // 2LM DRAM cache hits (demand reads) and misses (clean + dirty), in M/s
 } memdata_t;
 
 
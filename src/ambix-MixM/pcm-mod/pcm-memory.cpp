@@ -82,7 +82,8 @@ void display_sys_bandwidth(memdata_t *md)
     if (PMM_MIXED) {
         cout << "\
             \r|--                      PMM AD Throughput(MB/s):" << setw(14) << md->sys_pmmAppBW <<                                            "                --|\n\
-            \r|--                      PMM MM Throughput(MB/s):" << setw(14) << md->sys_pmmMemBW <<                                           "                --|\n";
+            \r|--                      PMM MM Throughput(MB/s):" << setw(14) << md->sys_pmmMemBW <<                                           "                --|\n\
+            \r|--                    MM Cache Hits/Misses(M/s):" << setw(10) << md->sys_mmHits << setw(10) << md->sys_mmMisses <<            "          --|\n";
     }
     cout << "\
         \r|--                        Read Throughput(MB/s):" << setw(14) << md->sys_dramReads+md->sys_pmmReads <<                              "                --|\n\
@@ -125,6 +126,9 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
     md.sys_pmmAppBW = 0.0;
     md.sys_pmmMemBW = 0.0;
 
+    md.sys_mmHits = 0.0;
+    md.sys_mmMisses = 0.0;
+
     auto toBW = [&elapsedTime](const uint64 nEvents)
     {
         return (float)(nEvents * 64 / 1000000.0 / (elapsedTime / 1000.0));
@@ -133,6 +137,10 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
     {
         return (uint64)(nEvents / 1000000);
     };
+    auto toMEvs = [&elapsedTime](const uint64 nEvents)
+    {
+        return (float)(nEvents / 1000000.0 / (elapsedTime / 1000.0));
+    };
 
     for(uint32 skt=0; skt < numSockets; ++skt)
     {
@@ -172,6 +180,7 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
             }
             else if (pmmMixed) {
                 md.sys_pmmMemBW += toBW(pmmMemoryModeCleanMisses + 2 * pmmMemoryModeDirtyMisses);
+                md.sys_mmMisses += toMEvs(pmmMemoryModeCleanMisses + pmmMemoryModeDirtyMisses);
             }
         }
 
@@ -180,6 +189,7 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
                 uint64 pmmReads = 0, pmmWrites = 0;
                 pmmReads = getM2MCounter(c, ServerPCICFGUncore::EventPosition::PMM_READ, uncState1[skt],uncState2[skt]);
                 pmmWrites = getM2MCounter(c, ServerPCICFGUncore::EventPosition::PMM_WRITE, uncState1[skt],uncState2[skt]);
+                md.sys_mmHits += toMEvs(getM2MCounter(c, ServerPCICFGUncore::EventPosition::NM_HIT, uncState1[skt],uncState2[skt]));
 
                 md.total_rOptane += toMEv(pmmReads);
                 md.total_wOptane += toMEv(pmmWrites);
@@ -0,0 +1,84 @@
+/**
+ * @file    ambix-bpf.bpf.c
+ * @brief  BPF collector for the BPF backend of ctl: counts the user page faults of bound processes per
+ * page, so that page hotness is known without the Ambix kernel module. With NUMA balancing enabled
+ * (kernel.numa_balancing=1) the kernel periodically unmaps pages to take hinting faults on them, which
+ * makes every accessed page fault again regularly. It also migrates those pages on its own, so ctl
+ * leaves promotions to the kernel in that case (see bf_check_numa_balancing()).
+ * Build: clang -O2 -g -target bpf -c ambix-bpf.bpf.c -o ambix-bpf.bpf.o
+ */
+
+#include <linux/types.h>
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "ambix-bpf.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+// Bound processes (tgid), set by ctl on bind/unbind
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, BPF_MAX_PIDS);
+    __type(key, __u32);
+    __type(value, __u8);
+} bound_pids SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} epoch SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, BPF_MAX_PAGES);
+    __type(key, page_key_t);
+    __type(value, page_heat_t);
+} page_heat SEC(".maps");
+
+// Format of the exceptions:page_fault_user tracepoint (x86)
+struct page_fault_args {
+    __u64 common; // common_type, common_flags, common_preempt_count, common_pid
+    unsigned long address;
+    unsigned long ip;
+    unsigned long error_code;
+};
+
+SEC("tracepoint/exceptions/page_fault_user")
+int ambix_page_fault(struct page_fault_args *ctx) {
+    __u32 pid = bpf_get_current_pid_tgid() >> 32;
+    __u32 zero = 0;
+    page_key_t key = {};
+    page_heat_t *heat;
+    __u32 *curr;
+
+    if (bpf_map_lookup_elem(&bound_pids, &pid) == NULL) {
+        return 0;
+    }
+    curr = bpf_map_lookup_elem(&epoch, &zero);
+    if (curr == NULL) {
+        return 0;
+    }
+
+    key.pid = pid;
+    key.addr = ctx->address & ~((1UL << BPF_PAGE_SHIFT) - 1);
+
+    heat = bpf_map_lookup_elem(&page_heat, &key);
+    if (heat == NULL) {
+        page_heat_t init = {.epoch = *curr, .faults = 1};
+        if (ctx->error_code & BPF_PF_WRITE) {
+            init.write_epoch = *curr;
+        }
+        bpf_map_update_elem(&page_heat, &key, &init, BPF_NOEXIST);
+        return 0;
+    }
+
+    __sync_fetch_and_add(&heat->faults, 1);
+    heat->epoch = *curr;
+    if (ctx->error_code & BPF_PF_WRITE) {
+        heat->write_epoch = *curr;
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _AMBIX_BPF_H
+#define _AMBIX_BPF_H
+
+// Shared by the BPF collector (ambix-bpf.bpf.c) and the BPF backend of ctl (built with -DAMBIX_BPF):
+
+#define BPF_OBJ_FILE "ambix-bpf.bpf.o"
+#define BPF_MAX_PAGES (1 << 22) // Pages tracked at once, least recently faulted ones are evicted (16GB of 4KB pages)
+#define BPF_MAX_PIDS 1024
+#define BPF_PAGE_SHIFT 12
+#define BPF_LOOKUP_BATCH 8192 // page_heat entries read per bpf_map_lookup_batch() call
+
+// page_fault_user error code bit set by write accesses
+#define BPF_PF_WRITE 0x2
+
+typedef struct page_key {
+    __u32 pid;
+    __u32 pad;
+    __u64 addr; // page aligned
+} page_key_t;
+
+// Epochs are advanced by ctl after every FIND (and on NVRAM_CLEAR), a page is young if it faulted in the current one
+typedef struct page_heat {
+    __u32 epoch; // epoch of the last fault
+    __u32 write_epoch; // epoch of the last write fault
+    __u64 faults;
+} page_heat_t;
+
+#endif
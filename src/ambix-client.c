@@ -141,6 +141,56 @@ int unbind_uds(int pid_arg) {
     return 1;
 }
 
+static int cgroup_uds(int op_code, const char *path) {
+    // Unix domain socket
+    struct sockaddr_un uds_addr;
+    int unix_fd;
+    req_t cgroup_req;
+    char cgroup_path[CGROUP_PATH_MAX];
+
+    if((unix_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "Error creating UD socket: %s\n", strerror(errno));
+        return 0;
+    }
+    memset(&uds_addr, 0, sizeof(uds_addr));
+    uds_addr.sun_family = AF_UNIX;
+
+    strncpy(uds_addr.sun_path, UDS_path, sizeof(uds_addr.sun_path)-1);
+
+    if(connect(unix_fd, (struct sockaddr*)&uds_addr, sizeof(uds_addr))) {
+        fprintf(stderr, "Error connecting to server via UDS: %s\n", strerror(errno));
+
+        close(unix_fd);
+        return 0;
+    }
+
+    memset(&cgroup_req, 0, sizeof(cgroup_req));
+    cgroup_req.op_code = op_code;
+    memset(cgroup_path, 0, sizeof(cgroup_path));
+    strncpy(cgroup_path, path, CGROUP_PATH_MAX - 1);
+
+    // Path follows the request on the same connection
+    if ((write(unix_fd, &cgroup_req, sizeof(cgroup_req)) != sizeof(cgroup_req)) ||
+            (write(unix_fd, cgroup_path, sizeof(cgroup_path)) != sizeof(cgroup_path))) {
+        fprintf(stderr, "Error writing to UDS fd: %s\n", strerror(errno));
+
+        close(unix_fd);
+        return 0;
+    }
+
+    close(unix_fd);
+    return 1;
+}
+
+// Binds every current and future process of a cgroup v2 (path relative to the cgroup2 mount)
+int bind_cgroup_uds(const char *path) {
+    return cgroup_uds(BIND_CGROUP_OP, path);
+}
+
+int unbind_cgroup_uds(const char *path) {
+    return cgroup_uds(UNBIND_CGROUP_OP, path);
+}
+
 void bind_uds_ft_() {
     bind_uds(0);
 }
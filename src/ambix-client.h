@@ -5,5 +5,7 @@
 
 extern int bind_uds(int pid);
 extern int unbind_uds(int pid);
+extern int bind_cgroup_uds(const char *path);
+extern int unbind_cgroup_uds(const char *path);
 
 #endif
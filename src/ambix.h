@@ -6,17 +6,39 @@
 
 #define MEMCHECK_INTERVAL PCM_DELAY * 1000
 #define NVRAMWRCHK_INTERVAL PCM_DELAY * 1000
+#define MEMCHECK_FAST_INTERVAL 200 // Shortest memcheck interval (ms) when pcm-memory.x samples faster than PCM_DELAY
 #define CLEAR_DELAY 50
 #define NVRAM_BW_THRESH 10
+#define NVRAM_WR_BW_THRESH 5 // pcm NVRAM write bandwidth above which write-hot pages are moved out of NVRAM
+#define PMM_LAT_THRESH 600 // pcm PMM read latency (ns) above which hot NVRAM pages are promoted at any bandwidth
+#define PMM_LAT_RATIO 8 // Same for PMM read latency over DRAM read latency
+#define PMM_LAT_MIN_BW 1 // PMM bandwidth below which the latency is not acted upon (too few requests)
 
 // BW info (for checking pcm output)
 #define DRAM_BW_MAX 50000
 #define NVRAM_BW_MAX 20000
+#define IPC_MAX 16
+#define LAT_MAX 100000 // ns
+#define DRAM_NODE_BW 20000 // Bandwidth a DRAM node sustains, migrations prefer destination nodes furthest below it
+#define NVRAM_NODE_BW 5000 // Same for NVRAM nodes
+
+// Migration rate limiter (ctl), rates in MB/s as reported by pcm
+#define NVRAM_BW_HEADROOM 0.8 // Share of NVRAM_BW_MAX the application and migrations may use together
+#define MIG_RATE_MIN 16 // Always allowed, so placement never stops completely
+#define MIG_BURST_MS 250 // Token bucket depth, in ms at the current rate
+#define IPC_DROP 0.9 // IPC below this share of the baseline while migrating halves the rate
+#define IPC_EWMA 0.25 // Weight of a new sample in the IPC baseline
+#define MIG_RATE_STEP 0.1 // Share of the headroom regained per interval without an IPC drop
 
 // PID info
 #define MAX_PIDS 0 // set to non-zero positive value to limit number of PIDs bound to Ambix
 #define MAX_PID_N 2147483647 // set to INT_MAX. true max pid number is shown in /proc/sys/kernel/pid_max
 
+// cgroup info
+#define CGROUP_PATH_MAX 256 // cgroup v2 path, relative to the cgroup2 mount (e.g. "/system.slice/app.service")
+#define CGROUP_SCAN_BATCH 1024 // New processes bound per cgroup on each rescan (the rest on the next ones)
+#define CGROUP_RESCAN_MS 1000 // Bound cgroups are rescanned for new and departed processes this often
+
 // Find-related constants:
 #define DRAM_MODE 0
 #define NVRAM_MODE 1
@@ -24,16 +46,47 @@
 #define SWITCH_MODE 3
 #define NVRAM_CLEAR 4
 #define NVRAM_WRITE_MODE 5
-#define MAX_N_FIND MAX_N_PER_PACKET * MAX_PACKETS - 1 // Amount of pages that fit in exactly MAX_PACKETS netlink packets making space for retval struct (end struct)
-#define MAX_N_SWITCH (MAX_N_FIND - 1) / 2 // Amount of switches that fit in exactly MAX_PACKETS netlink packets making space for begin and end struct
+// FIND modes walk the tier given in the request: DRAM_MODE looks for cold pages to demote to the next
+// (slower) tier, NVRAM modes look for hot pages to promote to the previous one, SWITCH_MODE exchanges
+// hot pages of the tier with cold pages of the previous one.
+#define DEMOTE_MODE DRAM_MODE
+#define PROMOTE_MODE NVRAM_MODE
+#define MAX_N_FIND (MAX_N_PER_PACKET * MAX_PACKETS - 1) // Amount of pages that fit in exactly MAX_PACKETS netlink packets making space for retval struct (end struct)
+#define MAX_N_SWITCH ((MAX_N_FIND - 1) / 2) // Amount of switches that fit in exactly MAX_PACKETS netlink packets making space for begin and end struct
+#define MAX_FIND_BATCHES 4 // FINDs a single placement decision is split into (ctl scans a batch while migrating the previous one)
+#define MIN_FIND_BATCH 8192 // Smallest batch a decision is split into (32MB of base pages), smaller ones are not worth a walk each
+#define PIPELINE_QUEUE 16 // FIND requests queued in ctl before submitters wait
+#define MIG_WORKERS_PER_NODE 2 // ctl migration workers per memory node, pinned to the CPUs closest to it
+#define MAX_MIG_WORKERS 64
+#define MIG_SHARD_PAGES 512 // Candidates of the same (pid, destination node) moved by a single move_pages call
+
+// Per-page access history (kernel module):
+#define HIST_EPOCHS 8 // Sampled epochs remembered per page, for both accessed and dirty bits
+#define HIST_EPOCH_MASK ((1U << HIST_EPOCHS) - 1)
+#define HIST_BITS (2 * HIST_EPOCHS)
+#define HIST_MASK ((1U << HIST_BITS) - 1)
+#define HIST_PER_ENTRY 3 // Pages packed in one xarray value entry (63 usable bits)
+#define HIST_STAMP_SHIFT (HIST_PER_ENTRY * HIST_BITS) // Remaining bits of an entry hold the write epoch it was last updated in
+#define HIST_STAMP_MASK ((1UL << (63 - HIST_STAMP_SHIFT)) - 1)
+
+// Page walk workers (kernel module):
+#define MAX_WALKERS 16 // Upper bound on worker threads (each holds ~5MB of candidate buffers)
+#define WALK_MIN_CHUNK (64UL << 20) // Smallest address range (bytes) handed to a single worker
+
+// Walk statistics (kernel module, /sys/kernel/debug/ambix):
+#define N_FIND_MODES 6 // DRAM_MODE to NVRAM_WRITE_MODE
+#define STATS_BUCKETS 24 // log2 histogram buckets, the last one also counts everything above it
 
+// Region sampling (kernel module, region_sampling=1):
+#define REGION_AREAS 3 // Mapped areas of an mm that regions cover (its range minus the two largest gaps)
+#define REGION_UPDATE_AGGRS 10 // Aggregation intervals between updates of the areas (mmap/munmap)
 
-// Node definition: DRAM nodes' (memory mode) ids must always be a lower value than NVRAM nodes' ids due to the memory policy set in client-placement.c
-static const int DRAM_NODES[] = {0};
-static const int NVRAM_NODES[] = {2};
 
-static const int n_dram_nodes = sizeof(DRAM_NODES)/sizeof(DRAM_NODES[0]);
-static const int n_nvram_nodes = sizeof(NVRAM_NODES)/sizeof(NVRAM_NODES[0]);
+// Tier topology: an ordered list of tiers (fastest first), each a set of NUMA nodes. Set at module load
+// (tiers=...) or at runtime from ctl ("tiers ..."), using the format parsed by parse_tiers().
+#define MAX_TIERS 8
+#define MAX_TIER_NODES 64 // Node ids must fit in a tier's node mask
+#define DEFAULT_TIERS "0:2" // e.g. "0:1:2-3" for local DRAM, remote DRAM and two NVRAM nodes
 
 // Netlink:
 #define NETLINK_USER 31
@@ -42,6 +95,23 @@ static const int n_nvram_nodes = sizeof(NVRAM_NODES)/sizeof(NVRAM_NODES[0]);
 #define MAX_N_PER_PACKET (MAX_PAYLOAD/sizeof(addr_info_t)) // Currently 1MB of pages
 
 
+// Candidate ring (FIND replies are written by the module into a buffer mmap'd by ctl):
+#define AMBIX_DEV_NAME "ambix"
+#define AMBIX_DEV_PATH "/dev/ambix"
+#define RING_SLOTS 2 // ctl migrates the reply in one slot while the module writes the next FIND into the other
+#define RING_SLOT_ENTRIES (MAX_N_FIND + 1) // Room for a full FIND reply
+#define RING_ENTRIES (RING_SLOTS * RING_SLOT_ENTRIES)
+#define RING_HDR_SIZE 4096 // Header is padded to a page so entries start page aligned
+#define RING_SIZE (RING_HDR_SIZE + RING_ENTRIES * sizeof(addr_info_t))
+#define AMBIX_IOC_MAGIC 'x'
+#define AMBIX_IOC_FIND _IOW(AMBIX_IOC_MAGIC, 1, req_t) // Doorbell: walk and publish reply in the ring
+#define AMBIX_IOC_MIGRATE _IOWR(AMBIX_IOC_MAGIC, 2, migrate_req_t) // Walk and migrate the candidates in the module
+#define AMBIX_IOC_GET_TIERS _IOR(AMBIX_IOC_MAGIC, 3, tier_cfg_t)
+#define AMBIX_IOC_SET_TIERS _IOW(AMBIX_IOC_MAGIC, 4, tier_cfg_t)
+#define AMBIX_IOC_BIND_CGROUP _IOW(AMBIX_IOC_MAGIC, 5, cgroup_req_t)
+#define AMBIX_IOC_UNBIND_CGROUP _IOW(AMBIX_IOC_MAGIC, 6, cgroup_req_t)
+#define AMBIX_IOC_CGROUP_STATS _IOWR(AMBIX_IOC_MAGIC, 7, cgroup_req_t) // Tier residency of a bound cgroup
+
 // Unix Domain Socket:
 #define UDS_path "./socket"
 #define MAX_BACKLOG 5
@@ -50,19 +120,74 @@ static const int n_nvram_nodes = sizeof(NVRAM_NODES)/sizeof(NVRAM_NODES[0]);
 #define FIND_OP 0
 #define BIND_OP 1
 #define UNBIND_OP 2
+#define BIND_CGROUP_OP 3 // UDS only: the req_t is followed by a CGROUP_PATH_MAX path
+#define UNBIND_CGROUP_OP 4
 
 // Comm-related structures:
 typedef struct addr_info {
     unsigned long addr;
     int pid_retval; // Stores pid info for FIND operation and BIND/UNBIND ok/nok
+    int huge; // 1 if addr is the start of a PMD-mapped transparent huge page (fills struct padding)
 } addr_info_t;
 
 typedef struct req {
     int op_code;
     int pid_n; // Stores pid for BIND/UNBIND and the number of pages for FIND
     int mode;
+    int tier; // Tier walked by FIND requests
+    unsigned long long nodes; // FIND: only pages on these nodes of the tier are returned (0 for the whole tier)
 } req_t;
 
+typedef struct cgroup_req {
+    char path[CGROUP_PATH_MAX];
+    int n_procs; // Bound processes (AMBIX_IOC_CGROUP_STATS)
+    int n_walked; // Of which were walked whole before the module's scan budget ran out (AMBIX_IOC_CGROUP_STATS)
+    unsigned long tier_pages[MAX_TIERS]; // Resident base pages per tier (AMBIX_IOC_CGROUP_STATS)
+} cgroup_req_t;
+
+typedef struct tier_cfg {
+    int n_tiers;
+    unsigned long long nodes[MAX_TIERS]; // Node mask of each tier, fastest tier first
+} tier_cfg_t;
+
+// In-kernel migration statistics, all in base pages (a THP counts as THP_SIZE/PAGE_SIZE)
+typedef struct migrate_stats {
+    int n_migrated;
+    int n_not_present; // Page was unmapped or its process exited before it could be isolated
+    int n_isolate_failed; // Page was not on an LRU list (e.g. already being migrated or reclaimed)
+    int n_nomem; // No free memory left on any node of the destination tier
+    int n_failed; // migrate_pages() gave up on the page (pinned, locked, under writeback...)
+} migrate_stats_t;
+
+typedef struct migrate_req {
+    req_t req; // FIND request whose candidates are migrated to the opposite tier
+    migrate_stats_t stats;
+} migrate_req_t;
+
+typedef struct ring_hdr {
+    unsigned long head; // Producer index (module), in entries since the device was opened (a reply takes a whole slot)
+    unsigned long tail; // Consumer index (ctl), set to the end of a reply's slot once it has been processed
+    unsigned long batch_start; // Entry offset of the last FIND reply
+    unsigned long batch_len; // Entries in the last FIND reply (including the end struct)
+} ring_hdr_t;
+
+// ctl hotness backends (first ctl argument):
+#define BACKEND_MODULE 0 // "module": page walks of ambix_hyb-mod.ko (default)
+#define BACKEND_PAGEMAP 1 // "pagemap": /proc/<pid>/pagemap, page_idle and soft-dirty, for stock kernels
+#define BACKEND_BPF 2 // "bpf": page faults counted by ambix-bpf.bpf.o (ctl built with make ctl-bpf)
+#define BACKEND_DAMON 3 // "damon": DAMOS migrate_hot/migrate_cold schemes set up through DAMON sysfs (Linux 6.11+)
+#define PAGEMAP_BATCH 65536 // pagemap entries read at once (256MB of address space with 4KB pages)
+#define IDLE_BLOCK_WORDS 4096 // page_idle bitmap words read/written at once (1GB of memory with 4KB pages)
+#define DAMON_SYSFS "/sys/kernel/mm/damon/admin/kdamonds"
+#define DAMON_SAMPLE_US 5000
+#define DAMON_AGGR_US 100000
+#define DAMON_UPDATE_US 1000000 // Regions are fitted to the mappings of the targets every update interval
+#define DAMON_MIN_REGIONS 10
+#define DAMON_MAX_REGIONS 1000 // Bounds the monitoring overhead, whatever the size of the bound processes
+#define DAMON_HOT_ACCESSES 5 // Sampled accesses per aggregation interval (at most 20) for a region to be promoted
+#define DAMON_COLD_AGE 20 // Aggregation intervals without accesses for a region to be demoted (2s)
+#define DAMON_MAX_QUOTA_SCALE 8 // Largest quota of a scheme, in times its request (see damon_applied_pages)
+
 //Client-ctl comms:
 #define PORT 8080
 #define SELECT_TIMEOUT 1
@@ -76,6 +201,9 @@ typedef struct req {
 #define MAX_INTERVAL_MUL 1
 #define INTERVAL_INC_FACTOR 1.0
 
+// Transparent huge pages (PMD-mapped) are migrated as a single unit
+#define THP_SIZE (2UL << 20)
+
 // Memory ranges: (64-bit systems only use 48-bit)
 #define IS_64BIT (sizeof(void*) == 8)
 #define MAX_ADDRESS (IS_64BIT ? 0xFFFF880000000000UL : 0xC0000000UL) // Max user-space addresses for the x86 architecture
@@ -93,23 +221,93 @@ int int_min(int val1, int val2) {
     return val1;
 }
 
-int contains(int value, int mode) {
-    const int *array;
-    int size, i;
+// A valid topology has at least two tiers, none of them empty, and no node in more than one tier
+int check_tiers(const tier_cfg_t *cfg) {
+    unsigned long long seen = 0;
+    int t;
 
-    if(mode == NVRAM_MODE) {
-        array = NVRAM_NODES;
-        size = n_nvram_nodes;
+    if ((cfg->n_tiers < 2) || (cfg->n_tiers > MAX_TIERS)) {
+        return -1;
     }
-    else {
-        array = DRAM_NODES;
-        size = n_dram_nodes;
-    }
-    for(i=0; i<size; i++) {
-        if(array[i] == value) {
-            return 1;
+    for (t = 0; t < cfg->n_tiers; t++) {
+        if ((cfg->nodes[t] == 0) || (cfg->nodes[t] & seen)) {
+            return -1;
         }
+        seen |= cfg->nodes[t];
     }
     return 0;
 }
+
+// Parses a tier list: tiers separated by ':', each a list of nodes and node ranges (e.g. "0,1:2-3")
+int parse_tiers(const char *str, tier_cfg_t *cfg) {
+    const char *p = str;
+    int t = 0, first = -1;
+    int node, i;
+
+    for (i = 0; i < MAX_TIERS; i++) {
+        cfg->nodes[i] = 0;
+    }
+
+    while (1) {
+        if ((*p < '0') || (*p > '9')) {
+            return -1;
+        }
+        for (node = 0; (*p >= '0') && (*p <= '9'); p++) {
+            node = node * 10 + (*p - '0');
+            if (node >= MAX_TIER_NODES) {
+                return -1;
+            }
+        }
+
+        if (first >= 0) {
+            if (node < first) {
+                return -1;
+            }
+            for (i = first; i <= node; i++) {
+                cfg->nodes[t] |= 1ULL << i;
+            }
+            first = -1;
+        }
+        else if (*p == '-') {
+            first = node;
+            p++;
+            continue;
+        }
+        else {
+            cfg->nodes[t] |= 1ULL << node;
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p == ':') {
+            if (++t >= MAX_TIERS) {
+                return -1;
+            }
+            p++;
+        }
+        else if ((*p == '\0') || (*p == '\n')) {
+            break;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    cfg->n_tiers = t + 1;
+    return check_tiers(cfg);
+}
+
+// Fills nodes with the node ids of a tier, in increasing order, and returns how many there are
+int tier_nodes(const tier_cfg_t *cfg, int tier, int *nodes) {
+    int n = 0;
+    int i;
+
+    for (i = 0; i < MAX_TIER_NODES; i++) {
+        if (cfg->nodes[tier] & (1ULL << i)) {
+            nodes[n++] = i;
+        }
+    }
+    return n;
+}
 #endif
@@ -3,16 +3,32 @@
 
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
 #include <linux/netlink.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <numaif.h>
 #include <numa.h>
 #include <math.h>
 #include <syscall.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#ifdef AMBIX_BPF
+#include <linux/types.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include "ambix-bpf.h"
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,8 +36,10 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
 
 int netlink_fd;
+int ring_fd;
 
 long page_size; // in kB
 
@@ -31,7 +49,13 @@ struct nlmsghdr *nlmh_out;//, *nlmh_in;
 char *buffer;
 int buf_size;
 
-addr_info_t *candidates;
+void *ring;
+ring_hdr_t *ring_hdr;
+addr_info_t *ring_entries;
+
+tier_cfg_t tiers; // tier topology, as configured in the module
+
+int backend = BACKEND_MODULE; // where FIND candidates come from
 
 struct iovec iov_out, iov_in;
 struct msghdr msg_out, msg_in;
@@ -39,6 +63,10 @@ struct msghdr msg_out, msg_in;
 volatile int exit_sig = 0;
 volatile int switch_act = 1;
 volatile int thresh_act = 1;
+volatile int write_act = 1;
+volatile int rate_act = 1; // pace migrations by NVRAM bandwidth headroom and IPC
+volatile int lat_act = 1; // let PMM latency trigger the switch component as well
+volatile int kmig_act = 0; // let the module migrate the candidates itself
 
 // In microseconds
 int memcheck_interval = MEMCHECK_INTERVAL * 1000;
@@ -117,37 +145,130 @@ HELPER FUNCTIONS
 int check_memdata(memdata_t *md) {
     if ((md == NULL) || !BETWEEN(md->sys_dramReads, 0, DRAM_BW_MAX) || !BETWEEN(md->sys_dramWrites, 0, DRAM_BW_MAX)
             || !BETWEEN(md->sys_pmmReads, 0, NVRAM_BW_MAX) || !BETWEEN(md->sys_pmmWrites, 0, NVRAM_BW_MAX)
-            || !BETWEEN(md->sys_pmmAppBW, 0, NVRAM_BW_MAX) || !BETWEEN(md->sys_pmmMemBW, 0, NVRAM_BW_MAX)) {
+            || !BETWEEN(md->sys_pmmAppBW, 0, NVRAM_BW_MAX) || !BETWEEN(md->sys_pmmMemBW, 0, NVRAM_BW_MAX)
+            || !BETWEEN(md->sys_ipc, 0, IPC_MAX) || !BETWEEN(md->n_sockets, 0, MAX_SOCKETS)
+            || !BETWEEN(md->sys_dramReadLat, 0, LAT_MAX) || !BETWEEN(md->sys_dramWriteLat, 0, LAT_MAX)
+            || !BETWEEN(md->sys_pmmReadLat, 0, LAT_MAX) || !BETWEEN(md->sys_pmmWriteLat, 0, LAT_MAX)) {
         return 0;
     }
 
     return 1;
 }
 
-memdata_t *read_memdata() {
-    memdata_t *md = malloc(sizeof(memdata_t));
+// Optane latency climbs under load well before its bandwidth looks high: PMM read latency over PMM_LAT_THRESH,
+// or over PMM_LAT_RATIO times that of DRAM, with enough PMM traffic for it to mean something
+int pmm_latency_high(memdata_t *md) {
+    if ((md->sys_pmmReadLat <= 0) || (md->sys_pmmReads + md->sys_pmmWrites < PMM_LAT_MIN_BW)) {
+        return 0;
+    }
+    return (md->sys_pmmReadLat > PMM_LAT_THRESH)
+        || ((md->sys_dramReadLat > 0) && (md->sys_pmmReadLat > PMM_LAT_RATIO * md->sys_dramReadLat));
+}
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifdef AMBIX_PCM
+// pcm is linked in (make ctl-pcm): every call samples the counters, covering the time since the previous one,
+// so there is no summary over shorter samples
+int read_pcm_sample(pcm_sample_t *out, pcm_summary_t *sum) {
+    static uint64_t no = 0;
+    uint64_t interval_us;
+
+    pcm_sampler_read(&out->md, &interval_us);
+    out->no = ++no;
+    out->ts_ns = now_ns();
+    out->interval_ns = interval_us * 1000;
+    out->cost_ns = 0;
+    sum->n_window = 0;
+    return 1;
+}
+#else
+pcm_shm_t *pcm_shm = NULL; // ring published by pcm-memory.x
 
-    FILE * in_file = fopen(PCM_FILE_NAME, "r");
-    if (in_file == NULL) {
-        fprintf(stderr, "Error opening memdata file.\n");
-        return md;
+int map_pcm_shm() {
+    int fd = shm_open(PCM_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        return 0; // pcm-memory.x not running (yet)
     }
-    if (fread(md, sizeof(memdata_t), 1, in_file) != 1) {
-        fprintf(stderr, "Error reading memdata from file.\n");
+    void *p = mmap(NULL, sizeof(pcm_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Could not map pcm shared memory: %s\n", strerror(errno));
+        return 0;
     }
+    pcm_shm = p;
+    if ((pcm_shm->version != PCM_SHM_VERSION) || (pcm_shm->size != sizeof(pcm_shm_t))) {
+        fprintf(stderr, "pcm shared memory has a different layout, rebuild pcm-memory.x.\n");
+        munmap(pcm_shm, sizeof(pcm_shm_t));
+        pcm_shm = NULL;
+        return 0;
+    }
+    return 1;
+}
 
-    fclose(in_file);
-
-    return md;
+void unmap_pcm_shm() {
+    munmap(pcm_shm, sizeof(pcm_shm_t));
+    pcm_shm = NULL;
 }
 
-time_t get_memdata_mtime() {
-    struct stat st;
-    if (stat(PCM_FILE_NAME, &st) != -1) {
-        return st.st_mtime;
+/*
+ * Copies the last published sample and the summary, retrying while pcm is writing them. pcm-memory.x
+ * may exit in the middle of a write and leave a seqlock odd for good, so after PCM_SHM_RETRIES attempts
+ * the shared memory is taken for stale and mapped again on the next call.
+ */
+int read_pcm_sample(pcm_sample_t *out, pcm_summary_t *sum) {
+    int tries;
+
+    if ((pcm_shm == NULL) && !map_pcm_shm()) {
+        return 0;
+    }
+
+    for (tries = 0; tries < PCM_SHM_RETRIES; tries++) {
+        uint64_t head = __atomic_load_n(&pcm_shm->head, __ATOMIC_ACQUIRE);
+        if (head == 0) {
+            return 0;
+        }
+        pcm_sample_t *s = &pcm_shm->ring[(head - 1) % PCM_SHM_SAMPLES];
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) && (out->no == head)) {
+            break;
+        }
+    }
+
+    // pcm-memory.x stopped, or was restarted on a new ring: map it again on the next call
+    if ((tries == PCM_SHM_RETRIES) || (now_ns() - out->ts_ns > 3 * out->interval_ns)) {
+        unmap_pcm_shm();
+        return 0;
+    }
+
+    // The summary may already include a newer sample, the caller checks sum->no
+    pcm_summary_t *s = &pcm_shm->summary;
+    for (tries = 0; tries < PCM_SHM_RETRIES; tries++) {
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(sum, s, sizeof(*sum));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            return 1;
+        }
     }
+    unmap_pcm_shm();
     return 0;
 }
+#endif
 
 
 long long free_space_node(int node, long long *sz) {
@@ -156,24 +277,17 @@ long long free_space_node(int node, long long *sz) {
     return node_fr;
 }
 
-long long free_space_tot_bytes(int mode, long long *sz) {
+long long free_space_tot_bytes(int tier, long long *sz) {
 
     long long total_node_sz = 0;
     long long total_node_fr = 0;
+    int nodes[MAX_TIER_NODES];
+    int n_nodes = tier_nodes(&tiers, tier, nodes);
 
-    if (mode == DRAM_MODE) {
-        for (int i=0; i < n_dram_nodes; i++) {
-            long long node_sz = 0;
-            total_node_fr += free_space_node(DRAM_NODES[i], &node_sz);
-            total_node_sz += node_sz;
-        }
-    }
-    else {
-        for (int i=0; i < n_nvram_nodes; i++) {
-            long long node_sz = 0;
-            total_node_fr += free_space_node(NVRAM_NODES[i], &node_sz);
-            total_node_sz += node_sz;
-        }
+    for (int i=0; i < n_nodes; i++) {
+        long long node_sz = 0;
+        total_node_fr += free_space_node(nodes[i], &node_sz);
+        total_node_sz += node_sz;
     }
 
     *sz = total_node_sz;
@@ -186,8 +300,8 @@ float free_space_per(int node) {
     return 1.0 * (sz - fr) / sz;
 }
 
-float free_space_tot_per(int mode, long long *sz) {
-    long long fr = free_space_tot_bytes(mode, sz);
+float free_space_tot_per(int tier, long long *sz) {
+    long long fr = free_space_tot_bytes(tier, sz);
     return 1.0 * (*sz - fr) / *sz;
 }
 
@@ -196,9 +310,205 @@ int free_space_pages(int node) {
     return free_space_node(node, &sz) / page_size;
 }
 
-int free_space_tot_pages(int mode) {
+int free_space_tot_pages(int tier) {
     long long sz = 0;
-    return free_space_tot_bytes(mode, &sz) / page_size;
+    return free_space_tot_bytes(tier, &sz) / page_size;
+}
+
+float node_bw[MAX_NODES]; // read + write bandwidth of each node in the last pcm sample (0 if unknown)
+
+void update_node_bw(memdata_t *md) {
+    for (int n=0; n < MAX_NODES; n++) {
+        node_bw[n] = (md->node_socket[n] >= 0) ? (md->node_reads[n] + md->node_writes[n]) : 0;
+    }
+    if (md->n_sockets > 1) {
+        for (int skt=0; skt < md->n_sockets; skt++) {
+            printf("Socket %d: DRAM %0.0f MB/s, NVRAM %0.0f MB/s read, %0.0f MB/s write\n", skt,
+                    md->skt_dramReads[skt] + md->skt_dramWrites[skt], md->skt_pmmReads[skt], md->skt_pmmWrites[skt]);
+        }
+    }
+}
+
+/*
+ * Nodes of a tier ordered by how much of their bandwidth is in use, least loaded first, so that migrations
+ * fill the nodes whose channels have headroom (and the socket they belong to) before saturated ones.
+ * Nodes with the same load keep their order, which is the tier order without pcm data.
+ */
+int tier_nodes_by_load(int tier, int *nodes) {
+    int n_nodes = tier_nodes(&tiers, tier, nodes);
+    float cap = (tier == tiers.n_tiers - 1) ? NVRAM_NODE_BW : DRAM_NODE_BW;
+    float load[MAX_TIER_NODES];
+
+    for (int i=0; i < n_nodes; i++) {
+        load[i] = (nodes[i] < MAX_NODES) ? (node_bw[nodes[i]] / cap) : 0;
+    }
+    for (int i=1; i < n_nodes; i++) {
+        int node = nodes[i];
+        float l = load[i];
+        int j = i;
+        for (; (j > 0) && (load[j-1] > l); j--) {
+            nodes[j] = nodes[j-1];
+            load[j] = load[j-1];
+        }
+        nodes[j] = node;
+        load[j] = l;
+    }
+    return n_nodes;
+}
+
+/*
+ * pcm's system totals hide one socket's Optane saturating while the other's is idle, so the NVRAM
+ * triggers are also checked per socket, each socket against its share (1/n_sockets) of the threshold.
+ * Returns the socket most over its share, or -1 if none is (or pcm has a single socket).
+ */
+int pmm_hot_socket(memdata_t *md, float thresh, int writes_only) {
+    int hot = -1;
+    float worst = 1;
+
+    for (int skt=0; (md->n_sockets > 1) && (skt < md->n_sockets); skt++) {
+        float bw = md->skt_pmmWrites[skt] + (writes_only ? 0 : md->skt_pmmReads[skt]);
+        float share = bw * md->n_sockets / thresh;
+        if (share > worst) {
+            worst = share;
+            hot = skt;
+        }
+    }
+    return hot;
+}
+
+// Socket with the most PMM traffic, or -1 with a single socket (latency is only known system-wide)
+int pmm_busiest_socket(memdata_t *md) {
+    int busiest = -1;
+    float max_bw = 0;
+
+    for (int skt=0; (md->n_sockets > 1) && (skt < md->n_sockets); skt++) {
+        float bw = md->skt_pmmReads[skt] + md->skt_pmmWrites[skt];
+        if (bw > max_bw) {
+            max_bw = bw;
+            busiest = skt;
+        }
+    }
+    return busiest;
+}
+
+// Nodes of tier on socket skt, the node mask a FIND is aimed at (0, the whole tier, if skt is -1 or unknown)
+unsigned long long socket_tier_nodes(memdata_t *md, int tier, int skt) {
+    int nodes[MAX_TIER_NODES];
+    int n_nodes = tier_nodes(&tiers, tier, nodes);
+    unsigned long long mask = 0;
+
+    for (int i=0; (skt >= 0) && (i < n_nodes); i++) {
+        if ((nodes[i] < MAX_NODES) && (md->node_socket[nodes[i]] == skt)) {
+            mask |= 1ULL << nodes[i];
+        }
+    }
+    return mask;
+}
+
+// Number of base pages a candidate occupies (THP entries are moved as a whole)
+int candidate_pages(addr_info_t *c) {
+    if (c->huge) {
+        return THP_SIZE / page_size;
+    }
+    return 1;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+MIGRATION RATE LIMITER
+
+-------------------------------------------------------------------------------
+*/
+
+/*
+ * Migrations use the NVRAM bandwidth the application needs. Migrated bytes go through a token bucket
+ * whose rate is set every memcheck round from pcm: the headroom between the application's NVRAM
+ * bandwidth and NVRAM_BW_HEADROOM of NVRAM_BW_MAX, scaled down (halved) whenever IPC while migrating
+ * falls below IPC_DROP of the IPC measured in rounds without migrations.
+ */
+
+double mig_rate = NVRAM_BW_MAX; // MB/s, until pcm says otherwise
+double mig_rate_scale = 1.0; // share of the headroom allowed, cut on IPC drops
+double ipc_base = 0; // application IPC while not migrating
+double mig_tokens = 0; // bytes
+long long mig_moved = 0; // bytes migrated since the last update
+struct timespec mig_refill_ts, mig_update_ts;
+pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Seconds since *ts, which is moved to now
+double elapsed_since(struct timespec *ts) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double s = (now.tv_sec - ts->tv_sec) + (now.tv_nsec - ts->tv_nsec) / 1e9;
+    *ts = now;
+    return s;
+}
+
+// Accounts bytes about to be migrated, sleeping while they exceed the budget
+void mig_rate_take(long long bytes) {
+    double wait = 0;
+
+    pthread_mutex_lock(&rate_lock);
+    mig_moved += bytes;
+    if (rate_act) {
+        double rate = mig_rate * 1000000; // bytes/s
+        mig_tokens = fmin(mig_tokens + elapsed_since(&mig_refill_ts) * rate, rate * MIG_BURST_MS / 1000);
+        mig_tokens -= bytes; // may go negative, later takers wait for the debt too
+        if (mig_tokens < 0) {
+            wait = -mig_tokens / rate;
+        }
+    }
+    pthread_mutex_unlock(&rate_lock);
+
+    if (wait > 0) {
+        usleep(wait * 1000000);
+    }
+}
+
+// New pcm sample: recomputes the rate from the NVRAM headroom and the IPC feedback
+void mig_rate_update(memdata_t *md) {
+    int backoff = 0;
+
+    pthread_mutex_lock(&rate_lock);
+    double interval = elapsed_since(&mig_update_ts);
+    int migrating = (mig_moved > 0);
+    double moved_bw = (interval > 0) ? mig_moved / 1000000.0 / interval : 0;
+    mig_moved = 0;
+
+    // pcm also sees the migrations, only the application's traffic counts against the headroom
+    double app_bw = fmax(md->sys_pmmReads + md->sys_pmmWrites - moved_bw, 0);
+    double headroom = NVRAM_BW_MAX * NVRAM_BW_HEADROOM - app_bw;
+
+    if (md->sys_ipc > 0) {
+        if (!migrating) {
+            ipc_base = (ipc_base > 0) ? ((1 - IPC_EWMA) * ipc_base + IPC_EWMA * md->sys_ipc) : md->sys_ipc;
+        }
+        else if ((ipc_base > 0) && (md->sys_ipc < IPC_DROP * ipc_base)) {
+            mig_rate_scale /= 2;
+            backoff = 1;
+        }
+        else {
+            mig_rate_scale = fmin(mig_rate_scale + MIG_RATE_STEP, 1);
+        }
+    }
+    mig_rate = fmax(mig_rate_scale * headroom, MIG_RATE_MIN);
+    pthread_mutex_unlock(&rate_lock);
+
+    if (backoff) {
+        printf("MEMCHECK: IPC %.2f below %.2f while migrating, migration rate cut to %.0f MB/s.\n",
+                md->sys_ipc, ipc_base, mig_rate);
+    }
+}
+
+// Pages that can be migrated in one memcheck interval at the current rate
+int mig_rate_pages() {
+    if (!rate_act) {
+        return INT_MAX;
+    }
+    return fmin(mig_rate * memcheck_interval / page_size, INT_MAX);
 }
 
 
@@ -212,27 +522,308 @@ MIGRATION FUNCTIONS
 */
 
 
-int do_migration(int mode, int n_found) {
-    void **addr = malloc(sizeof(unsigned long) * n_found);
-    int *dest_nodes = malloc(sizeof(int) * n_found);
-    int *status = malloc(sizeof(int) * n_found);
+/*
+ * Candidates are moved by a pool of workers. Each call is split into shards of consecutive candidates
+ * with the same pid and destination node (at most MIG_SHARD_PAGES), one move_pages call each. Workers
+ * serve a memory node and run on the CPUs closest to it, they take the shards bound to their node
+ * first and help with the others once those are gone.
+ */
+
+typedef struct mig_errs {
+    int n_busy; // EBUSY/EAGAIN: page in use, may succeed later
+    int n_nomem; // ENOMEM: destination node full
+    int n_fault; // EFAULT/ENOENT: address no longer mapped
+    int n_gone; // ESRCH/EPERM/EACCES: process exited or cannot be migrated
+    int n_other;
+} mig_errs_t;
+
+typedef struct mig_shard {
+    int pid;
+    int node; // destination node
+    int start; // first candidate of the shard
+    int n;
+    int taken;
+} mig_shard_t;
+
+typedef struct mig_job {
+    addr_info_t *cands;
+    void **addr;
+    int *dest_nodes;
+    int *status;
+    mig_shard_t *shards;
+    int n_shards;
+    int n_left; // shards not finished yet
+    int n_active; // workers still looking at the job
+    int e_pages; // base pages of failed migrations
+    mig_errs_t errs;
+} mig_job_t;
+
+pthread_t mig_workers[MAX_MIG_WORKERS];
+int mig_worker_node[MAX_MIG_WORKERS];
+int mig_worker_cpu_node[MAX_MIG_WORKERS];
+int n_mig_workers = 0;
+
+mig_job_t *mig_job = NULL;
+unsigned long mig_gen = 0; // bumped for every job handed to the workers
+volatile int mig_stop = 0;
+pthread_mutex_t mig_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mig_job_lock = PTHREAD_MUTEX_INITIALIZER; // one job at a time
+pthread_cond_t mig_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t mig_done_cond = PTHREAD_COND_INITIALIZER;
+
+void mig_count_err(mig_errs_t *errs, int err) {
+    switch (err) {
+        case EBUSY:
+        case EAGAIN:
+            errs->n_busy++;
+            break;
+        case ENOMEM:
+            errs->n_nomem++;
+            break;
+        case EFAULT:
+        case ENOENT:
+            errs->n_fault++;
+            break;
+        case ESRCH:
+        case EPERM:
+        case EACCES:
+            errs->n_gone++;
+            break;
+        default:
+            errs->n_other++;
+    }
+}
+
+int mig_n_errs(mig_errs_t *errs) {
+    return errs->n_busy + errs->n_nomem + errs->n_fault + errs->n_gone + errs->n_other;
+}
 
-    const int *node_list;
-    int n_nodes;
+void mig_add_errs(mig_errs_t *to, mig_errs_t *from) {
+    to->n_busy += from->n_busy;
+    to->n_nomem += from->n_nomem;
+    to->n_fault += from->n_fault;
+    to->n_gone += from->n_gone;
+    to->n_other += from->n_other;
+}
 
-    if (mode == DRAM_MODE) {
-        node_list = NVRAM_NODES;
-        n_nodes = n_nvram_nodes;
+void print_mig_errs(const char *what, mig_errs_t *errs) {
+    if (mig_n_errs(errs) > 0) {
+        printf("%s: %d candidates not migrated: %d busy, %d no memory, %d not mapped, %d process gone, %d other.\n",
+                what, mig_n_errs(errs), errs->n_busy, errs->n_nomem, errs->n_fault, errs->n_gone, errs->n_other);
     }
-    else {
-        node_list = DRAM_NODES;
-        n_nodes = n_dram_nodes;
+}
+
+// Moves one shard, retrying page by page if the whole call did not succeed
+void migrate_shard(mig_job_t *job, mig_shard_t *s) {
+    void **addr = job->addr + s->start;
+    int *nodes = job->dest_nodes + s->start;
+    int *status = job->status + s->start;
+    mig_errs_t errs;
+    int e_pages = 0;
+
+    memset(&errs, 0, sizeof(errs));
+
+    long long bytes = 0;
+    for (int j=0; j < s->n; j++) {
+        bytes += (long long) candidate_pages(&job->cands[s->start + j]) * page_size;
+    }
+    mig_rate_take(bytes);
+
+    if (numa_move_pages(s->pid, (unsigned long) s->n, addr, nodes, status, 0)) {
+        for (int j=0; j < s->n; j++) {
+            if (numa_move_pages(s->pid, 1, addr + j, nodes + j, status + j, 0) < 0) {
+                status[j] = -errno;
+            }
+        }
+    }
+    // Pages that could not be moved report a negative errno, the others their node
+    for (int j=0; j < s->n; j++) {
+        if (status[j] < 0) {
+            mig_count_err(&errs, -status[j]);
+            e_pages += candidate_pages(&job->cands[s->start + j]);
+        }
+    }
+
+    pthread_mutex_lock(&mig_lock);
+    mig_add_errs(&job->errs, &errs);
+    job->e_pages += e_pages;
+    if (--job->n_left == 0) {
+        pthread_cond_broadcast(&mig_done_cond);
+    }
+    pthread_mutex_unlock(&mig_lock);
+}
+
+// Takes shards of the job until none is left, those bound to node first
+void run_shards(mig_job_t *job, int node) {
+    for (int pass=0; pass < 2; pass++) {
+        for (int i=0; i < job->n_shards; i++) {
+            mig_shard_t *s = &job->shards[i];
+            if ((pass == 0) && (s->node != node)) {
+                continue;
+            }
+            if (!__atomic_exchange_n(&s->taken, 1, __ATOMIC_ACQ_REL)) {
+                migrate_shard(job, s);
+            }
+        }
+    }
+}
+
+// Closest node with CPUs (memory-only nodes, e.g. Optane, have none)
+int mig_cpu_node(int node) {
+    struct bitmask *cpus = numa_allocate_cpumask();
+    int best = -1;
+
+    for (int n=0; n <= numa_max_node(); n++) {
+        if ((numa_node_to_cpus(n, cpus) < 0) || (numa_bitmask_weight(cpus) == 0)) {
+            continue;
+        }
+        if ((best < 0) || (numa_distance(node, n) < numa_distance(node, best))) {
+            best = n;
+        }
+    }
+
+    numa_free_cpumask(cpus);
+    return best;
+}
+
+void *mig_worker(void *args) {
+    int node = mig_worker_node[(long) args];
+    int cpu_node = mig_worker_cpu_node[(long) args];
+    unsigned long seen = 0;
+
+    if ((cpu_node >= 0) && numa_run_on_node(cpu_node)) {
+        fprintf(stderr, "Could not pin migration worker to node %d: %s\n", cpu_node, strerror(errno));
+    }
+
+    pthread_mutex_lock(&mig_lock);
+    while (1) {
+        while (!mig_stop && (mig_gen == seen)) {
+            pthread_cond_wait(&mig_cond, &mig_lock);
+        }
+        if (mig_stop) {
+            break;
+        }
+        seen = mig_gen;
+        mig_job_t *job = mig_job;
+        if (job == NULL) {
+            continue; // finished before this worker woke up
+        }
+        job->n_active++;
+        pthread_mutex_unlock(&mig_lock);
+
+        run_shards(job, node);
+
+        pthread_mutex_lock(&mig_lock);
+        if (--job->n_active == 0) {
+            pthread_cond_broadcast(&mig_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&mig_lock);
+    return NULL;
+}
+
+// Spawns MIG_WORKERS_PER_NODE workers for every node with memory
+int start_mig_pool() {
+    for (int node=0; node <= numa_max_node(); node++) {
+        if (numa_node_size64(node, NULL) <= 0) {
+            continue;
+        }
+        for (int i=0; (i < MIG_WORKERS_PER_NODE) && (n_mig_workers < MAX_MIG_WORKERS); i++) {
+            mig_worker_node[n_mig_workers] = node;
+            mig_worker_cpu_node[n_mig_workers] = mig_cpu_node(node); // libnuma lookups are not thread safe
+            if (pthread_create(&mig_workers[n_mig_workers], NULL, mig_worker, (void *) (long) n_mig_workers)) {
+                return 0;
+            }
+            n_mig_workers++;
+        }
+    }
+    return 1;
+}
+
+void stop_mig_pool() {
+    pthread_mutex_lock(&mig_lock);
+    mig_stop = 1;
+    pthread_cond_broadcast(&mig_cond);
+    pthread_mutex_unlock(&mig_lock);
+
+    for (int i=0; i < n_mig_workers; i++) {
+        pthread_join(mig_workers[i], NULL);
+    }
+    n_mig_workers = 0;
+}
+
+/*
+ * Moves addr[i] (candidate cands[i]) to dest_nodes[i] for the first n candidates with the worker pool.
+ * Candidates of a process must be consecutive. Returns the base pages that could not be migrated and
+ * adds the reasons to errs.
+ */
+int migrate_parallel(addr_info_t *cands, void **addr, int *dest_nodes, int n, mig_errs_t *errs) {
+    mig_job_t job;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.cands = cands;
+    job.addr = addr;
+    job.dest_nodes = dest_nodes;
+    job.status = malloc(sizeof(int) * n);
+    job.shards = malloc(sizeof(mig_shard_t) * n);
+
+    for (int i=0; i < n; job.n_shards++) {
+        mig_shard_t *s = &job.shards[job.n_shards];
+        s->pid = cands[i].pid_retval;
+        s->node = dest_nodes[i];
+        s->start = i;
+        s->taken = 0;
+        for (i++; (i < n) && (cands[i].pid_retval == s->pid) && (dest_nodes[i] == s->node)
+                && (i - s->start < MIG_SHARD_PAGES); i++);
+        s->n = i - s->start;
+    }
+    job.n_left = job.n_shards;
+
+    if ((job.n_shards == 1) || (n_mig_workers == 0)) {
+        run_shards(&job, -1);
     }
+    else {
+        pthread_mutex_lock(&mig_job_lock);
+
+        pthread_mutex_lock(&mig_lock);
+        mig_job = &job;
+        mig_gen++;
+        pthread_cond_broadcast(&mig_cond);
+        pthread_mutex_unlock(&mig_lock);
+
+        run_shards(&job, -1); // the caller helps too
 
-    for (int i=0; i< n_found; i++) {
-        status[i] = -123;
+        pthread_mutex_lock(&mig_lock);
+        while ((job.n_left > 0) || (job.n_active > 0)) {
+            pthread_cond_wait(&mig_done_cond, &mig_lock);
+        }
+        mig_job = NULL;
+        pthread_mutex_unlock(&mig_lock);
+
+        pthread_mutex_unlock(&mig_job_lock);
     }
 
+    mig_add_errs(errs, &job.errs);
+    free(job.status);
+    free(job.shards);
+    return job.e_pages;
+}
+
+// Moves the candidates to the nodes of dest_tier, filling them in order
+int do_migration(addr_info_t *candidates, int dest_tier, int n_found) {
+    void **addr = malloc(sizeof(unsigned long) * n_found);
+    int *dest_nodes = malloc(sizeof(int) * n_found);
+    mig_errs_t errs;
+
+    int node_list[MAX_TIER_NODES];
+    int n_nodes = tier_nodes_by_load(dest_tier, node_list);
+
+    memset(&errs, 0, sizeof(errs));
+
     int n_processed = 0;
     for (int i=0; (i < n_nodes) && (n_processed < n_found); i++) {
         int curr_node = node_list[i];
@@ -240,56 +831,48 @@ int do_migration(int mode, int n_found) {
         int n_avail_pages = free_space_pages(curr_node);
 
         int j=0;
-        for (; (j < n_avail_pages) && (n_processed+j < n_found); j++) {
+        for (; (n_processed+j < n_found) && (candidate_pages(&candidates[n_processed+j]) <= n_avail_pages); j++) {
+            n_avail_pages -= candidate_pages(&candidates[n_processed+j]);
             addr[n_processed+j] = (void *) candidates[n_processed+j].addr;
             dest_nodes[n_processed+j] = curr_node;
         }
 
         n_processed += j;
     }
-    int n_migrated, i;
-    int e = 0; // counts failed migrations
-
-    for (n_migrated=0, i=0; n_migrated < n_processed; n_migrated+=i) {
-        int curr_pid;
-        curr_pid=candidates[n_migrated].pid_retval;
+    int n_pages = 0; // base pages processed
 
-        for (i=1; (candidates[n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < n_processed); i++);
-
-        void **addr_displacement = addr + n_migrated;
-        int *dest_nodes_displacement = dest_nodes + n_migrated;
-        if (move_pages(curr_pid, (unsigned long) i, addr_displacement, dest_nodes_displacement, status, 0)) {
-            // Migrate all and output addresses that could not migrate
-            for (int j=0; j < i; j++) {
-                if (move_pages(curr_pid, 1, addr_displacement + j, dest_nodes_displacement + j, status, 0)) {
-                    printf("Error migrating addr: %ld, pid: %d\n", (unsigned long) *(addr_displacement + j), curr_pid);
-                    e++;
-                }
-            }
-        }
+    for (int i=0; i < n_processed; i++) {
+        n_pages += candidate_pages(&candidates[i]);
     }
 
+    int e = migrate_parallel(candidates, addr, dest_nodes, n_processed, &errs); // base pages of failed migrations
+    print_mig_errs("Migration", &errs);
+
     free(addr);
     free(dest_nodes);
-    free(status);
-    return n_migrated - e;
+    return n_pages - e;
 }
 
-int do_switch(int n_found) {
+// Exchanges the candidates of tier (first section) with those of tier-1 (after the separator)
+int do_switch(addr_info_t *candidates, int tier, int n_found) {
+    int upper_nodes[MAX_TIER_NODES], lower_nodes[MAX_TIER_NODES];
+    int n_upper_nodes = tier_nodes_by_load(tier - 1, upper_nodes);
+    int n_lower_nodes = tier_nodes_by_load(tier, lower_nodes);
     void **addr_dram = malloc(sizeof(unsigned long) * n_found);
     int *dest_nodes_dram = malloc(sizeof(int) * n_found);
     void **addr_nvram = malloc(sizeof(unsigned long) * n_found);
     int *dest_nodes_nvram = malloc(sizeof(int) * n_found);
-    int *status = malloc(sizeof(int) * n_found);
+    mig_errs_t dram_errs, nvram_errs;
 
-    for (int i=0; i < n_found; i++) {
-        status[i] = -123;
-    }
+    memset(&dram_errs, 0, sizeof(dram_errs));
+    memset(&nvram_errs, 0, sizeof(nvram_errs));
 
     int dram_migrated = 0;
     int nvram_migrated = 0;
     int dram_e = 0; // counts failed migrations
     int nvram_e = 0; // counts failed migrations
+    int dram_e_pages = 0; // base pages of failed migrations
+    int nvram_e_pages = 0; // base pages of failed migrations
 
     int dram_free = 1;
     int nvram_free = 1;
@@ -299,16 +882,17 @@ int do_switch(int n_found) {
         int old_n_processed = dram_migrated + dram_e;
         int dram_processed = old_n_processed;
 
-        for (int i=0; (i < n_nvram_nodes) && (dram_processed < n_found); i++) {
-            int curr_node = NVRAM_NODES[i];
+        for (int i=0; (i < n_lower_nodes) && (dram_processed < n_found); i++) {
+            int curr_node = lower_nodes[i];
 
             long long node_fr = 0;
             numa_node_size64(curr_node, &node_fr);
             int n_avail_pages = node_fr / page_size;
 
             int j=0;
-            for (; (j < n_avail_pages) && (j+dram_processed < n_found); j++) {
-                addr_dram[dram_processed+j] = (void *) candidates[n_found+1+j].addr;
+            for (; (j+dram_processed < n_found) && (candidate_pages(&candidates[n_found+1+dram_processed+j]) <= n_avail_pages); j++) {
+                n_avail_pages -= candidate_pages(&candidates[n_found+1+dram_processed+j]);
+                addr_dram[dram_processed+j] = (void *) candidates[n_found+1+dram_processed+j].addr;
                 dest_nodes_nvram[dram_processed+j] = curr_node;
             }
 
@@ -316,26 +900,12 @@ int do_switch(int n_found) {
         }
         if (old_n_processed < dram_processed) {
             // Send processed pages to NVRAM
-            int n_migrated, i;
+            int n_errs = mig_n_errs(&dram_errs);
             dram_free = 1;
 
-            for (n_migrated=0, i=0; n_migrated < dram_processed; n_migrated+=i) {
-                int curr_pid;
-                curr_pid = candidates[n_found+1+n_migrated].pid_retval;
-
-                for (i=1; (candidates[n_found+1+n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < dram_processed); i++);
-                void **addr_displacement = addr_dram + n_migrated;
-                int *dest_nodes_displacement = dest_nodes_nvram + n_migrated;
-                if (numa_move_pages(curr_pid, (unsigned long) i, addr_displacement, dest_nodes_displacement, status, 0)) {
-                    // Migrate all and output addresses that could not migrate
-                    for (int j=0; j < i; j++) {
-                        if (numa_move_pages(curr_pid, 1, addr_displacement + j, dest_nodes_displacement + j, status, 0)) {
-                            printf("Error migrating DRAM/MEM addr: %ld, pid: %d\n", (unsigned long) *(addr_displacement + j), curr_pid);
-                            dram_e++;
-                        }
-                    }
-                }
-            }
+            dram_e_pages += migrate_parallel(candidates + n_found + 1 + old_n_processed, addr_dram + old_n_processed,
+                                        dest_nodes_nvram + old_n_processed, dram_processed - old_n_processed, &dram_errs);
+            dram_e += mig_n_errs(&dram_errs) - n_errs;
         }
         else {
             dram_free = 0;
@@ -347,15 +917,16 @@ int do_switch(int n_found) {
         old_n_processed = nvram_migrated + nvram_e;
         int nvram_processed = old_n_processed;
 
-        for (int i=0; (i < n_dram_nodes) && (nvram_processed < n_found); i++) {
-            int curr_node = DRAM_NODES[i];
+        for (int i=0; (i < n_upper_nodes) && (nvram_processed < n_found); i++) {
+            int curr_node = upper_nodes[i];
 
             long long node_fr = 0;
             numa_node_size64(curr_node, &node_fr);
             int n_avail_pages = node_fr / page_size;
 
             int j=0;
-            for (; (j < n_avail_pages) && (j+nvram_processed < n_found); j++) {
+            for (; (j+nvram_processed < n_found) && (candidate_pages(&candidates[nvram_processed+j]) <= n_avail_pages); j++) {
+                n_avail_pages -= candidate_pages(&candidates[nvram_processed+j]);
                 addr_nvram[nvram_processed+j] = (void *) candidates[nvram_processed+j].addr;
                 dest_nodes_dram[nvram_processed+j] = curr_node;
             }
@@ -365,26 +936,12 @@ int do_switch(int n_found) {
 
         if (old_n_processed < nvram_processed) {
             // Send processed pages to DRAM
-            int n_migrated, i;
+            int n_errs = mig_n_errs(&nvram_errs);
             nvram_free = 1;
 
-            for (n_migrated=0, i=0; n_migrated < nvram_processed; n_migrated+=i) {
-                int curr_pid;
-                curr_pid=candidates[n_migrated].pid_retval;
-
-                for (i=1; (candidates[n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < nvram_processed); i++);
-                void **addr_displacement = addr_nvram + n_migrated;
-                int *dest_nodes_displacement = dest_nodes_dram + n_migrated;
-                if (numa_move_pages(curr_pid, (unsigned long) i, addr_displacement, dest_nodes_displacement, status, 0)) {
-                    // Migrate all and output addresses that could not migrate
-                    for (int j=0; j < i; j++) {
-                        if (numa_move_pages(curr_pid, 1, addr_displacement + j, dest_nodes_displacement + j, status, 0)) {
-                            printf("Error migrating NVRAM addr: %ld, pid: %d\n", (unsigned long) *(addr_displacement + j), curr_pid);
-                            nvram_e++;
-                        }
-                    }
-                }
-            }
+            nvram_e_pages += migrate_parallel(candidates + old_n_processed, addr_nvram + old_n_processed,
+                                        dest_nodes_dram + old_n_processed, nvram_processed - old_n_processed, &nvram_errs);
+            nvram_e += mig_n_errs(&nvram_errs) - n_errs;
         }
         else {
             nvram_free = 0;
@@ -397,9 +954,18 @@ int do_switch(int n_found) {
     free(addr_nvram);
     free(dest_nodes_dram);
     free(dest_nodes_nvram);
-    free(status);
+    print_mig_errs("Switch (demotion)", &dram_errs);
+    print_mig_errs("Switch (promotion)", &nvram_errs);
 
-    return dram_migrated + nvram_migrated;
+    int n_pages = 0; // base pages processed
+    for (int i=0; i < dram_migrated + dram_e; i++) {
+        n_pages += candidate_pages(&candidates[n_found+1+i]);
+    }
+    for (int i=0; i < nvram_migrated + nvram_e; i++) {
+        n_pages += candidate_pages(&candidates[i]);
+    }
+
+    return n_pages - dram_e_pages - nvram_e_pages;
 }
 
 
@@ -407,43 +973,1233 @@ int do_switch(int n_found) {
 /*
 -------------------------------------------------------------------------------
 
-REQUEST PROCESSING FUNCTIONS
+PAGEMAP BACKEND
 
 -------------------------------------------------------------------------------
 */
 
 
-int send_req(req_t req, addr_info_t **out) {
+/*
+ * Finds candidates without the kernel module, on stock kernels (run as root): page residency comes from
+ * /proc/<pid>/pagemap (PFN, mapped to its node through the memory block layout in sysfs), accesses from
+ * the page_idle bitmap and writes from the soft-dirty bit. Every scanned page is marked idle again, so a
+ * FIND sees the accesses made since the previous one. Pagemap entries are read PAGEMAP_BATCH at a time
+ * and the idle bitmap IDLE_BLOCK_WORDS words at a time, each block at most once per FIND.
+ */
+
+#define PM_PRESENT (1ULL << 63)
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PM_PFN_MASK ((1ULL << 55) - 1)
+#define IDLE_BLOCK_PFNS (IDLE_BLOCK_WORDS * 64UL)
+
+#define PM_SKIP 0
+#define PM_FOUND 1
+#define PM_BACKUP 2
+
+int *pm_pids; // bound processes (pagemap, BPF and DAMON backends), protected by comm_lock
+unsigned long *pm_cursor; // address the next pagemap scan of each bound process resumes from
+int n_pm_pids = 0;
+int max_pm_pids = 0;
+
+addr_info_t *pm_slots[RING_SLOTS]; // FIND replies, as in the module's ring slots (room for a full switch)
+addr_info_t *pm_backup;
+uint64_t *pm_buf; // pagemap batch
+
+int idle_fd = -1;
+unsigned long block_pages; // pages per memory block
+long n_mem_blocks = 0;
+int *block_node; // node of each memory block (-1 if offline)
+unsigned long long pm_find_nodes = 0; // nodes the current FIND is restricted to (0 for the whole tier), under comm_lock
+signed char *block_tier; // tier of each memory block (-1 if not managed)
+
+long n_idle_blocks = 0;
+uint64_t **idle_bits; // idle bitmap blocks read during the current FIND
+uint64_t **idle_marks; // pages to mark idle again at the end of the FIND
+long *idle_words; // words of each block read during the current FIND (-1 if not read yet)
+
+// Unbinds the process at index i of pm_pids, the last one takes its place. Caller holds comm_lock.
+static void pm_remove(int i) {
+    n_pm_pids--;
+    pm_pids[i] = pm_pids[n_pm_pids];
+    pm_cursor[i] = pm_cursor[n_pm_pids];
+}
 
-    pthread_mutex_lock(&comm_lock);
+// Builds the memory block -> node table from /sys/devices/system/node/node*/memory*
+int pm_load_nodes() {
+    FILE *f = fopen("/sys/devices/system/memory/block_size_bytes", "r");
+    unsigned long block_size = 0;
+    char path[64];
 
-    memset(NLMSG_DATA(nlmh_out), 0, MAX_PAYLOAD);
-    memcpy(NLMSG_DATA(nlmh_out), &req, sizeof(req));
-    sendmsg(netlink_fd, &msg_out, 0);
+    if ((f == NULL) || (fscanf(f, "%lx", &block_size) != 1) || (block_size < (unsigned long) page_size)) {
+        fprintf(stderr, "Error reading memory block size.\n");
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 0;
+    }
+    fclose(f);
+    block_pages = block_size / page_size;
+
+    for (int node=0; node <= numa_max_node(); node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+        DIR *dir = opendir(path);
+        struct dirent *ent;
+        if (dir == NULL) {
+            continue;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            long block;
+            if ((sscanf(ent->d_name, "memory%ld", &block) != 1) || (block < 0)) {
+                continue;
+            }
+            if (block >= n_mem_blocks) {
+                long new_n = (block + 1) * 2;
+                block_node = realloc(block_node, sizeof(int) * new_n);
+                for (long b = n_mem_blocks; b < new_n; b++) {
+                    block_node[b] = -1;
+                }
+                n_mem_blocks = new_n;
+            }
+            block_node[block] = node;
+        }
+        closedir(dir);
+    }
 
-    //configure_netlink_inbound();
-    memset(buffer, 0, buf_size);
-    int len = recvmsg(netlink_fd, &msg_in, 0);
+    if (n_mem_blocks == 0) {
+        fprintf(stderr, "Error reading memory block layout.\n");
+        return 0;
+    }
+    block_tier = malloc(n_mem_blocks);
+
+    n_idle_blocks = (n_mem_blocks * block_pages + IDLE_BLOCK_PFNS - 1) / IDLE_BLOCK_PFNS;
+    idle_bits = calloc(n_idle_blocks, sizeof(uint64_t *));
+    idle_marks = calloc(n_idle_blocks, sizeof(uint64_t *));
+    idle_words = malloc(sizeof(long) * n_idle_blocks);
+    for (long b=0; b < n_idle_blocks; b++) {
+        idle_words[b] = -1;
+    }
+    return 1;
+}
 
-    addr_info_t *curr_pointer = *out;
-    int i = 0;
-    struct nlmsghdr * curr_nlmh;
-    for (curr_nlmh = (struct nlmsghdr *) buffer; NLMSG_OK(curr_nlmh, len); curr_nlmh = NLMSG_NEXT(curr_nlmh, len)) {
-        if (curr_nlmh->nlmsg_type == NLMSG_ERROR) {
-            pthread_mutex_unlock(&comm_lock);
-            return 0;
+void pm_update_tiers() {
+    for (long b=0; b < n_mem_blocks; b++) {
+        block_tier[b] = -1;
+        for (int t=0; (block_node[b] >= 0) && (t < tiers.n_tiers); t++) {
+            if (tiers.nodes[t] & (1ULL << block_node[b])) {
+                block_tier[b] = t;
+            }
         }
-        int payload_len = NLMSG_PAYLOAD(curr_nlmh, 0);
-        memcpy(curr_pointer, (addr_info_t *) NLMSG_DATA(curr_nlmh), payload_len);
-        curr_pointer += payload_len/sizeof(addr_info_t);
-        i++;
+    }
+}
+
+// Page is on tier, and on one of the nodes of pm_find_nodes if any
+static inline int pm_pfn_wanted(unsigned long pfn, int tier) {
+    unsigned long b = pfn / block_pages;
+
+    if ((b >= (unsigned long) n_mem_blocks) || (block_tier[b] != tier)) {
+        return 0;
+    }
+    return (pm_find_nodes == 0) || (pm_find_nodes & (1ULL << block_node[b]));
+}
+
+/*
+ * Idle bit of a page, reading its bitmap block on first use during a FIND. Returns -1 if the bit could
+ * not be read (failed or short read, e.g. past the last pfn), in which case the page is skipped.
+ */
+static inline int pm_idle(unsigned long pfn) {
+    unsigned long b = pfn / IDLE_BLOCK_PFNS;
+    unsigned long w = (pfn % IDLE_BLOCK_PFNS) / 64;
+
+    if (idle_words[b] < 0) {
+        if (idle_bits[b] == NULL) {
+            idle_bits[b] = malloc(IDLE_BLOCK_WORDS * sizeof(uint64_t));
+            idle_marks[b] = malloc(IDLE_BLOCK_WORDS * sizeof(uint64_t));
+        }
+        memset(idle_marks[b], 0, IDLE_BLOCK_WORDS * sizeof(uint64_t));
+        ssize_t rd = pread(idle_fd, idle_bits[b], IDLE_BLOCK_WORDS * sizeof(uint64_t), b * IDLE_BLOCK_WORDS * sizeof(uint64_t));
+        idle_words[b] = (rd > 0) ? (rd / sizeof(uint64_t)) : 0;
+    }
+    if (w >= (unsigned long) idle_words[b]) {
+        return -1;
+    }
+    return (idle_bits[b][w] >> (pfn % 64)) & 1;
+}
+
+// Caller already read the idle bit of pfn (pm_idle() did not fail)
+static inline void pm_mark_idle(unsigned long pfn) {
+    idle_marks[pfn / IDLE_BLOCK_PFNS][(pfn % IDLE_BLOCK_PFNS) / 64] |= 1ULL << (pfn % 64);
+}
+
+// Writes the idle marks of the blocks used by the last FIND (set bits mark pages idle, others are left alone)
+void pm_flush_idle() {
+    for (long b=0; b < n_idle_blocks; b++) {
+        if (idle_words[b] > 0) {
+            size_t len = idle_words[b] * sizeof(uint64_t);
+            if (pwrite(idle_fd, idle_marks[b], len, b * IDLE_BLOCK_WORDS * sizeof(uint64_t)) != (ssize_t) len) {
+                fprintf(stderr, "Error marking pages idle: %s\n", strerror(errno));
+            }
+        }
+        idle_words[b] = -1;
+    }
+}
+
+// Clears the soft-dirty bits of a process, so that the next scan sees the pages written since
+void pm_clear_soft_dirty(int pid) {
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+    int fd = open(path, O_WRONLY);
+    if (fd != -1) {
+        if (write(fd, "4", 1) != 1) {
+            fprintf(stderr, "Error clearing soft-dirty bits (pid=%d): %s\n", pid, strerror(errno));
+        }
+        close(fd);
+    }
+}
+
+// Same choices as the module's selection functions, from a single sample of the accessed and dirty bits
+static inline int pm_select(int mode, int young, int dirty) {
+    switch (mode) {
+        case DRAM_MODE:
+            return !young ? PM_FOUND : (!dirty ? PM_BACKUP : PM_SKIP);
+        case NVRAM_MODE:
+            return (young && dirty) ? PM_FOUND : PM_BACKUP;
+        case NVRAM_INTENSIVE_MODE:
+        case SWITCH_MODE:
+            return (young && dirty) ? PM_FOUND : (young ? PM_BACKUP : PM_SKIP);
+        case NVRAM_WRITE_MODE:
+            return (young && dirty) ? PM_FOUND : (dirty ? PM_BACKUP : PM_SKIP);
+    }
+    return PM_SKIP;
+}
+
+// Adds a page to out or pm_backup depending on what pm_select() chose
+static inline void pm_add(int sel, unsigned long addr, int pid, addr_info_t *out, int n, int *n_out, int *n_backup) {
+    if (sel == PM_FOUND) {
+        out[*n_out].addr = addr;
+        out[*n_out].pid_retval = pid;
+        out[(*n_out)++].huge = 0;
+    }
+    else if ((sel == PM_BACKUP) && (*n_backup < (n - *n_out))) {
+        pm_backup[*n_backup].addr = addr;
+        pm_backup[*n_backup].pid_retval = pid;
+        pm_backup[(*n_backup)++].huge = 0;
+    }
+}
+
+/*
+ * Scans the writable mappings of a bound process for pages on tier, adding them to out/pm_backup as
+ * pm_select() decides (NVRAM_CLEAR only marks them idle). Stops once out holds n entries, and the next
+ * scan resumes from *cursor (back to the lowest address once the end is reached), so that the whole
+ * address space is covered across FINDs. Returns 0 if the process is gone.
+ */
+int pm_scan(int pid, unsigned long *cursor, int tier, int mode, addr_info_t *out, int n, int *n_out, int *n_backup) {
+    char path[64], line[256], perms[8];
+    unsigned long start, end;
+    unsigned long next = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+    int fd = open(path, O_RDONLY);
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *maps = fopen(path, "r");
+    if ((fd == -1) || (maps == NULL)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (maps != NULL) {
+            fclose(maps);
+        }
+        return 0;
+    }
+
+    while (((mode == NVRAM_CLEAR) || (*n_out < n)) && (fgets(line, sizeof(line), maps) != NULL)) {
+        if ((sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3) || (perms[1] != 'w')) {
+            continue;
+        }
+        if (mode != NVRAM_CLEAR) {
+            if (end <= *cursor) {
+                continue;
+            }
+            start = (start > *cursor) ? start : *cursor;
+        }
+
+        for (unsigned long addr = start; (addr < end) && ((mode == NVRAM_CLEAR) || (*n_out < n)); addr += PAGEMAP_BATCH * page_size) {
+            unsigned long n_pages = fmin(PAGEMAP_BATCH, (end - addr) / page_size);
+            ssize_t rd = pread(fd, pm_buf, n_pages * sizeof(uint64_t), (addr / page_size) * sizeof(uint64_t));
+            if (rd <= 0) {
+                break;
+            }
+            n_pages = rd / sizeof(uint64_t);
+
+            for (unsigned long i=0; i < n_pages; i++) {
+                uint64_t e = pm_buf[i];
+                unsigned long pfn = e & PM_PFN_MASK;
+
+                if (!(e & PM_PRESENT) || (pfn == 0) || !pm_pfn_wanted(pfn, tier)) {
+                    continue;
+                }
+
+                int idle = pm_idle(pfn);
+                if (idle < 0) {
+                    continue;
+                }
+                pm_mark_idle(pfn);
+                if (mode == NVRAM_CLEAR) {
+                    continue;
+                }
+
+                pm_add(pm_select(mode, !idle, (e & PM_SOFT_DIRTY) != 0), addr + i * page_size, pid, out, n, n_out, n_backup);
+                if (*n_out == n) {
+                    next = addr + (i + 1) * page_size;
+                    break;
+                }
+            }
+        }
+    }
+
+    fclose(maps);
+    close(fd);
+    if (mode == NVRAM_CLEAR) {
+        pm_clear_soft_dirty(pid);
+    }
+    else {
+        *cursor = next;
+    }
+    return 1;
+}
+
+// Collects up to n candidates of tier from all bound processes (backups fill what is left), followed by an end entry
+int pm_collect(int tier, int mode, int n, addr_info_t *out) {
+    int n_out = 0, n_backup = 0;
+
+    for (int i=0; (i < n_pm_pids) && ((n_out < n) || (mode == NVRAM_CLEAR)); i++) {
+        if (!pm_scan(pm_pids[i], &pm_cursor[i], tier, mode, out, n, &n_out, &n_backup)) {
+            printf("Unbinding exited process (pid=%d).\n", pm_pids[i]);
+            pm_remove(i--);
+        }
+    }
+    pm_flush_idle();
+
+    for (int i=0; (i < n_backup) && (n_out < n); i++) {
+        out[n_out++] = pm_backup[i];
+    }
+    out[n_out].pid_retval = 0;
+    return n_out;
+}
+
+int pm_bind(int pid) {
+    int ret = 0;
+
+    if ((kill(pid, 0) == -1) && (errno == ESRCH)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&comm_lock);
+    int i;
+    for (i=0; (i < n_pm_pids) && (pm_pids[i] != pid); i++);
+    if (i < n_pm_pids) {
+        printf("Already managing given PID.\n");
+    }
+    else if ((MAX_PIDS == 0) || (n_pm_pids < MAX_PIDS)) {
+        if (n_pm_pids == max_pm_pids) {
+            max_pm_pids = max_pm_pids ? (2 * max_pm_pids) : 16;
+            pm_pids = realloc(pm_pids, sizeof(int) * max_pm_pids);
+            pm_cursor = realloc(pm_cursor, sizeof(unsigned long) * max_pm_pids);
+        }
+        pm_cursor[n_pm_pids] = 0;
+        pm_pids[n_pm_pids++] = pid;
+        if (backend == BACKEND_PAGEMAP) {
+            pm_clear_soft_dirty(pid);
+        }
+        ret = 1;
+    }
+    pthread_mutex_unlock(&comm_lock);
+    return ret;
+}
+
+int pm_unbind(int pid) {
+    int ret = 0;
+
+    pthread_mutex_lock(&comm_lock);
+    for (int i=0; i < n_pm_pids; i++) {
+        if (pm_pids[i] == pid) {
+            pm_remove(i);
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&comm_lock);
+    return ret;
+}
+
+int pm_open(const char *tier_list) {
+    if ((idle_fd = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR)) == -1) {
+        fprintf(stderr, "Could not open page_idle bitmap: %s\nThe pagemap backend needs root and CONFIG_IDLE_PAGE_TRACKING.\n", strerror(errno));
+        return 0;
+    }
+    if (parse_tiers((tier_list != NULL) ? tier_list : DEFAULT_TIERS, &tiers)) {
+        fprintf(stderr, "Invalid tier topology.\n");
+        close(idle_fd);
+        return 0;
+    }
+    if (!pm_load_nodes()) {
+        close(idle_fd);
+        return 0;
+    }
+    pm_update_tiers();
+
+    for (int i=0; i < RING_SLOTS; i++) {
+        pm_slots[i] = malloc(sizeof(addr_info_t) * RING_SLOT_ENTRIES);
+    }
+    pm_backup = malloc(sizeof(addr_info_t) * MAX_N_FIND);
+    pm_buf = malloc(sizeof(uint64_t) * PAGEMAP_BATCH);
+    return 1;
+}
+
+void pm_close() {
+    for (long b=0; b < n_idle_blocks; b++) {
+        free(idle_bits[b]);
+        free(idle_marks[b]);
+    }
+    free(idle_bits);
+    free(idle_marks);
+    free(idle_words);
+    free(block_node);
+    free(block_tier);
+    for (int i=0; i < RING_SLOTS; i++) {
+        free(pm_slots[i]);
+    }
+    free(pm_backup);
+    free(pm_buf);
+    free(pm_pids);
+    free(pm_cursor);
+    close(idle_fd);
+}
+
+
+
+#ifdef AMBIX_BPF
+/*
+-------------------------------------------------------------------------------
+
+BPF BACKEND
+
+-------------------------------------------------------------------------------
+*/
+
+
+/*
+ * Finds candidates from the user page faults counted by the BPF collector (ambix-bpf.bpf.c), for hosts
+ * where the module cannot be loaded. A page is young if it faulted since the last FIND and dirty if one
+ * of those faults was a write (NUMA balancing hinting faults make accessed pages fault regularly). The
+ * fault map is read BPF_LOOKUP_BATCH entries per syscall and the node of the pages is queried with one
+ * move_pages() call per process and batch. Only pages that faulted while their process was bound are
+ * known, so demotion candidates are the known pages that stopped faulting.
+ */
+
+struct bpf_object *bf_obj;
+struct bpf_link *bf_link;
+int bf_pids_fd, bf_epoch_fd, bf_heat_fd;
+__u32 bf_epoch = 1;
+int bf_kernel_promotes = 0; // NUMA balancing migrates faulting pages itself, see bf_check_numa_balancing()
+
+page_key_t *bf_keys; // last lookup batch
+page_heat_t *bf_vals;
+int *bf_order; // batch entries sorted by pid
+void **bf_addrs;
+int *bf_status;
+
+int bf_bind(int pid) {
+    __u32 key = pid;
+    __u8 one = 1;
+
+    if (bpf_map_update_elem(bf_pids_fd, &key, &one, BPF_ANY)) {
+        fprintf(stderr, "Error adding pid %d to the BPF collector: %s\n", pid, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+void bf_unbind(int pid) {
+    __u32 key = pid;
+
+    bpf_map_delete_elem(bf_pids_fd, &key);
+}
+
+void bf_next_epoch() {
+    __u32 zero = 0;
+
+    bf_epoch++;
+    bpf_map_update_elem(bf_epoch_fd, &zero, &bf_epoch, BPF_ANY);
+}
+
+int node_tier(int node) {
+    for (int t=0; t < tiers.n_tiers; t++) {
+        if (tiers.nodes[t] & (1ULL << node)) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+static int cmp_key_pid(const void *a, const void *b) {
+    return (int) bf_keys[*(const int *) a].pid - (int) bf_keys[*(const int *) b].pid;
+}
+
+// Classifies the pages of the last lookup batch that are on tier. Caller holds comm_lock.
+void bf_classify(int count, int tier, int mode, addr_info_t *out, int n, int *n_out, int *n_backup) {
+    int i, j, k;
+
+    for (i=0; i < count; i++) {
+        bf_order[i] = i;
+    }
+    qsort(bf_order, count, sizeof(int), cmp_key_pid);
+
+    for (i=0; (i < count) && (*n_out < n); i = j) {
+        int pid = bf_keys[bf_order[i]].pid;
+        int p;
+
+        for (j=i; (j < count) && (bf_keys[bf_order[j]].pid == pid); j++) {
+            bf_addrs[j-i] = (void *) bf_keys[bf_order[j]].addr;
+        }
+
+        for (p=0; (p < n_pm_pids) && (pm_pids[p] != pid); p++);
+        if (p == n_pm_pids) {
+            continue; // unbound since these faults
+        }
+        if (numa_move_pages(pid, j - i, bf_addrs, NULL, bf_status, 0)) {
+            if (errno == ESRCH) {
+                printf("Unbinding exited process (pid=%d).\n", pid);
+                bf_unbind(pid);
+                pm_remove(p);
+            }
+            continue;
+        }
+
+        for (k=i; (k < j) && (*n_out < n); k++) {
+            page_heat_t *heat = &bf_vals[bf_order[k]];
+
+            // status is the page's node, or negative if it is not present anymore
+            if ((bf_status[k-i] < 0) || (node_tier(bf_status[k-i]) != tier)
+                    || (pm_find_nodes && !(pm_find_nodes & (1ULL << bf_status[k-i])))) {
+                continue;
+            }
+            pm_add(pm_select(mode, heat->epoch == bf_epoch, heat->write_epoch == bf_epoch),
+                    (unsigned long) bf_addrs[k-i], pid, out, n, n_out, n_backup);
+        }
+    }
+}
+
+/*
+ * The hinting faults the collector relies on come from NUMA balancing, which also moves the faulting
+ * page to the node of the faulting CPU (kernel.numa_balancing=1) or promotes it out of CPU-less nodes
+ * (=2). Promoting as well would make ctl and the kernel fight over the same pages, so promotions are
+ * left to the kernel and ctl only demotes: a demoted page only comes back if it is accessed again.
+ * With =2 alone, pages of nodes with CPUs take no hinting faults and look cold to the collector.
+ */
+void bf_check_numa_balancing() {
+    FILE *f = fopen("/proc/sys/kernel/numa_balancing", "r");
+    int mode = 0;
+
+    if ((f == NULL) || (fscanf(f, "%d", &mode) != 1)) {
+        mode = 0;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    bf_kernel_promotes = (mode != 0);
+    if (mode == 0) {
+        fprintf(stderr, "Warning: NUMA balancing is disabled, pages only fault on first touch and will look cold "
+                        "(sysctl kernel.numa_balancing=1).\n");
+    }
+    else {
+        printf("NUMA balancing migrates faulting pages itself: promotions are left to the kernel, ctl only demotes.\n");
+        if (!(mode & 1)) {
+            fprintf(stderr, "Warning: kernel.numa_balancing=%d does not scan nodes with CPUs, their pages will look "
+                            "cold (set it to 1 or 3).\n", mode);
+        }
+    }
+}
+
+// Collects up to n candidates of tier from the fault map (backups fill what is left), followed by an end entry
+int bf_collect(int tier, int mode, int n, addr_info_t *out) {
+    __u32 batch_in, batch_out, count;
+    int n_out = 0, n_backup = 0;
+    int first = 1;
+    int ret;
+
+    // The kernel promotes the pages that fault, the hot half of switches included
+    if (bf_kernel_promotes && (mode != DRAM_MODE) && (mode != NVRAM_CLEAR)) {
+        out[0].pid_retval = 0;
+        return 0;
+    }
+
+    // Clearing only needs a new epoch, started by send_local_find()
+    while ((mode != NVRAM_CLEAR) && (n_out < n)) {
+        count = BPF_LOOKUP_BATCH;
+        ret = bpf_map_lookup_batch(bf_heat_fd, first ? NULL : &batch_in, &batch_out, bf_keys, bf_vals, &count, NULL);
+        if (ret && (errno != ENOENT)) {
+            fprintf(stderr, "Error reading BPF fault map: %s\n", strerror(errno));
+            break;
+        }
+        bf_classify(count, tier, mode, out, n, &n_out, &n_backup);
+        if (ret) {
+            break; // ENOENT: that was the last batch
+        }
+        batch_in = batch_out;
+        first = 0;
+    }
+
+    for (int i=0; (i < n_backup) && (n_out < n); i++) {
+        out[n_out++] = pm_backup[i];
+    }
+    out[n_out].pid_retval = 0;
+    return n_out;
+}
+
+int bf_open(const char *tier_list) {
+    struct bpf_program *prog;
+    __u32 zero = 0;
+
+    if (parse_tiers((tier_list != NULL) ? tier_list : DEFAULT_TIERS, &tiers)) {
+        fprintf(stderr, "Invalid tier topology.\n");
+        return 0;
+    }
+
+    bf_obj = bpf_object__open_file(BPF_OBJ_FILE, NULL);
+    if ((bf_obj == NULL) || libbpf_get_error(bf_obj)) {
+        fprintf(stderr, "Could not open %s.\n", BPF_OBJ_FILE);
+        return 0;
+    }
+    if (bpf_object__load(bf_obj)) {
+        fprintf(stderr, "Could not load %s: %s\nThe BPF backend needs root.\n", BPF_OBJ_FILE, strerror(errno));
+        bpf_object__close(bf_obj);
+        return 0;
+    }
+    prog = bpf_object__find_program_by_name(bf_obj, "ambix_page_fault");
+    bf_link = (prog != NULL) ? bpf_program__attach(prog) : NULL;
+    if ((bf_link == NULL) || libbpf_get_error(bf_link)) {
+        fprintf(stderr, "Could not attach the BPF page fault collector.\n");
+        bpf_object__close(bf_obj);
+        return 0;
+    }
+
+    bf_pids_fd = bpf_object__find_map_fd_by_name(bf_obj, "bound_pids");
+    bf_epoch_fd = bpf_object__find_map_fd_by_name(bf_obj, "epoch");
+    bf_heat_fd = bpf_object__find_map_fd_by_name(bf_obj, "page_heat");
+    bpf_map_update_elem(bf_epoch_fd, &zero, &bf_epoch, BPF_ANY);
+    bf_check_numa_balancing();
+
+    bf_keys = malloc(sizeof(page_key_t) * BPF_LOOKUP_BATCH);
+    bf_vals = malloc(sizeof(page_heat_t) * BPF_LOOKUP_BATCH);
+    bf_order = malloc(sizeof(int) * BPF_LOOKUP_BATCH);
+    bf_addrs = malloc(sizeof(void *) * BPF_LOOKUP_BATCH);
+    bf_status = malloc(sizeof(int) * BPF_LOOKUP_BATCH);
+    for (int i=0; i < RING_SLOTS; i++) {
+        pm_slots[i] = malloc(sizeof(addr_info_t) * RING_SLOT_ENTRIES);
+    }
+    pm_backup = malloc(sizeof(addr_info_t) * MAX_N_FIND);
+    return 1;
+}
+
+void bf_close() {
+    bpf_link__destroy(bf_link);
+    bpf_object__close(bf_obj);
+    free(bf_keys);
+    free(bf_vals);
+    free(bf_order);
+    free(bf_addrs);
+    free(bf_status);
+    for (int i=0; i < RING_SLOTS; i++) {
+        free(pm_slots[i]);
+    }
+    free(pm_backup);
+    free(pm_pids);
+    free(pm_cursor);
+}
+#endif
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+DAMON BACKEND
+
+-------------------------------------------------------------------------------
+*/
+
+
+/*
+ * Leaves monitoring and migration to DAMON (Linux 6.16+, the first to migrate vaddr targets), driven
+ * through its sysfs interface. One kdamond monitors the bound processes (a vaddr target each) in at most
+ * DAMON_MAX_REGIONS regions, and FIND requests arm DAMOS schemes instead of returning candidates. There
+ * is a migrate_cold scheme demoting to the slower tier and a migrate_hot one promoting to the faster
+ * tier. Arming a scheme sets its action and a quota of the requested pages per memcheck interval;
+ * schemes that memcheck_placement() stops asking for go back to the stat action. Migrated pages are read
+ * back from the scheme stats.
+ * DAMOS cannot restrict a vaddr scheme to the pages of a node, so schemes also match regions that are
+ * already on their destination tier: only two tiers are supported (a third one would be pulled into the
+ * middle one), and each quota is scaled by how much of what the scheme tried it actually migrated.
+ */
+
+#define DAMON_CTX DAMON_SYSFS "/0/contexts/0"
+#define DAMON_MAX_SZ "18446744073709551615"
+#define DAMON_MAX_ATTR "4294967295"
+
+// Scheme of each FIND: demoting from tier t is scheme 2t, promoting from tier t is scheme 2t-1
+#define DAMON_DEMOTE(t) (2 * (t))
+#define DAMON_PROMOTE(t) (2 * (t) - 1)
+
+#define DAMON_DISARMED 0
+#define DAMON_ARMED 1
+#define DAMON_STALE 2 // armed before the current memcheck round, disarmed at its end unless armed again
+
+int n_damon_schemes = 0;
+int damon_armed[2 * MAX_TIERS];
+unsigned long long damon_applied[2 * MAX_TIERS]; // sz_applied at the last read
+unsigned long long damon_tried[2 * MAX_TIERS]; // sz_tried at the last read
+double damon_scale[2 * MAX_TIERS]; // quota per requested byte, sz_tried/sz_applied of the last interval
+
+static int damon_vwrite(const char *val, const char *fmt, va_list ap) {
+    char path[256];
+
+    vsnprintf(path, sizeof(path), fmt, ap);
+    int fd = open(path, O_WRONLY);
+    if ((fd == -1) || (write(fd, val, strlen(val)) != (ssize_t) strlen(val))) {
+        fprintf(stderr, "Error writing %s to %s: %s\n", val, path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+int damon_write(const char *val, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int ret = damon_vwrite(val, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int damon_write_num(unsigned long long val, const char *fmt, ...) {
+    char str[32];
+    va_list ap;
+
+    snprintf(str, sizeof(str), "%llu", val);
+    va_start(ap, fmt);
+    int ret = damon_vwrite(str, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+unsigned long long damon_read(const char *fmt, ...) {
+    unsigned long long val = 0;
+    char path[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(path, sizeof(path), fmt, ap);
+    va_end(ap);
+
+    FILE *f = fopen(path, "r");
+    if ((f == NULL) || (fscanf(f, "%llu", &val) != 1)) {
+        fprintf(stderr, "Error reading %s.\n", path);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    return val;
+}
+
+int damon_running() {
+    char state[8] = "";
+    FILE *f = fopen(DAMON_SYSFS "/0/state", "r");
+
+    if (f != NULL) {
+        if (fgets(state, sizeof(state), f) == NULL) {
+            state[0] = '\0';
+        }
+        fclose(f);
+    }
+    return !strcmp(state, "on\n");
+}
+
+// Applies the sysfs tree to the kdamond, starting it if there is something to monitor
+int damon_commit() {
+    if (damon_running()) {
+        return damon_write("commit", DAMON_SYSFS "/0/state");
+    }
+    if (n_pm_pids == 0) {
+        return 1;
+    }
+    return damon_write("on", DAMON_SYSFS "/0/state");
+}
+
+// Makes the DAMON targets the bound processes that are still alive. Caller holds comm_lock.
+int damon_sync_targets() {
+    for (int i=0; i < n_pm_pids; i++) {
+        if ((kill(pm_pids[i], 0) == -1) && (errno == ESRCH)) {
+            printf("Unbinding exited process (pid=%d).\n", pm_pids[i]);
+            pm_remove(i--);
+        }
+    }
+
+    if (!damon_write_num(n_pm_pids, DAMON_CTX "/targets/nr_targets")) {
+        return 0;
+    }
+    for (int i=0; i < n_pm_pids; i++) {
+        if (!damon_write_num(pm_pids[i], DAMON_CTX "/targets/%d/pid_target", i)) {
+            return 0;
+        }
+    }
+
+    if ((n_pm_pids == 0) && damon_running()) {
+        return damon_write("off", DAMON_SYSFS "/0/state");
+    }
+    return damon_commit();
+}
+
+// Sets up an idle scheme (stat action): promotion schemes match hot regions, demotion schemes cold ones
+int damon_setup_scheme(int i) {
+    int hot = i % 2;
+
+    return damon_write("stat", DAMON_CTX "/schemes/%d/action", i)
+        && damon_write_num(page_size, DAMON_CTX "/schemes/%d/access_pattern/sz/min", i)
+        && damon_write(DAMON_MAX_SZ, DAMON_CTX "/schemes/%d/access_pattern/sz/max", i)
+        && damon_write_num(hot ? DAMON_HOT_ACCESSES : 0, DAMON_CTX "/schemes/%d/access_pattern/nr_accesses/min", i)
+        && damon_write(hot ? DAMON_MAX_ATTR : "0", DAMON_CTX "/schemes/%d/access_pattern/nr_accesses/max", i)
+        && damon_write_num(hot ? 0 : DAMON_COLD_AGE, DAMON_CTX "/schemes/%d/access_pattern/age/min", i)
+        && damon_write(DAMON_MAX_ATTR, DAMON_CTX "/schemes/%d/access_pattern/age/max", i)
+        && damon_write_num(memcheck_interval / 1000, DAMON_CTX "/schemes/%d/quotas/reset_interval_ms", i)
+        && damon_write("none", DAMON_CTX "/schemes/%d/watermarks/metric", i);
+}
+
+// One demotion and one promotion scheme per pair of adjacent tiers. Caller holds comm_lock.
+int damon_set_schemes() {
+    n_damon_schemes = 2 * (tiers.n_tiers - 1);
+    if (!damon_write_num(n_damon_schemes, DAMON_CTX "/schemes/nr_schemes")) {
+        return 0;
+    }
+    for (int i=0; i < n_damon_schemes; i++) {
+        damon_armed[i] = DAMON_DISARMED;
+        damon_applied[i] = 0;
+        damon_tried[i] = 0;
+        damon_scale[i] = 1;
+        if (!damon_setup_scheme(i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Lets scheme i migrate up to n_pages per memcheck interval (a zero quota would mean no limit)
+int damon_arm(int i, int n_pages) {
+    int tier = (i + 1) / 2;
+    int dest = (i % 2) ? tier - 1 : tier + 1;
+    int nodes[MAX_TIER_NODES];
+
+    if (n_pages <= 0) {
+        return 1;
+    }
+    tier_nodes_by_load(dest, nodes); // DAMON takes a single node, the least loaded one
+    damon_armed[i] = DAMON_ARMED;
+    return damon_write_num(nodes[0], DAMON_CTX "/schemes/%d/target_nid", i)
+        && damon_write_num((unsigned long long) (n_pages * damon_scale[i]) * page_size, DAMON_CTX "/schemes/%d/quotas/bytes", i)
+        && damon_write((i % 2) ? "migrate_hot" : "migrate_cold", DAMON_CTX "/schemes/%d/action", i);
+}
+
+/*
+ * Pages migrated by scheme i since the last call. The quota is charged for every region tried, those
+ * already on the destination node included, so the next quota is scaled by tried/applied (at most
+ * DAMON_MAX_QUOTA_SCALE times the request). Caller has updated the scheme stats.
+ */
+int damon_applied_pages(int i) {
+    unsigned long long applied = damon_read(DAMON_CTX "/schemes/%d/stats/sz_applied", i);
+    unsigned long long tried = damon_read(DAMON_CTX "/schemes/%d/stats/sz_tried", i);
+    unsigned long long delta = (applied >= damon_applied[i]) ? applied - damon_applied[i] : applied;
+    unsigned long long tried_delta = (tried >= damon_tried[i]) ? tried - damon_tried[i] : tried;
+
+    // While disarmed the stat action tries regions without migrating them
+    if ((damon_armed[i] != DAMON_DISARMED) && (tried_delta > 0)) {
+        damon_scale[i] = (delta > 0) ? fmin((double) tried_delta / delta, DAMON_MAX_QUOTA_SCALE) : DAMON_MAX_QUOTA_SCALE;
+    }
+    damon_applied[i] = applied;
+    damon_tried[i] = tried;
+    return delta / page_size;
+}
+
+// FIND request for the DAMON backend: arms the scheme(s) of the request and returns the pages they
+// migrated since the previous request (schemes apply their quota asynchronously)
+int damon_find(req_t req) {
+    int n = fmin(req.pid_n, MAX_N_FIND);
+    int n_migrated = 0;
+
+    if (req.mode == NVRAM_CLEAR) {
+        return 0; // DAMON resets access counts every aggregation interval
+    }
+
+    pthread_mutex_lock(&comm_lock);
+    if (!damon_running()) {
+        damon_sync_targets(); // a kdamond stops once all its targets have exited
+    }
+    if (damon_running()) {
+        damon_write("update_schemes_stats", DAMON_SYSFS "/0/state");
+    }
+
+    switch (req.mode) {
+        case DRAM_MODE:
+            n_migrated = damon_applied_pages(DAMON_DEMOTE(req.tier));
+            damon_arm(DAMON_DEMOTE(req.tier), n);
+            break;
+        case NVRAM_MODE:
+        case NVRAM_INTENSIVE_MODE:
+        case NVRAM_WRITE_MODE:
+            n_migrated = damon_applied_pages(DAMON_PROMOTE(req.tier));
+            damon_arm(DAMON_PROMOTE(req.tier), n);
+            break;
+        case SWITCH_MODE:
+            n = fmin(n, MAX_N_SWITCH);
+            n_migrated = damon_applied_pages(DAMON_PROMOTE(req.tier)) + damon_applied_pages(DAMON_DEMOTE(req.tier - 1));
+            damon_arm(DAMON_PROMOTE(req.tier), n);
+            damon_arm(DAMON_DEMOTE(req.tier - 1), n);
+            break;
+    }
+    damon_commit();
+
+    pthread_mutex_unlock(&comm_lock);
+    return n_migrated;
+}
+
+// memcheck_placement() brackets its rounds with these, so a scheme only runs while the round keeps arming it
+void damon_begin_round() {
+    pthread_mutex_lock(&comm_lock);
+    for (int i=0; i < n_damon_schemes; i++) {
+        if (damon_armed[i] == DAMON_ARMED) {
+            damon_armed[i] = DAMON_STALE;
+        }
+    }
+    pthread_mutex_unlock(&comm_lock);
+}
+
+void damon_end_round() {
+    int changed = 0;
+
+    pthread_mutex_lock(&comm_lock);
+    for (int i=0; i < n_damon_schemes; i++) {
+        if (damon_armed[i] == DAMON_STALE) {
+            damon_armed[i] = DAMON_DISARMED;
+            changed |= damon_write("stat", DAMON_CTX "/schemes/%d/action", i);
+        }
+    }
+    if (changed) {
+        damon_commit();
+    }
+    pthread_mutex_unlock(&comm_lock);
+}
+
+void damon_print_stats() {
+    pthread_mutex_lock(&comm_lock);
+    if (!damon_running()) {
+        printf("DAMON is not running (no bound processes).\n");
+        pthread_mutex_unlock(&comm_lock);
+        return;
+    }
+    damon_write("update_schemes_stats", DAMON_SYSFS "/0/state");
+    for (int i=0; i < n_damon_schemes; i++) {
+        int tier = (i + 1) / 2;
+        int dest = (i % 2) ? tier - 1 : tier + 1;
+
+        printf("Tier %d->%d (%s): tried %llu regions (%llu MB), applied %llu regions (%llu MB), quota exceeded %llu times\n",
+                tier, dest, (damon_armed[i] != DAMON_DISARMED) ? "armed" : "idle",
+                damon_read(DAMON_CTX "/schemes/%d/stats/nr_tried", i),
+                damon_read(DAMON_CTX "/schemes/%d/stats/sz_tried", i) >> 20,
+                damon_read(DAMON_CTX "/schemes/%d/stats/nr_applied", i),
+                damon_read(DAMON_CTX "/schemes/%d/stats/sz_applied", i) >> 20,
+                damon_read(DAMON_CTX "/schemes/%d/stats/qt_exceeds", i));
+    }
+    pthread_mutex_unlock(&comm_lock);
+}
+
+// vaddr schemes only migrate from Linux 6.16 on, earlier kernels accept them but do nothing
+void damon_check_kernel() {
+    struct utsname un;
+    int major = 0, minor = 0;
+
+    if ((uname(&un) == 0) && (sscanf(un.release, "%d.%d", &major, &minor) == 2)
+            && ((major < 6) || ((major == 6) && (minor < 16)))) {
+        fprintf(stderr, "Warning: Linux %d.%d cannot migrate the pages of DAMON vaddr targets (6.16 or later needed).\n",
+                major, minor);
+    }
+}
+
+int damon_open(const char *tier_list) {
+    if (parse_tiers((tier_list != NULL) ? tier_list : DEFAULT_TIERS, &tiers)) {
+        fprintf(stderr, "Invalid tier topology.\n");
+        return 0;
+    }
+    if (tiers.n_tiers > 2) {
+        fprintf(stderr, "The DAMON backend supports two tiers only.\n");
+        return 0;
+    }
+    damon_check_kernel();
+    if (access(DAMON_SYSFS "/nr_kdamonds", W_OK)) {
+        fprintf(stderr, "Could not access DAMON sysfs: %s\nThe DAMON backend needs root and CONFIG_DAMON_SYSFS.\n", strerror(errno));
+        return 0;
+    }
+    if (damon_read(DAMON_SYSFS "/nr_kdamonds") && damon_running()) {
+        fprintf(stderr, "DAMON is already in use, stop its kdamonds first.\n");
+        return 0;
+    }
+
+    if (!damon_write("1", DAMON_SYSFS "/nr_kdamonds")
+            || !damon_write("1", DAMON_SYSFS "/0/contexts/nr_contexts")
+            || !damon_write("vaddr", DAMON_CTX "/operations")
+            || !damon_write_num(DAMON_SAMPLE_US, DAMON_CTX "/monitoring_attrs/intervals/sample_us")
+            || !damon_write_num(DAMON_AGGR_US, DAMON_CTX "/monitoring_attrs/intervals/aggr_us")
+            || !damon_write_num(DAMON_UPDATE_US, DAMON_CTX "/monitoring_attrs/intervals/update_us")
+            || !damon_write_num(DAMON_MIN_REGIONS, DAMON_CTX "/monitoring_attrs/nr_regions/min")
+            || !damon_write_num(DAMON_MAX_REGIONS, DAMON_CTX "/monitoring_attrs/nr_regions/max")
+            || !damon_write("0", DAMON_CTX "/targets/nr_targets")
+            || !damon_set_schemes()) {
+        damon_write("0", DAMON_SYSFS "/nr_kdamonds");
+        return 0;
+    }
+    return 1;
+}
+
+void damon_close() {
+    if (damon_running()) {
+        damon_write("off", DAMON_SYSFS "/0/state");
+    }
+    damon_write("0", DAMON_SYSFS "/nr_kdamonds");
+    free(pm_pids);
+    free(pm_cursor);
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+REQUEST PROCESSING FUNCTIONS
+
+-------------------------------------------------------------------------------
+*/
+
+
+int send_req(req_t req, addr_info_t **out) {
+
+    pthread_mutex_lock(&comm_lock);
+
+    memset(NLMSG_DATA(nlmh_out), 0, MAX_PAYLOAD);
+    memcpy(NLMSG_DATA(nlmh_out), &req, sizeof(req));
+    sendmsg(netlink_fd, &msg_out, 0);
+
+    //configure_netlink_inbound();
+    memset(buffer, 0, buf_size);
+    int len = recvmsg(netlink_fd, &msg_in, 0);
+
+    addr_info_t *curr_pointer = *out;
+    int i = 0;
+    struct nlmsghdr * curr_nlmh;
+    for (curr_nlmh = (struct nlmsghdr *) buffer; NLMSG_OK(curr_nlmh, len); curr_nlmh = NLMSG_NEXT(curr_nlmh, len)) {
+        if (curr_nlmh->nlmsg_type == NLMSG_ERROR) {
+            pthread_mutex_unlock(&comm_lock);
+            return 0;
+        }
+        int payload_len = NLMSG_PAYLOAD(curr_nlmh, 0);
+        memcpy(curr_pointer, (addr_info_t *) NLMSG_DATA(curr_nlmh), payload_len);
+        curr_pointer += payload_len/sizeof(addr_info_t);
+        i++;
+
+    }
+    pthread_mutex_unlock(&comm_lock);
+    return 1;
+}
+
+// FIND requests skip netlink: the module writes the reply directly into a slot of the mmap'd ring
+int send_ring_find(req_t req, addr_info_t **out, unsigned long *ring_end) {
+    pthread_mutex_lock(&comm_lock);
+
+    if (ioctl(ring_fd, AMBIX_IOC_FIND, &req) < 0) {
+        fprintf(stderr, "Error in FIND request: %s\n", strerror(errno));
+        pthread_mutex_unlock(&comm_lock);
+        return 0;
+    }
+    *ring_end = __atomic_load_n(&ring_hdr->head, __ATOMIC_ACQUIRE);
+    *out = ring_entries + ring_hdr->batch_start;
+
+    pthread_mutex_unlock(&comm_lock);
+    return 1;
+}
+
+// Hands the slot of a processed reply (and of any earlier one) back to the module
+void release_ring(unsigned long ring_end) {
+    __atomic_store_n(&ring_hdr->tail, ring_end, __ATOMIC_RELEASE);
+}
+
+// FIND and migrate inside the module, only statistics come back
+int send_kernel_migrate(req_t req) {
+    migrate_req_t mreq;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.req = req;
+
+    pthread_mutex_lock(&comm_lock);
+    if (ioctl(ring_fd, AMBIX_IOC_MIGRATE, &mreq) < 0) {
+        fprintf(stderr, "Error in MIGRATE request: %s\n", strerror(errno));
+        pthread_mutex_unlock(&comm_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&comm_lock);
+
+    migrate_stats_t *st = &mreq.stats;
+    if (st->n_not_present || st->n_isolate_failed || st->n_nomem || st->n_failed) {
+        printf("Kernel migration: %d pages migrated, failed: %d not present, %d not isolated, %d no memory, %d busy.\n",
+                st->n_migrated, st->n_not_present, st->n_isolate_failed, st->n_nomem, st->n_failed);
+    }
+
+    return st->n_migrated;
+}
+
+int load_tiers() {
+    if (ioctl(ring_fd, AMBIX_IOC_GET_TIERS, &tiers) < 0) {
+        fprintf(stderr, "Error reading tier topology: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+int send_tiers(tier_cfg_t *cfg) {
+    pthread_mutex_lock(&placement_lock);
+    if (backend != BACKEND_MODULE) {
+        int nodes[MAX_TIER_NODES];
+        for (int t=0; t < cfg->n_tiers; t++) {
+            int n_nodes = tier_nodes(cfg, t, nodes);
+            for (int i=0; i < n_nodes; i++) {
+                if (numa_node_size64(nodes[i], NULL) <= 0) {
+                    fprintf(stderr, "Error setting tier topology: node %d has no memory.\n", nodes[i]);
+                    pthread_mutex_unlock(&placement_lock);
+                    return 0;
+                }
+            }
+        }
+        if ((backend == BACKEND_DAMON) && (cfg->n_tiers > 2)) {
+            fprintf(stderr, "Error setting tier topology: the DAMON backend supports two tiers only.\n");
+            pthread_mutex_unlock(&placement_lock);
+            return 0;
+        }
+        tiers = *cfg;
+        pm_update_tiers();
+        if (backend == BACKEND_DAMON) {
+            pthread_mutex_lock(&comm_lock);
+            if (damon_set_schemes()) {
+                damon_commit();
+            }
+            pthread_mutex_unlock(&comm_lock);
+        }
+        pthread_mutex_unlock(&placement_lock);
+        return 1;
+    }
+    if (ioctl(ring_fd, AMBIX_IOC_SET_TIERS, cfg) < 0) {
+        fprintf(stderr, "Error setting tier topology: %s\n", strerror(errno));
+        pthread_mutex_unlock(&placement_lock);
+        return 0;
+    }
+    tiers = *cfg;
+    pthread_mutex_unlock(&placement_lock);
+    return 1;
+}
+
+void print_tiers() {
+    int nodes[MAX_TIER_NODES];
+
+    for (int t=0; t < tiers.n_tiers; t++) {
+        int n_nodes = tier_nodes(&tiers, t, nodes);
+        printf("Tier %d: nodes", t);
+        for (int i=0; i < n_nodes; i++) {
+            printf(" %d", nodes[i]);
+        }
+        printf("\n");
+    }
+}
+
+// cgroup requests go through the candidate ring device, netlink requests cannot carry a path
+int send_cgroup_req(unsigned long cmd, cgroup_req_t *creq) {
+    if (backend != BACKEND_MODULE) {
+        fprintf(stderr, "cgroup requests need the kernel module backend.\n");
+        return 0;
+    }
+
+    pthread_mutex_lock(&comm_lock);
+    if (ioctl(ring_fd, cmd, creq) < 0) {
+        fprintf(stderr, "Error in cgroup request (%s): %s\n", creq->path, strerror(errno));
+        pthread_mutex_unlock(&comm_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&comm_lock);
+    return 1;
+}
+
+int send_bind_cgroup(const char *path) {
+    cgroup_req_t creq;
+
+    memset(&creq, 0, sizeof(creq));
+    snprintf(creq.path, CGROUP_PATH_MAX, "%s", path);
+    return send_cgroup_req(AMBIX_IOC_BIND_CGROUP, &creq);
+}
+
+int send_unbind_cgroup(const char *path) {
+    cgroup_req_t creq;
+
+    memset(&creq, 0, sizeof(creq));
+    snprintf(creq.path, CGROUP_PATH_MAX, "%s", path);
+    return send_cgroup_req(AMBIX_IOC_UNBIND_CGROUP, &creq);
+}
+
+void print_cgroup_stats(const char *path) {
+    cgroup_req_t creq;
+
+    memset(&creq, 0, sizeof(creq));
+    snprintf(creq.path, CGROUP_PATH_MAX, "%s", path);
+    if (!send_cgroup_req(AMBIX_IOC_CGROUP_STATS, &creq)) {
+        return;
+    }
 
+    printf("cgroup %s: %d bound processes\n", creq.path, creq.n_procs);
+    if (creq.n_walked < creq.n_procs) {
+        printf("\tScan budget ran out, only %d of them fully counted\n", creq.n_walked);
+    }
+    for (int t=0; t < tiers.n_tiers; t++) {
+        printf("\tTier %d: %lu MB\n", t, creq.tier_pages[t] * page_size / (1024 * 1024));
     }
-    pthread_mutex_unlock(&comm_lock);
-    return 1;
 }
 
 int send_bind(int pid) {
+#ifdef AMBIX_BPF
+    if (backend == BACKEND_BPF) {
+        return pm_bind(pid) && bf_bind(pid);
+    }
+#endif
+    if (backend == BACKEND_PAGEMAP) {
+        return pm_bind(pid);
+    }
+    if (backend == BACKEND_DAMON) {
+        if (!pm_bind(pid)) {
+            return 0;
+        }
+        pthread_mutex_lock(&comm_lock);
+        int ret = damon_sync_targets();
+        pthread_mutex_unlock(&comm_lock);
+        return ret;
+    }
+
     req_t req;
     addr_info_t *op_retval = malloc(sizeof(addr_info_t));
 
@@ -460,6 +2216,24 @@ int send_bind(int pid) {
 }
 
 int send_unbind(int pid) {
+#ifdef AMBIX_BPF
+    if (backend == BACKEND_BPF) {
+        bf_unbind(pid);
+    }
+#endif
+    if (backend == BACKEND_DAMON) {
+        if (!pm_unbind(pid)) {
+            return 0;
+        }
+        pthread_mutex_lock(&comm_lock);
+        damon_sync_targets();
+        pthread_mutex_unlock(&comm_lock);
+        return 1;
+    }
+    if (backend != BACKEND_MODULE) {
+        return pm_unbind(pid);
+    }
+
     req_t req;
     addr_info_t *op_retval = malloc(sizeof(addr_info_t));
 
@@ -475,36 +2249,289 @@ int send_unbind(int pid) {
     return 0;
 }
 
-int send_find(int n_pages, int mode) {
-    req_t req;
+// Tier checks of the module's FIND, for requests served in ctl
+int check_find_tier(req_t req) {
+    if (((req.mode == DRAM_MODE) && (req.tier >= tiers.n_tiers - 1)) || ((req.mode != DRAM_MODE) && (req.mode != NVRAM_CLEAR) && (req.tier <= 0))
+            || (req.tier < 0) || (req.tier >= tiers.n_tiers)) {
+        fprintf(stderr, "Error in FIND request: invalid tier %d for this mode.\n", req.tier);
+        return 0;
+    }
+    return 1;
+}
 
-    req.op_code = FIND_OP;
-    req.pid_n = n_pages;
-    req.mode = mode;
+// FIND request served in ctl (pagemap or BPF backend), written to out in the layout of the module's replies
+int send_local_find(req_t req, addr_info_t *out) {
+    int (*collect)(int tier, int mode, int n, addr_info_t *out) = pm_collect;
+    int n = req.pid_n;
 
-    send_req(req, &candidates);
+#ifdef AMBIX_BPF
+    if (backend == BACKEND_BPF) {
+        collect = bf_collect;
+    }
+#endif
 
-    int n_found=-1;
+    if (!check_find_tier(req)) {
+        return 0;
+    }
 
-    while (candidates[++n_found].pid_retval > 0);
+    pthread_mutex_lock(&comm_lock);
 
-    if (n_found == 0) {
-        return 0;
+    if (req.mode == SWITCH_MODE) {
+        // Hot pages of tier, separator, then as many cold pages of the tier above
+        n = fmin(n, MAX_N_SWITCH);
+        pm_find_nodes = req.nodes;
+        int n_hot = collect(req.tier, SWITCH_MODE, n, out);
+        pm_find_nodes = 0;
+        int n_cold = collect(req.tier - 1, DRAM_MODE, n_hot, out + n_hot + 1);
+        if (n_cold < n_hot) {
+            memmove(out + n_cold + 1, out + n_hot + 1, sizeof(addr_info_t) * n_cold);
+            out[n_cold].pid_retval = 0;
+            out[2 * n_cold + 1].pid_retval = 0;
+        }
     }
-    switch (mode) {
-        case DRAM_MODE:
-            return do_migration(DRAM_MODE, n_found);
-            break;
-        case NVRAM_MODE:
-        case NVRAM_INTENSIVE_MODE:
-        case NVRAM_WRITE_MODE:
-            return do_migration(NVRAM_MODE, n_found);
+    else {
+        pm_find_nodes = req.nodes;
+        collect(req.tier, req.mode, fmin(n, MAX_N_FIND), out);
+        pm_find_nodes = 0;
+    }
+
+#ifdef AMBIX_BPF
+    if (backend == BACKEND_BPF) {
+        bf_next_epoch();
+    }
+#endif
+
+    pthread_mutex_unlock(&comm_lock);
+    return 1;
+}
+
+/*
+-------------------------------------------------------------------------------
+
+FIND PIPELINE
+
+-------------------------------------------------------------------------------
+*/
+
+/*
+ * FIND requests are queued and served by two threads: the scan thread sends each FIND and the migration
+ * thread migrates its candidates, so the walk for one batch overlaps the migration of the previous one.
+ * At most RING_SLOTS replies are in flight, one per slot of the candidate ring (or of pm_slots for the
+ * local backends); a slot is handed back once its candidates are migrated. Requests are served in
+ * submission order and identified by their position in it.
+ */
+
+typedef struct find_job {
+    unsigned long id;
+    req_t req;
+    unsigned long group; // id of the first batch of a split request
+    addr_info_t *cands; // FIND reply, NULL when the backend migrated the pages itself
+    unsigned long ring_end; // ring position to release once migrated
+    int n_found;
+    int n_migrated;
+    int pending; // submitted and n_migrated not read yet, the entry cannot be reused
+} find_job_t;
+
+find_job_t pl_jobs[PIPELINE_QUEUE];
+unsigned long pl_submitted = 0; // ids handed out
+unsigned long pl_scanned = 0; // jobs whose FIND was sent
+unsigned long pl_done = 0; // jobs migrated
+unsigned long pl_short_group = ULONG_MAX; // group whose last scanned batch came back short
+volatile int pl_stop = 0;
+
+pthread_t scan_thread, migrate_thread;
+pthread_mutex_t pl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pl_cond = PTHREAD_COND_INITIALIZER;
+
+void scan_job(find_job_t *job) {
+    job->cands = NULL;
+    job->n_found = 0;
+    job->n_migrated = 0;
+
+    if (job->group == pl_short_group) {
+        return; // an earlier batch already took every candidate there was
+    }
+
+    if (backend == BACKEND_DAMON) {
+        job->n_migrated = check_find_tier(job->req) ? damon_find(job->req) : 0; // DAMON migrates the pages itself
+        return;
+    }
+    else if (backend != BACKEND_MODULE) {
+        addr_info_t *slot = pm_slots[job->id % RING_SLOTS];
+        if (!send_local_find(job->req, slot)) {
+            return;
+        }
+        job->cands = slot;
+    }
+    else if (kmig_act && (job->req.mode != NVRAM_CLEAR)) {
+        job->n_migrated = send_kernel_migrate(job->req);
+        mig_rate_take((long long) job->n_migrated * page_size); // already moved, delays the next FIND instead
+        return;
+    }
+    else if (!send_ring_find(job->req, &job->cands, &job->ring_end)) {
+        return;
+    }
+
+    while (job->cands[job->n_found].pid_retval > 0) {
+        job->n_found++;
+    }
+    if ((job->req.mode != SWITCH_MODE) && (job->n_found < job->req.pid_n)) {
+        pl_short_group = job->group;
+    }
+}
+
+void migrate_job(find_job_t *job) {
+    int tier = job->req.tier;
+
+    if (job->n_found > 0) {
+        switch (job->req.mode) {
+            case DRAM_MODE:
+                job->n_migrated = do_migration(job->cands, tier + 1, job->n_found);
+                break;
+            case NVRAM_MODE:
+            case NVRAM_INTENSIVE_MODE:
+            case NVRAM_WRITE_MODE:
+                job->n_migrated = do_migration(job->cands, tier - 1, job->n_found);
+                break;
+            case SWITCH_MODE:
+                job->n_migrated = do_switch(job->cands, tier, job->n_found);
+                break;
+        }
+    }
+
+    if ((backend == BACKEND_MODULE) && (job->cands != NULL)) {
+        release_ring(job->ring_end);
+    }
+}
+
+void *scan_pipeline(void *args) {
+    pthread_mutex_lock(&pl_lock);
+    while (1) {
+        while (!pl_stop && ((pl_scanned == pl_submitted) || (pl_scanned - pl_done >= RING_SLOTS))) {
+            pthread_cond_wait(&pl_cond, &pl_lock);
+        }
+        if (pl_stop) {
             break;
-        case SWITCH_MODE:
-            return do_switch(n_found);
+        }
+        find_job_t *job = &pl_jobs[pl_scanned % PIPELINE_QUEUE];
+        pthread_mutex_unlock(&pl_lock);
+
+        scan_job(job);
+
+        pthread_mutex_lock(&pl_lock);
+        pl_scanned++;
+        pthread_cond_broadcast(&pl_cond);
+    }
+    pthread_mutex_unlock(&pl_lock);
+    return NULL;
+}
+
+void *migrate_pipeline(void *args) {
+    pthread_mutex_lock(&pl_lock);
+    while (1) {
+        while (!pl_stop && (pl_done == pl_scanned)) {
+            pthread_cond_wait(&pl_cond, &pl_lock);
+        }
+        if (pl_stop) {
             break;
+        }
+        find_job_t *job = &pl_jobs[pl_done % PIPELINE_QUEUE];
+        pthread_mutex_unlock(&pl_lock);
+
+        migrate_job(job);
+
+        pthread_mutex_lock(&pl_lock);
+        pl_done++;
+        pthread_cond_broadcast(&pl_cond);
     }
-    return 0;
+    pthread_mutex_unlock(&pl_lock);
+    return NULL;
+}
+
+void stop_pipeline() {
+    pthread_mutex_lock(&pl_lock);
+    pl_stop = 1;
+    pthread_cond_broadcast(&pl_cond);
+    pthread_mutex_unlock(&pl_lock);
+
+    pthread_join(scan_thread, NULL);
+    pthread_join(migrate_thread, NULL);
+}
+
+// Queues a FIND request and returns its id, waits while the queue is full
+unsigned long submit_find(int n_pages, int mode, int tier, unsigned long long nodes, unsigned long group) {
+    pthread_mutex_lock(&pl_lock);
+    while (!pl_stop && pl_jobs[pl_submitted % PIPELINE_QUEUE].pending) {
+        pthread_cond_wait(&pl_cond, &pl_lock);
+    }
+    unsigned long id = pl_submitted;
+    find_job_t *job = &pl_jobs[id % PIPELINE_QUEUE];
+
+    memset(job, 0, sizeof(*job));
+    job->id = id;
+    job->req.op_code = FIND_OP;
+    job->req.pid_n = n_pages;
+    job->req.mode = mode;
+    job->req.tier = tier;
+    job->req.nodes = nodes;
+    job->group = (group == ULONG_MAX) ? id : group;
+
+    if (!pl_stop) {
+        job->pending = 1;
+        pl_submitted++;
+        pthread_cond_broadcast(&pl_cond);
+    }
+    pthread_mutex_unlock(&pl_lock);
+    return id;
+}
+
+// Waits for request id to be migrated and returns the pages it moved
+int wait_find(unsigned long id) {
+    int n_migrated = 0;
+
+    pthread_mutex_lock(&pl_lock);
+    while (!pl_stop && (pl_done <= id)) {
+        pthread_cond_wait(&pl_cond, &pl_lock);
+    }
+    if (pl_done > id) {
+        n_migrated = pl_jobs[id % PIPELINE_QUEUE].n_migrated;
+        pl_jobs[id % PIPELINE_QUEUE].pending = 0;
+        pthread_cond_broadcast(&pl_cond);
+    }
+    pthread_mutex_unlock(&pl_lock);
+    return n_migrated;
+}
+
+int send_find(int n_pages, int mode, int tier) {
+    return wait_find(submit_find(n_pages, mode, tier, 0, ULONG_MAX));
+}
+
+/*
+ * Splits a FIND of n_pages (on nodes of the tier, if not 0) into up to MAX_FIND_BATCHES batches that go through the pipeline back to back,
+ * so that the next batch is walked while the previous one is migrated. Batches hold an even share of the
+ * request, at least MIN_FIND_BATCH and at most MAX_N_FIND pages. Only the module keeps walk cursors
+ * between FINDs, the other backends would return the same pages for every batch and get a single request.
+ */
+int send_find_batches(int n_pages, int mode, int tier, unsigned long long nodes) {
+    unsigned long ids[MAX_FIND_BATCHES];
+    int n_batches = 0;
+    int n_migrated = 0;
+    int batch;
+
+    if ((backend != BACKEND_MODULE) || (n_pages < 2 * MIN_FIND_BATCH)) {
+        return wait_find(submit_find(fmin(n_pages, MAX_N_FIND), mode, tier, nodes, ULONG_MAX));
+    }
+
+    n_pages = fmin(n_pages, MAX_FIND_BATCHES * MAX_N_FIND);
+    batch = fmin(fmax((n_pages + MAX_FIND_BATCHES - 1) / MAX_FIND_BATCHES, MIN_FIND_BATCH), MAX_N_FIND);
+    for (int left = n_pages; (left > 0) && (n_batches < MAX_FIND_BATCHES); left -= batch) {
+        ids[n_batches] = submit_find(fmin(left, batch), mode, tier, nodes, n_batches ? ids[0] : ULONG_MAX);
+        n_batches++;
+    }
+    for (int i=0; i < n_batches; i++) {
+        n_migrated += wait_find(ids[i]);
+    }
+    return n_migrated;
 }
 
 
@@ -518,66 +2545,156 @@ PLACEMENT FUNCTIONS
 */
 
 
+// The slowest tier keeps the NVRAM thresholds, every faster tier uses the DRAM ones
+float tier_target(int tier) {
+    return (tier == tiers.n_tiers - 1) ? NVRAM_TARGET : DRAM_TARGET;
+}
+
+float tier_limit(int tier) {
+    return (tier == tiers.n_tiers - 1) ? NVRAM_LIMIT : DRAM_LIMIT;
+}
+
 void *memcheck_placement(void *args) {
-    long long dram_sz = 0;
-    long long nvram_sz = 0;
-    float dram_usage;
-    float nvram_usage;
+    long long tier_sz[MAX_TIERS];
+    float usage[MAX_TIERS];
     int n_pages;
-    time_t prev_memdata_lmod = 0;
+    uint64_t prev_sample = 0;
+    pcm_sample_t sample;
+    pcm_summary_t summary;
 
     while (!exit_sig) {
         int n_migrated = 0;
         int switch_migrated = 0;
+        int write_migrated = 0;
         int thresh_migrated = 0;
+        int nvram_cleared = 0;
         int sleep_interval = memcheck_interval;
+        int last = tiers.n_tiers - 1; // NVRAM tier, the one pcm reports bandwidth for
 
-        if (thresh_act || switch_act) {
-            dram_usage = free_space_tot_per(DRAM_MODE, &dram_sz);
-            nvram_usage = free_space_tot_per(NVRAM_MODE, &nvram_sz);
-            printf("Current DRAM Usage: %0.2f%%\n", dram_usage * 100);
-            printf("Current NVRAM Usage: %0.2f%%\n", nvram_usage * 100);
+        if (backend == BACKEND_DAMON) {
+            damon_begin_round();
         }
 
-        if (switch_act) {
-            time_t memdata_lmod = get_memdata_mtime();
-            if (memdata_lmod == 0 || (memdata_lmod == prev_memdata_lmod)) {
+        if (thresh_act || switch_act || write_act) {
+            for (int t=0; t <= last; t++) {
+                usage[t] = free_space_tot_per(t, &tier_sz[t]);
+                printf("Current Tier %d Usage: %0.2f%%\n", t, usage[t] * 100);
+            }
+        }
+
+        // Write and switch components: move write-hot NVRAM pages to the tier right above it and trade the
+        // hot ones for its cold pages, driven by pcm NVRAM bandwidth (which also sets the migration rate)
+        if (switch_act || write_act || rate_act) {
+            if (!read_pcm_sample(&sample, &summary) || (sample.no == prev_sample)) {
                 printf("MEMCHECK: Old or invalid memdata values. Ignoring...\n");
             }
             else {
-                prev_memdata_lmod = memdata_lmod;
-                memdata_t *md = read_memdata();
+                prev_sample = sample.no;
+                memdata_t *md = &sample.md;
+                int smoothed = (summary.no >= sample.no) && (summary.n_window > 1);
+
+                // pcm samples faster than memcheck runs: check sooner, and act on the smoothed bandwidth
+                if ((backend != BACKEND_DAMON) && (sample.interval_ns < (uint64_t) PCM_DELAY * 1000000000)) {
+                    memcheck_interval = fmax(MEMCHECK_FAST_INTERVAL * 1000, sample.interval_ns / 1000);
+                }
+                else {
+                    memcheck_interval = MEMCHECK_INTERVAL * 1000;
+                }
+                if (smoothed) {
+                    md->sys_dramReads = summary.stat[PCM_DRAM_READS].ewma;
+                    md->sys_dramWrites = summary.stat[PCM_DRAM_WRITES].ewma;
+                    md->sys_pmmReads = summary.stat[PCM_PMM_READS].ewma;
+                    md->sys_pmmWrites = summary.stat[PCM_PMM_WRITES].ewma;
+                    md->sys_pmmAppBW = summary.stat[PCM_PMM_APP_BW].ewma;
+                }
+
                 if (!check_memdata(md)) {
                     printf("MEMCHECK: Unexpected memdata values.\n");
                 }
                 else {
+                    update_node_bw(md);
+                    if (rate_act) {
+                        mig_rate_update(md);
+                    }
+
                     float pmm_bw;
                     if (PMM_MIXED) {
                         pmm_bw = md->sys_pmmAppBW;
+                        if (smoothed) {
+                            pmm_bw = fmax(pmm_bw, summary.stat[PCM_PMM_APP_BW].p95); // bursts the average hides
+                        }
                     }
                     else {
                         pmm_bw = md->sys_pmmWrites;
+                        if (smoothed) {
+                            pmm_bw = fmax(pmm_bw, summary.stat[PCM_PMM_WRITES].p95);
+                        }
+                    }
+
+                    // Sockets whose Optane is over its share of a threshold: FINDs take the pages of its nodes
+                    int wr_skt = pmm_hot_socket(md, NVRAM_WR_BW_THRESH, 1);
+                    int bw_skt = pmm_hot_socket(md, NVRAM_BW_THRESH, !PMM_MIXED);
+
+                    // NVRAM writes are much slower than its reads: while there is room above, write-hot pages go first
+                    if (write_act && ((md->sys_pmmWrites > NVRAM_WR_BW_THRESH) || (wr_skt >= 0)) && (usage[last-1] < DRAM_TARGET)) {
+                        long long n_bytes = (DRAM_TARGET - usage[last-1]) * tier_sz[last-1];
+                        n_pages = n_bytes / page_size;
+                        n_pages = fmin(n_pages, fmin(MAX_FIND_BATCHES * MAX_N_FIND, mig_rate_pages()));
+                        if (wr_skt >= 0) {
+                            printf("MEMCHECK: Socket %d NVRAM writes at %0.0f MB/s.\n", wr_skt, md->skt_pmmWrites[wr_skt]);
+                        }
+
+                        pthread_mutex_lock(&placement_lock);
+                        if (backend != BACKEND_DAMON) {
+                            send_find(0, NVRAM_CLEAR, last);
+                            usleep(clear_interval);
+                            nvram_cleared = 1;
+                        }
+                        write_migrated = send_find_batches(n_pages, NVRAM_WRITE_MODE, last, socket_tier_nodes(md, last, wr_skt));
+                        pthread_mutex_unlock(&placement_lock);
+
+                        if (write_migrated > 0) {
+                            printf("Tier %d->%d: Sent %d out of %d write-hot pages.\n", last, last-1, write_migrated, n_pages);
+                            usage[last-1] = free_space_tot_per(last-1, &tier_sz[last-1]);
+                            usage[last] = free_space_tot_per(last, &tier_sz[last]);
+                        }
                     }
-                    if (pmm_bw > NVRAM_BW_THRESH) {
+
+                    int lat_bound = lat_act && pmm_latency_high(md);
+                    int bw_bound = (pmm_bw > NVRAM_BW_THRESH) || (bw_skt >= 0);
+                    if (lat_bound && !bw_bound) {
+                        printf("MEMCHECK: PMM read latency %.0fns (DRAM %.0fns).\n", md->sys_pmmReadLat, md->sys_dramReadLat);
+                        bw_skt = pmm_busiest_socket(md); // the latency is system-wide, relieve the busiest socket
+                    }
+                    else if (bw_skt >= 0) {
+                        printf("MEMCHECK: Socket %d NVRAM at %0.0f MB/s.\n", bw_skt, md->skt_pmmReads[bw_skt] + md->skt_pmmWrites[bw_skt]);
+                    }
+                    unsigned long long bw_nodes = socket_tier_nodes(md, last, bw_skt);
+
+                    if (switch_act && (bw_bound || lat_bound)) {
                         pthread_mutex_lock(&placement_lock);
-                        send_find(0, NVRAM_CLEAR);
-                        usleep(clear_interval);
-                        if (dram_usage >= DRAM_TARGET) {
-                            switch_migrated = send_find(MAX_N_SWITCH, SWITCH_MODE);
+                        if ((backend != BACKEND_DAMON) && !nvram_cleared) {
+                            send_find(0, NVRAM_CLEAR, last);
+                            usleep(clear_interval);
+                            nvram_cleared = 1;
+                        }
+                        if (usage[last-1] >= DRAM_TARGET) {
+                            n_pages = fmin(MAX_N_SWITCH, mig_rate_pages() / 2);
+                            switch_migrated = wait_find(submit_find(n_pages, SWITCH_MODE, last, bw_nodes, ULONG_MAX));
                             if (switch_migrated > 0) {
-                                printf("DRAM<->NVRAM: Switched %d out of %ld pages.\n", switch_migrated, MAX_N_SWITCH * 2);
+                                printf("Tier %d<->%d: Switched %d out of %d pages.\n", last-1, last, switch_migrated, n_pages * 2);
                             }
                         }
                         else {
-                            long long n_bytes = (DRAM_LIMIT - dram_usage) * dram_sz;
+                            long long n_bytes = (DRAM_LIMIT - usage[last-1]) * tier_sz[last-1];
                             n_pages = n_bytes / page_size;
-                            n_pages = fmin(n_pages, MAX_N_FIND);
-                            switch_migrated = send_find(n_pages, NVRAM_INTENSIVE_MODE);
+                            n_pages = fmin(n_pages, fmin(MAX_FIND_BATCHES * MAX_N_FIND, mig_rate_pages()));
+                            switch_migrated = send_find_batches(n_pages, NVRAM_INTENSIVE_MODE, last, bw_nodes);
 
                             if (switch_migrated > 0) {
-                                printf("NVRAM->DRAM: Sent %d out of %d intensive pages.\n", switch_migrated, n_pages);
-                                dram_usage = free_space_tot_per(DRAM_MODE, &dram_sz);
-                                nvram_usage = free_space_tot_per(NVRAM_MODE, &nvram_sz);
+                                printf("Tier %d->%d: Sent %d out of %d intensive pages.\n", last, last-1, switch_migrated, n_pages);
+                                usage[last-1] = free_space_tot_per(last-1, &tier_sz[last-1]);
+                                usage[last] = free_space_tot_per(last, &tier_sz[last]);
                             }
                         }
 
@@ -585,43 +2702,58 @@ void *memcheck_placement(void *args) {
                     }
                 }
 
-                n_migrated += switch_migrated;
-                free(md);
+                n_migrated += switch_migrated + write_migrated;
             }
         }
 
+        // Threshold component: for each pair of adjacent tiers, slowest pair first so that a tier has made
+        // room below before receiving pages from above
         if (thresh_act) {
-            if ((dram_usage > DRAM_LIMIT) && (nvram_usage < NVRAM_TARGET)) {
-                long long n_bytes = fmin((dram_usage - DRAM_TARGET) * dram_sz,
-                                    (NVRAM_TARGET - nvram_usage) * nvram_sz);
-                n_pages = n_bytes / page_size;
-                n_pages = fmin(n_pages, MAX_N_FIND);
-                pthread_mutex_lock(&placement_lock);
-                thresh_migrated = send_find(n_pages, DRAM_MODE);
-                pthread_mutex_unlock(&placement_lock);
-                if (thresh_migrated > 0) {
-                    printf("DRAM->NVRAM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
+            for (int t=last-1; t >= 0; t--) {
+                int pair_migrated = 0;
+
+                if ((usage[t] > DRAM_LIMIT) && (usage[t+1] < tier_target(t+1))) {
+                    long long n_bytes = fmin((usage[t] - DRAM_TARGET) * tier_sz[t],
+                                        (tier_target(t+1) - usage[t+1]) * tier_sz[t+1]);
+                    n_pages = n_bytes / page_size;
+                    n_pages = fmin(n_pages, fmin(MAX_FIND_BATCHES * MAX_N_FIND, mig_rate_pages()));
+                    pthread_mutex_lock(&placement_lock);
+                    pair_migrated = send_find_batches(n_pages, DEMOTE_MODE, t, 0);
+                    pthread_mutex_unlock(&placement_lock);
+                    if (pair_migrated > 0) {
+                        printf("Tier %d->%d: Migrated %d out of %d pages.\n", t, t+1, pair_migrated, n_pages);
+                    }
                 }
-            }
-            else if (!switch_act && (nvram_usage > NVRAM_LIMIT) && (dram_usage < DRAM_TARGET)) {
-                long long n_bytes = fmin((nvram_usage - NVRAM_TARGET) * nvram_sz,
-                                    (DRAM_TARGET - dram_usage) * dram_sz);
-                n_pages = n_bytes / page_size;
-                n_pages = fmin(n_pages, MAX_N_FIND);
-                pthread_mutex_lock(&placement_lock);
-                thresh_migrated = send_find(n_pages, NVRAM_MODE);
-                pthread_mutex_unlock(&placement_lock);
-                if (thresh_migrated > 0) {
-                    printf("NVRAM->DRAM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
+                // The switch component already promotes out of the NVRAM tier
+                else if (!(switch_act && (t+1 == last)) && (usage[t+1] > tier_limit(t+1)) && (usage[t] < DRAM_TARGET)) {
+                    long long n_bytes = fmin((usage[t+1] - tier_target(t+1)) * tier_sz[t+1],
+                                        (DRAM_TARGET - usage[t]) * tier_sz[t]);
+                    n_pages = n_bytes / page_size;
+                    n_pages = fmin(n_pages, fmin(MAX_FIND_BATCHES * MAX_N_FIND, mig_rate_pages()));
+                    pthread_mutex_lock(&placement_lock);
+                    pair_migrated = send_find_batches(n_pages, PROMOTE_MODE, t+1, 0);
+                    pthread_mutex_unlock(&placement_lock);
+                    if (pair_migrated > 0) {
+                        printf("Tier %d->%d: Migrated %d out of %d pages.\n", t+1, t, pair_migrated, n_pages);
+                    }
+                }
+
+                if (pair_migrated > 0) {
+                    usage[t] = free_space_tot_per(t, &tier_sz[t]);
+                    usage[t+1] = free_space_tot_per(t+1, &tier_sz[t+1]);
                 }
+                thresh_migrated += pair_migrated;
             }
 
             n_migrated += thresh_migrated;
         }
 
-        if (n_migrated > 0) {
+        if (backend == BACKEND_DAMON) {
+            damon_end_round(); // armed schemes migrate at their quota until the next round
+        }
+        else if ((n_migrated > 0) && !rate_act) {
             sleep_interval *= 2; // give time for bw to settle given the migrated pages
-            if (switch_migrated > 0) {
+            if (nvram_cleared) {
                 sleep_interval -= clear_interval;
             }
         }
@@ -705,9 +2837,12 @@ void *process_stdin(void *args) {
     printf("Available commands:\n"
             "\tbind [pid]\n"
             "\tunbind [pid]\n"
-            "\tDEBUG: send [n] [dram|nvram|dramwr]\n"
-            "\tDEBUG: switch [n]\n"
-            "\tDEBUG: toggle [switch|thresh|all]\n"
+            "\tbindcg|unbindcg|cgstat [cgroup v2 path]\n"
+            "\ttiers [list, e.g. 0:1:2-3]\n"
+            "\tdamonstat\n"
+            "\tDEBUG: send [n] [dram|nvram|dramwr] [tier]\n"
+            "\tDEBUG: switch [n] [tier]\n"
+            "\tDEBUG: toggle [switch|thresh|write|rate|latency|kmig|all]\n"
             "\tDEBUG: clear\n"
             "\texit\n");
 
@@ -754,32 +2889,58 @@ void *process_stdin(void *args) {
             }
         }
 
+        else if (!strcmp(substring, "bindcg") || !strcmp(substring, "unbindcg") || !strcmp(substring, "cgstat")) {
+            char *cmd = substring;
+            if ((substring = strtok(NULL, " \n")) == NULL) {
+                fprintf(stderr, "Invalid argument for %s command.\n", cmd);
+                continue;
+            }
+            if (!strcmp(cmd, "bindcg")) {
+                if (send_bind_cgroup(substring)) {
+                    printf("Bind request success (cgroup=%s).\n", substring);
+                }
+            }
+            else if (!strcmp(cmd, "unbindcg")) {
+                if (send_unbind_cgroup(substring)) {
+                    printf("Unbind request success (cgroup=%s).\n", substring);
+                }
+            }
+            else {
+                print_cgroup_stats(substring);
+            }
+        }
+
         else if (!strcmp(substring, "send")) {
             if ((substring = strtok(NULL, " ")) == NULL) {
                 fprintf(stderr, "Invalid argument for send command.\n");
                 continue;
             }
             long n = strtol(substring, NULL, 10);
-            if ((substring = strtok(NULL, " ")) == NULL) {
+            if ((substring = strtok(NULL, " \n")) == NULL) {
                 fprintf(stderr, "Invalid argument for send command.\n");
                 continue;
             }
 
+            // Optional source tier, by default pages are promoted from the slowest tier and demoted from the fastest
+            char *tier_arg = strtok(NULL, " \n");
             int n_migrated = 0;
 
-            if (!strcmp(substring, "dram\n")) {
+            if (!strcmp(substring, "dram")) {
+                int tier = (tier_arg != NULL) ? strtol(tier_arg, NULL, 10) : tiers.n_tiers - 1;
                 pthread_mutex_lock(&placement_lock);
-                n_migrated = send_find((int) n, NVRAM_MODE);
+                n_migrated = send_find((int) n, NVRAM_MODE, tier);
                 pthread_mutex_unlock(&placement_lock);
             }
-            else if (!strcmp(substring, "nvram\n")) {
+            else if (!strcmp(substring, "nvram")) {
+                int tier = (tier_arg != NULL) ? strtol(tier_arg, NULL, 10) : 0;
                 pthread_mutex_lock(&placement_lock);
-                n_migrated = send_find((int) n, DRAM_MODE);
+                n_migrated = send_find((int) n, DRAM_MODE, tier);
                 pthread_mutex_unlock(&placement_lock);
             }
-            else if (!strcmp(substring, "dramwr\n")) {
+            else if (!strcmp(substring, "dramwr")) {
+                int tier = (tier_arg != NULL) ? strtol(tier_arg, NULL, 10) : tiers.n_tiers - 1;
                 pthread_mutex_lock(&placement_lock);
-                n_migrated = send_find((int) n, NVRAM_WRITE_MODE);
+                n_migrated = send_find((int) n, NVRAM_WRITE_MODE, tier);
                 pthread_mutex_unlock(&placement_lock);
             }
 
@@ -799,14 +2960,40 @@ void *process_stdin(void *args) {
             }
             long n = strtol(substring, NULL, 10);
             n = fmin(n, MAX_N_SWITCH);
+            char *tier_arg = strtok(NULL, " \n");
+            int tier = (tier_arg != NULL) ? strtol(tier_arg, NULL, 10) : tiers.n_tiers - 1;
             pthread_mutex_lock(&placement_lock);
-            int n_migrated = send_find((int) n, SWITCH_MODE);
+            int n_migrated = send_find((int) n, SWITCH_MODE, tier);
             pthread_mutex_unlock(&placement_lock);
             if (n_migrated > 0) {
                 printf("NVRAM<->DRAM: Switched %d out of %ld pages.\n", n_migrated, n * 2);
             }
         }
 
+        else if (!strcmp(substring, "tiers\n")) {
+            print_tiers();
+        }
+
+        else if (!strcmp(substring, "tiers")) {
+            tier_cfg_t cfg;
+            if (((substring = strtok(NULL, " ")) == NULL) || parse_tiers(substring, &cfg)) {
+                fprintf(stderr, "Invalid argument for tiers command.\n");
+                continue;
+            }
+            if (send_tiers(&cfg)) {
+                print_tiers();
+            }
+        }
+
+        else if (!strcmp(substring, "damonstat\n")) {
+            if (backend == BACKEND_DAMON) {
+                damon_print_stats();
+            }
+            else {
+                fprintf(stderr, "damonstat needs the DAMON backend.\n");
+            }
+        }
+
         else if (!strcmp(substring, "toggle")) {
             if ((substring = strtok(NULL, " ")) == NULL) {
                 fprintf(stderr, "Invalid argument for toggle command.\n");
@@ -832,6 +3019,46 @@ void *process_stdin(void *args) {
                     printf("Threshold component turned OFF\n");
                 }
             }
+            else if (!strcmp(substring, "write\n")) {
+                write_act = 1 - write_act;
+
+                if (write_act) {
+                    printf("Write component turned ON\n");
+                }
+                else {
+                    printf("Write component turned OFF\n");
+                }
+            }
+            else if (!strcmp(substring, "rate\n")) {
+                rate_act = 1 - rate_act;
+
+                if (rate_act) {
+                    printf("Migration rate limiter turned ON\n");
+                }
+                else {
+                    printf("Migration rate limiter turned OFF\n");
+                }
+            }
+            else if (!strcmp(substring, "latency\n")) {
+                lat_act = 1 - lat_act;
+
+                if (lat_act) {
+                    printf("Latency trigger turned ON\n");
+                }
+                else {
+                    printf("Latency trigger turned OFF\n");
+                }
+            }
+            else if (!strcmp(substring, "kmig\n")) {
+                kmig_act = 1 - kmig_act;
+
+                if (kmig_act) {
+                    printf("In-kernel migration turned ON\n");
+                }
+                else {
+                    printf("In-kernel migration turned OFF\n");
+                }
+            }
             else if (!strcmp(substring, "all\n")) {
                 switch_act = 1 - switch_act;
                 thresh_act = 1 - thresh_act;
@@ -861,9 +3088,12 @@ void *process_stdin(void *args) {
                     "Available commands:\n"
                     "\tbind [pid]\n"
                     "\tunbind [pid]\n"
-                    "\tDEBUG: send [n] [dram|nvram|dramwr]\n"
-                    "\tDEBUG: switch [n]\n"
-                    "\tDEBUG: toggle [switch|thresh|all]\n"
+                    "\tbindcg|unbindcg|cgstat [cgroup v2 path]\n"
+                    "\ttiers [list, e.g. 0:1:2-3]\n"
+                    "\tdamonstat\n"
+                    "\tDEBUG: send [n] [dram|nvram|dramwr] [tier]\n"
+                    "\tDEBUG: switch [n] [tier]\n"
+                    "\tDEBUG: toggle [switch|thresh|write|rate|latency|kmig|all]\n"
                     "\tDEBUG: clear\n"
                     "\texit\n");
 
@@ -880,6 +3110,7 @@ void *process_socket(void *args) {
     struct sockaddr_un uds_addr;
     int unix_fd, sel, acc, rd;
     req_t unix_req;
+    char cgroup_path[CGROUP_PATH_MAX];
 
     struct timeval sel_timeout;
     fd_set readfds;
@@ -938,6 +3169,17 @@ void *process_socket(void *args) {
                             fprintf(stderr, "Unbind request failed (pid=%d).\n", unix_req.pid_n);
                         }
                         break;
+                    case BIND_CGROUP_OP:
+                    case UNBIND_CGROUP_OP:
+                        if (read(acc, cgroup_path, CGROUP_PATH_MAX) != CGROUP_PATH_MAX) {
+                            fprintf(stderr, "Unexpected amount of bytes read for cgroup path.\n");
+                            break;
+                        }
+                        cgroup_path[CGROUP_PATH_MAX - 1] = '\0';
+                        if ((unix_req.op_code == BIND_CGROUP_OP) ? send_bind_cgroup(cgroup_path) : send_unbind_cgroup(cgroup_path)) {
+                            printf("%s request success (cgroup=%s).\n", (unix_req.op_code == BIND_CGROUP_OP) ? "Bind" : "Unbind", cgroup_path);
+                        }
+                        break;
                     default:
                         fprintf(stderr, "Unexpected request OPcode from accepted UD socket connection");
                 }
@@ -971,17 +3213,40 @@ MAIN FUNCTION
 */
 
 
-int main() {
-
+// Connects to the kernel module: netlink for bind/unbind, the candidate ring device for everything else
+int open_module() {
     if ((netlink_fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_USER)) == -1) {
         fprintf(stderr, "Could not create netlink socket fd: %s\nTry inserting kernel module first.\n", strerror(errno));
-        return 1;
+        return 0;
+    }
+    if ((ring_fd = open(AMBIX_DEV_PATH, O_RDWR)) == -1) {
+        if (errno == EBUSY) {
+            fprintf(stderr, "Could not open %s: another ctl is running.\n", AMBIX_DEV_PATH);
+        }
+        else {
+            fprintf(stderr, "Could not open %s: %s\nTry inserting kernel module first (ctl must run as root).\n",
+                    AMBIX_DEV_PATH, strerror(errno));
+        }
+        close(netlink_fd);
+        return 0;
+    }
+    if ((ring = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Could not map candidate ring: %s\n", strerror(errno));
+        close(ring_fd);
+        close(netlink_fd);
+        return 0;
+    }
+    ring_hdr = ring;
+    ring_entries = (addr_info_t *) ((char *) ring + RING_HDR_SIZE);
+    if (!load_tiers()) {
+        munmap(ring, RING_SIZE);
+        close(ring_fd);
+        close(netlink_fd);
+        return 0;
     }
-    page_size = sysconf(_SC_PAGESIZE);
-    int packet_size = NLMSG_SPACE(MAX_PAYLOAD);
-    buf_size = packet_size * MAX_PACKETS;
 
-    candidates = malloc(sizeof(addr_info_t) * MAX_N_FIND);
+    int packet_size = NLMSG_SPACE(MAX_PAYLOAD);
+    buf_size = packet_size; // only single-packet BIND/UNBIND replies go through netlink
 
     buffer = malloc(buf_size);
 
@@ -993,11 +3258,80 @@ int main() {
 
     if (bind(netlink_fd, (struct sockaddr *) &src_addr, sizeof(src_addr))) {
         printf("Error binding netlink socket fd: %s\n", strerror(errno));
-        free(candidates);
+        munmap(ring, RING_SIZE);
+        close(ring_fd);
+        close(netlink_fd);
         free(buffer);
         free(nlmh_out);
+        return 0;
+    }
+    return 1;
+}
+
+void close_backend() {
+    if (backend == BACKEND_PAGEMAP) {
+        pm_close();
+        return;
+    }
+    if (backend == BACKEND_DAMON) {
+        damon_close();
+        return;
+    }
+#ifdef AMBIX_BPF
+    if (backend == BACKEND_BPF) {
+        bf_close();
+        return;
+    }
+#endif
+    close(netlink_fd);
+    munmap(ring, RING_SIZE);
+    close(ring_fd);
+    free(buffer);
+    free(nlmh_out);
+}
+
+// Usage: ambix-hyb-ctl.o [module|pagemap [tiers]|bpf [tiers]|damon [tiers]]
+int main(int argc, char *argv[]) {
+    page_size = sysconf(_SC_PAGESIZE);
+
+    if ((argc > 1) && !strcmp(argv[1], "pagemap")) {
+        backend = BACKEND_PAGEMAP;
+        if (!pm_open((argc > 2) ? argv[2] : NULL)) {
+            return 1;
+        }
+    }
+    else if ((argc > 1) && !strcmp(argv[1], "bpf")) {
+#ifdef AMBIX_BPF
+        backend = BACKEND_BPF;
+        if (!bf_open((argc > 2) ? argv[2] : NULL)) {
+            return 1;
+        }
+#else
+        fprintf(stderr, "ctl was built without the BPF backend (make ctl-bpf).\n");
+        return 1;
+#endif
+    }
+    else if ((argc > 1) && !strcmp(argv[1], "damon")) {
+        backend = BACKEND_DAMON;
+        if (!damon_open((argc > 2) ? argv[2] : NULL)) {
+            return 1;
+        }
+    }
+    else if ((argc > 1) && strcmp(argv[1], "module")) {
+        fprintf(stderr, "Unknown backend %s (expected module, pagemap, bpf or damon).\n", argv[1]);
+        return 1;
+    }
+    else if (!open_module()) {
+        return 1;
+    }
+
+#ifdef AMBIX_PCM
+    if (pcm_sampler_open() != 0) {
+        fprintf(stderr, "Could not program the memory bandwidth counters (ctl-pcm must run as root).\n");
+        close_backend();
         return 1;
     }
+#endif
 
     if (pthread_mutex_init(&comm_lock, NULL)) {
         fprintf(stderr, "Error creating communication mutex lock: %s\n", strerror(errno));
@@ -1007,6 +3341,18 @@ int main() {
         fprintf(stderr, "Error creating placement mutex lock: %s\n", strerror(errno));
     }
 
+    else if (!start_mig_pool()) {
+        fprintf(stderr, "Error spawning migration workers: %s\n", strerror(errno));
+    }
+
+    else if (pthread_create(&scan_thread, NULL, scan_pipeline, NULL)) {
+        fprintf(stderr, "Error spawning FIND scan thread: %s\n", strerror(errno));
+    }
+
+    else if (pthread_create(&migrate_thread, NULL, migrate_pipeline, NULL)) {
+        fprintf(stderr, "Error spawning FIND migration thread: %s\n", strerror(errno));
+    }
+
     else if (pthread_create(&stdin_thread, NULL, process_stdin, NULL)) {
         fprintf(stderr, "Error spawning stdin thread: %s\n", strerror(errno));
     }
@@ -1024,19 +3370,18 @@ int main() {
         printf("Exiting ctl...\n");
         pthread_join(socket_thread, NULL);
         pthread_join(memcheck_thread, NULL);
+        stop_pipeline();
+        stop_mig_pool();
+#ifdef AMBIX_PCM
+        pcm_sampler_close();
+#endif
 
         pthread_mutex_destroy(&comm_lock);
         pthread_mutex_destroy(&placement_lock);
 
-        close(netlink_fd);
-        free(candidates);
-        free(buffer);
-        free(nlmh_out);
+        close_backend();
         return 0;
     }
-    close(netlink_fd);
-    free(candidates);
-    free(buffer);
-    free(nlmh_out);
+    close_backend();
     return 1;
 }
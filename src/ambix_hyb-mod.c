@@ -10,31 +10,58 @@
 
 #pragma GCC diagnostic ignored "-Wdeclaration-after-statement"
 
+#include <linux/atomic.h>
+#include <linux/cgroup.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/init.h>  // Macros used to mark up functions e.g., __init __exit
 #include <linux/kernel.h>  // Contains types, macros, functions for the kernel
+#include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
 #include <linux/mempolicy.h>
+#include <linux/migrate.h>
+#include <linux/mm_inline.h>
+#include <linux/mmu_notifier.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>  // Core header for loading LKMs into the kernel
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <net/sock.h>
 #include <linux/netlink.h>
 #include <linux/skbuff.h>
 #include <linux/mount.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
+#include <linux/sched/task.h>
 #include <linux/seq_file.h>
 #include <linux/shmem_fs.h>
 #include <linux/signal.h>
+#include <linux/random.h>
+#include <linux/refcount.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 #include <linux/pagewalk.h>
 #include <linux/mmzone.h> // Contains conversion between pfn and node id (NUMA node)
+#include <asm/tlbflush.h>
 
 #include <linux/string.h>
 #include "ambix.h"
 
+#define CREATE_TRACE_POINTS
+#include "ambix_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Miguel Marques");
 MODULE_DESCRIPTION("Bandwidth-aware page replacement");
@@ -43,26 +70,226 @@ MODULE_INFO(vermagic, "5.8.5-patched SMP mod_unload modversions ");
 
 struct sock *nl_sock;
 
-addr_info_t *found_addrs;
+addr_info_t *found_addrs; // where the current request's reply is built (nl_addrs or the candidate ring)
+addr_info_t *nl_addrs; // reply buffer for requests received via netlink
 addr_info_t *backup_addrs; // prevents a second page walk
 addr_info_t *switch_backup_addrs; // for switch walk
 
-struct task_struct **task_items;
 struct nlmsghdr **nlmh_array;
+
+// Bound-process registry (see add_bound_task):
+#define BOUND_MM_LIVE 0
+#define BOUND_MM_EXITED 1 // release callback ran, queued on exited_mms
+#define BOUND_MM_DETACHED 2 // no longer bound, notifier reference dropped
+
+typedef struct bound_mm {
+    struct mmu_notifier mn;
+    struct list_head tasks; // bound tasks sharing this mm
+    struct llist_node exit_node;
+    atomic_t state;
+} bound_mm_t;
+
+typedef struct bound_cgroup {
+    struct cgroup *cgrp;
+    char path[CGROUP_PATH_MAX];
+    struct list_head node;
+} bound_cgroup_t;
+
+// Address range whose pages are assumed to be accessed alike (see REGION SAMPLING)
+typedef struct region {
+    unsigned long start, end;
+    unsigned long sample; // page whose accessed bit was cleared at the last sample (0 if none yet)
+    unsigned int nr_accesses; // samples that found it accessed in the current aggregation interval
+    unsigned int last_accesses; // nr_accesses of the last complete aggregation interval, used by FIND
+} region_t;
+
+typedef struct bound_task {
+    pid_t pid;
+    int idx; // position in bound_tasks
+    struct mm_struct *mm;
+    bound_mm_t *bmm;
+    bound_cgroup_t *cg; // cgroup the task was bound through (NULL if bound by pid)
+    struct list_head mm_node;
+    struct hlist_node hnode;
+    struct xarray hist; // access history, keyed by virtual page (see hist_update)
+    struct mutex regions_lock; // taken by the region sampler and region_find
+    region_t *regions; // sorted by address, allocated by the region sampler
+    int n_regions;
+    refcount_t ref; // registry reference plus one per sampler pass (see get_sampled_task)
+    u64 walk_ns; // time spent walking this task by FIND and clear requests (see WALK STATISTICS)
+    unsigned long walk_entries;
+    struct rcu_head rcu;
+} bound_task_t;
+
+static DEFINE_HASHTABLE(bound_hash, 10);
+static LLIST_HEAD(exited_mms);
+static LIST_HEAD(bound_cgroups);
+bound_task_t **bound_tasks; // walk order
+int max_bound = 0;
 int n_pids = 0;
 
-volatile unsigned long last_addr_dram = 0;
-volatile unsigned long last_addr_nvram = 0;
+// Walk cursors (task index and address to resume from), per tier and walk direction
+#define DEMOTE_WALK 0
+#define PROMOTE_WALK 1
+#define CLEAR_WALK 2
+#define N_WALK_DIRS 3
+unsigned long last_addr[MAX_TIERS][N_WALK_DIRS];
+int last_pid[MAX_TIERS][N_WALK_DIRS];
+
+// Tier topology:
+static char *tiers_param = DEFAULT_TIERS;
+module_param_named(tiers, tiers_param, charp, 0444);
+MODULE_PARM_DESC(tiers, "Memory tiers, fastest first, separated by ':' (e.g. \"0:1:2-3\")");
 
-int last_pid_dram = 0;
-int last_pid_nvram = 0;
+tier_cfg_t tiers;
+int node_tier[MAX_NUMNODES]; // tier of each node (-1 if not managed), the lookup done for every walked entry
+int walk_tier = 0; // tier walked by the current request
+unsigned long long walk_nodes = 0; // nodes of walk_tier the current request is restricted to (0 for all)
 
-int curr_pid = 0;
 int n_to_find = 0;
 int n_found = 0;
 int n_backup = 0;
 int n_switch_backup = 0;
 
+// Page walk worker pool:
+static int n_walkers = 0;
+module_param(n_walkers, int, 0444);
+MODULE_PARM_DESC(n_walkers, "Number of page walk worker threads (0 = one per online CPU, capped at MAX_WALKERS)");
+
+// Scan budget (see walk_range_sliced):
+static int scan_slice = 4096;
+module_param(scan_slice, int, 0644);
+MODULE_PARM_DESC(scan_slice, "Page table entries walked before the mmap lock is dropped and the walker reschedules (0 = no slicing)");
+
+static unsigned int scan_budget_us = 0;
+module_param(scan_budget_us, uint, 0644);
+MODULE_PARM_DESC(scan_budget_us, "Time a single walk may take in microseconds, the next one resumes where it stopped (0 = no limit)");
+
+// Region sampling (see REGION SAMPLING):
+static int region_sampling = 0;
+module_param(region_sampling, int, 0444);
+MODULE_PARM_DESC(region_sampling, "Sample one page per address region instead of walking every page table entry");
+
+static unsigned int sample_us = 5000;
+module_param(sample_us, uint, 0644);
+MODULE_PARM_DESC(sample_us, "Region sampling interval in microseconds");
+
+static unsigned int aggr_us = 100000;
+module_param(aggr_us, uint, 0644);
+MODULE_PARM_DESC(aggr_us, "Region aggregation interval in microseconds (regions are merged and split once per interval)");
+
+static int min_regions = 10;
+module_param(min_regions, int, 0444);
+MODULE_PARM_DESC(min_regions, "Minimum number of regions per bound process");
+
+static int max_regions = 1000;
+module_param(max_regions, int, 0444);
+MODULE_PARM_DESC(max_regions, "Maximum number of regions per bound process");
+
+static int region_hot_accesses = 5;
+module_param(region_hot_accesses, int, 0644);
+MODULE_PARM_DESC(region_hot_accesses, "Minimum accessed samples per aggregation interval for a region to be considered hot");
+
+static int region_cold_accesses = 0;
+module_param(region_cold_accesses, int, 0644);
+MODULE_PARM_DESC(region_cold_accesses, "Maximum accessed samples per aggregation interval for a region to be considered cold");
+
+// Access history thresholds (in epochs out of the last HIST_EPOCHS):
+static int hist_hot_freq = 2;
+module_param(hist_hot_freq, int, 0644);
+MODULE_PARM_DESC(hist_hot_freq, "Minimum accessed epochs for an NVRAM page to be considered hot");
+
+static int hist_cold_freq = 1;
+module_param(hist_cold_freq, int, 0644);
+MODULE_PARM_DESC(hist_cold_freq, "Maximum accessed epochs for an idle DRAM page to be considered cold");
+
+static int hist_write_freq = 1;
+module_param(hist_write_freq, int, 0644);
+MODULE_PARM_DESC(hist_write_freq, "Minimum written epochs for a page to be considered write-intensive");
+
+static unsigned int write_epoch_ms = 1000;
+module_param(write_epoch_ms, uint, 0644);
+MODULE_PARM_DESC(write_epoch_ms, "Length of a write epoch in milliseconds, whatever the walks in between (0 = one epoch per sample)");
+
+// Page table entries visited by a walk, and why the ones that were not sampled were skipped
+typedef struct walk_stats {
+    unsigned long entries; // PTEs and huge PMDs
+    unsigned long vmas; // VMAs with at least one entry visited
+    unsigned long not_present;
+    unsigned long read_only;
+    unsigned long wrong_tier; // on the nodes of another tier than the walked one
+} walk_stats_t;
+
+// Per-worker candidate lists (passed to the callbacks through walk->private)
+typedef struct walk_ctx {
+    addr_info_t *found;
+    addr_info_t *backup;
+    addr_info_t *switch_backup;
+    int n_found;
+    int n_backup;
+    int n_switch_backup;
+    int n_to_find;
+    int curr_pid;
+    int tier; // only pages on this tier's nodes are sampled
+    unsigned long long nodes; // and, if not 0, only on these nodes
+    struct xarray *hist;
+    unsigned long *tier_pages; // resident base pages per tier (count walks)
+    unsigned long flush_start, flush_end; // range of the current VMA whose entries were cleared
+    int scanned; // entries walked in the current slice
+    unsigned long resume; // where the walk stopped when the slice ran out
+    walk_stats_t stats;
+    struct vm_area_struct *last_vma; // VMA of the last entry visited (for stats.vmas)
+} walk_ctx_t;
+
+// A range of one bound mm, walked by a single worker
+typedef struct walk_job {
+    struct mm_struct *mm;
+    struct xarray *hist;
+    int task_idx;
+    int pid;
+    unsigned long start;
+    unsigned long end;
+    unsigned long resume; // end if the range was walked, where the scan budget ran out otherwise
+    int worker; // worker that walked this job and holds its candidates
+    int found_start, n_found;
+    int backup_start, n_backup;
+    int switch_backup_start, n_switch_backup;
+    unsigned long entries; // page table entries visited
+    u64 ns; // wall time of the walk
+} walk_job_t;
+
+typedef struct walk_worker {
+    struct task_struct *thread;
+    walk_ctx_t ctx;
+    unsigned long seen_gen;
+} walk_worker_t;
+
+walk_worker_t *walkers;
+
+walk_job_t *walk_jobs;
+int n_walk_jobs = 0;
+int walk_quota = 0;
+ktime_t walk_expires; // scan budget deadline of the current walk
+const struct mm_walk_ops *walk_ops;
+
+walk_stats_t req_stats; // summed over the walks of the current FIND request
+
+unsigned long walk_gen = 0;
+atomic_t next_walk_job;
+atomic_t walk_total;
+atomic_t walkers_pending;
+
+static DECLARE_WAIT_QUEUE_HEAD(walk_wq);
+static DECLARE_COMPLETION(walk_done);
+static DEFINE_MUTEX(walk_mutex);
+static DEFINE_MUTEX(req_mutex); // serializes netlink and device requests
+static DEFINE_MUTEX(bound_lock); // bound_tasks and n_pids, also held by writers (under req_mutex)
+
+// Candidate ring shared with ctl through AMBIX_DEV_PATH:
+void *ring;
+ring_hdr_t *ring_hdr;
+addr_info_t *ring_entries;
+
 
 
 /*
@@ -75,85 +302,371 @@ HELPER FUNCTIONS
 
 
 
-static int find_target_process(pid_t pid) {  // to find the task struct by process_name or pid
+/*
+ * Bound-process registry. Each bound task holds a reference on its mm through an mmu notifier, whose
+ * release callback (run when the address space is torn down, on exit or exec) queues the mm on
+ * exited_mms. Pending exits are reaped at the start of every request, so no per-request scan of the
+ * bound tasks is needed. Lookups by pid go through an RCU-protected hash table, while bound_tasks keeps
+ * a dense array in walk order (cursors are indexes into it). Writers are serialized by req_mutex and
+ * also take bound_lock, which is all the region sampler holds to pick its next task.
+ */
+
+static void bound_mm_release(struct mmu_notifier *mn, struct mm_struct *mm) {
+    bound_mm_t *bmm = container_of(mn, bound_mm_t, mn);
+
+    if (atomic_cmpxchg(&bmm->state, BOUND_MM_LIVE, BOUND_MM_EXITED) == BOUND_MM_LIVE) {
+        llist_add(&bmm->exit_node, &exited_mms);
+    }
+}
+
+static void hist_erase_range(struct xarray *hist, unsigned long start, unsigned long end);
+
+// Unmapped pages lose their history; tasks are walked under RCU as this may run concurrently with reaping
+static int bound_mm_invalidate(struct mmu_notifier *mn, const struct mmu_notifier_range *range) {
+    bound_mm_t *bmm = container_of(mn, bound_mm_t, mn);
+    bound_task_t *bt;
+
+    if (range->event != MMU_NOTIFY_UNMAP) {
+        return 0;
+    }
+    rcu_read_lock();
+    list_for_each_entry_rcu(bt, &bmm->tasks, mm_node) {
+        hist_erase_range(&bt->hist, range->start, range->end);
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static struct mmu_notifier *bound_mm_alloc(struct mm_struct *mm) {
+    bound_mm_t *bmm = kzalloc(sizeof(bound_mm_t), GFP_KERNEL);
+
+    if (bmm == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+    INIT_LIST_HEAD(&bmm->tasks);
+    atomic_set(&bmm->state, BOUND_MM_LIVE);
+    return &bmm->mn;
+}
+
+static void bound_mm_free(struct mmu_notifier *mn) {
+    kfree(container_of(mn, bound_mm_t, mn));
+}
+
+static const struct mmu_notifier_ops bound_mm_ops = {
+    .release = bound_mm_release,
+    .invalidate_range_start = bound_mm_invalidate,
+    .alloc_notifier = bound_mm_alloc,
+    .free_notifier = bound_mm_free,
+};
+
+// Caller holds rcu_read_lock() or req_mutex
+static bound_task_t *bound_lookup(pid_t pid) {
+    bound_task_t *bt;
+
+    hash_for_each_possible_rcu(bound_hash, bt, hnode, pid) {
+        if (bt->pid == pid) {
+            return bt;
+        }
+    }
+    return NULL;
+}
+
+static int add_bound_task(pid_t pid, bound_cgroup_t *cg) {
+    struct task_struct *t;
+    struct mm_struct *mm;
+    struct mmu_notifier *mn;
+    bound_task_t *bt;
+
     if ((MAX_PIDS > 0) && (n_pids >= MAX_PIDS)) {
         pr_info("PLACEMENT: Managed PIDs at capacity.\n");
         return 0;
     }
-    int i;
-    for (i=0; i < n_pids; i++) {
-        if ((task_items[i] != NULL) && (task_items[i]->pid == pid)) {
-            pr_info("PLACEMENT: Already managing given PID.\n");
+    if (bound_lookup(pid) != NULL) {
+        pr_info("PLACEMENT: Already managing given PID.\n");
+        return 0;
+    }
+
+    rcu_read_lock();
+    t = pid_task(find_vpid(pid), PIDTYPE_PID);
+    if (t != NULL) {
+        get_task_struct(t);
+    }
+    rcu_read_unlock();
+    if (t == NULL) {
+        return 0;
+    }
+    mm = get_task_mm(t);
+    put_task_struct(t);
+    if (mm == NULL) {
+        return 0; // kernel thread or exiting
+    }
+
+    if (n_pids == max_bound) {
+        int new_max = max_bound ? (2 * max_bound) : 16;
+        bound_task_t **new_tasks;
+
+        mutex_lock(&bound_lock);
+        new_tasks = krealloc(bound_tasks, sizeof(bound_task_t *) * new_max, GFP_KERNEL);
+        if (new_tasks != NULL) {
+            bound_tasks = new_tasks;
+            max_bound = new_max;
+        }
+        mutex_unlock(&bound_lock);
+        if (new_tasks == NULL) {
+            mmput(mm);
             return 0;
         }
     }
 
-    struct pid *pid_s = find_get_pid(pid);
-    if (pid_s == NULL) {
+    bt = kzalloc(sizeof(bound_task_t), GFP_KERNEL);
+    if (bt == NULL) {
+        mmput(mm);
         return 0;
     }
-    struct task_struct *t = get_pid_task(pid_s, PIDTYPE_PID);
-    if (t != NULL) {
-        task_items[n_pids++] = t;
-        return 1;
+
+    mn = mmu_notifier_get(&bound_mm_ops, mm);
+    if (IS_ERR(mn)) {
+        kfree(bt);
+        mmput(mm);
+        return 0;
+    }
+    bt->bmm = container_of(mn, bound_mm_t, mn);
+    if (!list_empty(&bt->bmm->tasks)) {
+        mmu_notifier_put(mn); // mm already bound through another pid, which owns the reference
     }
 
-    return 0;
+    bt->pid = pid;
+    bt->cg = cg;
+    bt->mm = mm; // kept alive by the notifier (mm_count), walks take mm_users with mmget_not_zero()
+    xa_init(&bt->hist);
+    mutex_init(&bt->regions_lock);
+    refcount_set(&bt->ref, 1);
+    list_add_rcu(&bt->mm_node, &bt->bmm->tasks);
+
+    mutex_lock(&bound_lock);
+    bt->idx = n_pids;
+    bound_tasks[n_pids++] = bt;
+    mutex_unlock(&bound_lock);
+    hash_add_rcu(bound_hash, &bt->hnode, pid);
+
+    mmput(mm);
+    return 1;
+}
+
+// Drops the registry's notifier reference once no bound task uses the mm
+static void put_bound_mm(bound_mm_t *bmm) {
+    if (!list_empty(&bmm->tasks)) {
+        return;
+    }
+    // A queued mm is put by reap_exited_tasks() instead, after taking it off the exit list
+    if (atomic_cmpxchg(&bmm->state, BOUND_MM_LIVE, BOUND_MM_DETACHED) == BOUND_MM_LIVE) {
+        mmu_notifier_put(&bmm->mn);
+    }
+}
+
+// Frees a task once it is unbound and the region sampler is done with it
+static void put_bound_task(bound_task_t *bt) {
+    if (refcount_dec_and_test(&bt->ref)) {
+        kfree(bt->regions);
+        kfree_rcu(bt, rcu);
+    }
 }
 
-static int update_pid_list(int i) {
-    if (last_pid_dram > i) {
-        last_pid_dram--;
+static void remove_bound_task(bound_task_t *bt) {
+    int i = bt->idx;
+    int last = n_pids - 1;
+    int t, d;
+
+    hash_del_rcu(&bt->hnode);
+    list_del_rcu(&bt->mm_node);
+    mutex_lock(&bound_lock);
+
+    // Move the last task into the freed slot, cursors follow it
+    for (t = 0; t < MAX_TIERS; t++) {
+        for (d = 0; d < N_WALK_DIRS; d++) {
+            if (last_pid[t][d] == i) {
+                last_addr[t][d] = 0;
+            }
+            else if (last_pid[t][d] == last) {
+                last_pid[t][d] = i;
+            }
+        }
     }
-    else if (last_pid_dram == i) {
-        last_addr_dram = 0;
+    bound_tasks[i] = bound_tasks[last];
+    bound_tasks[i]->idx = i;
+    n_pids--;
+    mutex_unlock(&bound_lock);
 
-        if (last_pid_dram == (n_pids-1)) {
-            last_pid_dram = 0;
+    for (t = 0; t < MAX_TIERS; t++) {
+        for (d = 0; d < N_WALK_DIRS; d++) {
+            if (last_pid[t][d] >= n_pids) {
+                last_pid[t][d] = 0;
+            }
         }
     }
 
-    if (last_pid_nvram > i) {
-        last_pid_nvram--;
+    xa_destroy(&bt->hist);
+    put_bound_mm(bt->bmm);
+    put_bound_task(bt);
+}
+
+/*
+ * Unbinds every task whose address space went away since the last call. A pid that is still alive
+ * went through exec (the new mm is installed before the old one is released), so it is bound again
+ * on its new address space, through the same cgroup if any, and keeps being managed.
+ */
+static void reap_exited_tasks(void) {
+    struct llist_node *exited = llist_del_all(&exited_mms);
+    bound_mm_t *bmm, *next;
+    bound_task_t *bt, *tmp;
+    bound_cgroup_t *cg;
+    pid_t pid;
+
+    llist_for_each_entry_safe(bmm, next, exited, exit_node) {
+        list_for_each_entry_safe(bt, tmp, &bmm->tasks, mm_node) {
+            pid = bt->pid;
+            cg = bt->cg;
+            remove_bound_task(bt);
+            if (add_bound_task(pid, cg)) {
+                pr_info("PLACEMENT: Rebound PID %d after exec.\n", pid);
+            }
+        }
+        mmu_notifier_put(&bmm->mn);
     }
-    else if (last_pid_nvram == i) {
-        last_addr_nvram = 0;
+}
 
-        if (last_pid_nvram == (n_pids-1)) {
-            last_pid_nvram = 0;
+/*
+ * Binds the processes of a bound cgroup (and of its descendants) that are not bound yet. Pids are
+ * collected under RCU and bound afterwards, at most CGROUP_SCAN_BATCH per call: the remaining ones are
+ * picked up by the next scan since bound processes are skipped. Caller holds req_mutex, which also
+ * guards scan_pids.
+ */
+static pid_t scan_pids[CGROUP_SCAN_BATCH];
+
+static void scan_cgroup(bound_cgroup_t *cg) {
+    struct cgroup_subsys_state *css;
+    struct css_task_iter it;
+    struct task_struct *t;
+    int n = 0, i;
+
+    rcu_read_lock();
+    css_for_each_descendant_pre(css, &cg->cgrp->self) {
+        css_task_iter_start(css, CSS_TASK_ITER_PROCS, &it);
+        while ((n < CGROUP_SCAN_BATCH) && ((t = css_task_iter_next(&it)) != NULL)) {
+            pid_t pid = task_tgid_vnr(t);
+            if (!(t->flags & PF_KTHREAD) && (pid > 0) && (bound_lookup(pid) == NULL)) {
+                scan_pids[n++] = pid;
+            }
         }
+        css_task_iter_end(&it);
     }
+    rcu_read_unlock();
 
-    // Shift left all subsequent entries
-    int j;
-    for (j = i; j < (n_pids - 1); j++) {
-        task_items[j] = task_items[j+1];
+    for (i = 0; i < n; i++) {
+        add_bound_task(scan_pids[i], cg);
     }
+}
 
-    n_pids--;
+// Unbinds the tasks bound through a cgroup that are no longer in it (or in one of its descendants)
+static void prune_cgroup(bound_cgroup_t *cg) {
+    struct task_struct *t;
+    int i, in;
 
-    return 0;
+    // Backwards, so the task swapped into a freed slot has already been checked
+    for (i = n_pids - 1; i >= 0; i--) {
+        if (bound_tasks[i]->cg != cg) {
+            continue;
+        }
+        rcu_read_lock();
+        t = pid_task(find_vpid(bound_tasks[i]->pid), PIDTYPE_PID);
+        in = (t != NULL) && cgroup_is_descendant(task_dfl_cgroup(t), cg->cgrp);
+        rcu_read_unlock();
+        if (!in) {
+            remove_bound_task(bound_tasks[i]);
+        }
+    }
+}
+
+/*
+ * Bound cgroups are rescanned every CGROUP_RESCAN_MS from a delayed work, off the request path: processes
+ * created in them since the last scan are bound and those that moved out are unbound. The work rearms
+ * itself while any cgroup is bound.
+ */
+static void cgroup_scan_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(cgroup_scan_work, cgroup_scan_fn);
+
+static void cgroup_scan_fn(struct work_struct *work) {
+    bound_cgroup_t *cg;
+
+    mutex_lock(&req_mutex);
+    if (!llist_empty(&exited_mms)) {
+        reap_exited_tasks();
+    }
+    list_for_each_entry(cg, &bound_cgroups, node) {
+        prune_cgroup(cg);
+        scan_cgroup(cg);
+    }
+    if (!list_empty(&bound_cgroups)) {
+        schedule_delayed_work(&cgroup_scan_work, msecs_to_jiffies(CGROUP_RESCAN_MS));
+    }
+    mutex_unlock(&req_mutex);
 }
 
 static int refresh_pids(void) {
-    int i;
+    if (!llist_empty(&exited_mms)) {
+        reap_exited_tasks();
+    }
+    return 0;
+}
 
-    for (i=0; i < n_pids; i++) {
-        if((task_items[i] == NULL) || (find_get_pid(task_items[i]->pid) == NULL)) {
-            update_pid_list(i);
-            i--;
-        }
+// Installs a new tier topology. Caller serializes with requests (req_mutex or module init).
+static int set_tiers(const tier_cfg_t *cfg) {
+    int nodes[MAX_TIER_NODES];
+    int t, i, n;
 
+    if (check_tiers(cfg)) {
+        return -EINVAL;
+    }
+    for (t = 0; t < cfg->n_tiers; t++) {
+        n = tier_nodes(cfg, t, nodes);
+        for (i = 0; i < n; i++) {
+            if ((nodes[i] >= MAX_NUMNODES) || !node_state(nodes[i], N_MEMORY)) {
+                pr_info("PLACEMENT: Node %d has no memory.\n", nodes[i]);
+                return -EINVAL;
+            }
+        }
     }
 
-    printk(KERN_INFO "LIST AFTER REFRESH:");
-    for(i=0; i<n_pids; i++) {
-        printk(KERN_INFO "i:%d, pid:%d\n", i, task_items[i]->pid);
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node_tier[i] = -1;
+    }
+    for (t = 0; t < cfg->n_tiers; t++) {
+        n = tier_nodes(cfg, t, nodes);
+        for (i = 0; i < n; i++) {
+            node_tier[nodes[i]] = t;
+        }
     }
+    tiers = *cfg;
 
+    // Tiers may have been renumbered, start all walks over
+    memset(last_pid, 0, sizeof(last_pid));
+    memset(last_addr, 0, sizeof(last_addr));
+
+    pr_info("PLACEMENT: Managing %d memory tiers.\n", tiers.n_tiers);
     return 0;
 }
 
+static inline int pfn_tier(unsigned long pfn) {
+    return node_tier[pfn_to_nid(pfn)];
+}
+
+// Page is on the walked tier, and on one of the nodes the walk is restricted to if any
+static inline int pfn_walked(walk_ctx_t *ctx, unsigned long pfn) {
+    int nid = pfn_to_nid(pfn);
+
+    return (node_tier[nid] == ctx->tier) && ((ctx->nodes == 0) || (ctx->nodes & (1ULL << nid)));
+}
+
 
 
 /*
@@ -165,42 +678,350 @@ CALLBACK FUNCTIONS
 */
 
 
-static int pte_callback_mem(pte_t *ptep, unsigned long addr, unsigned long next,
-                        struct mm_walk *walk) {
+static inline void add_candidate(addr_info_t *list, int *n, unsigned long addr, int pid, int huge) {
+    list[*n].addr = addr;
+    list[*n].pid_retval = pid;
+    list[(*n)++].huge = huge;
+}
+
+/*
+ * Clear functions: the accessed bit is cleared atomically and the TLB is not flushed here, the caller
+ * batches the flush for the whole VMA (see walk_flush_vma). A dirty bit is handed over to the page
+ * before being cleared, as try_to_unmap() does, so that no write-back is lost.
+ * Return 1 if the entry changed and its TLB entry must be flushed.
+ */
+static int clear_pte_bits(struct vm_area_struct *vma, unsigned long addr, pte_t *ptep) {
+    pte_t pte = *ptep;
+    struct page *page = NULL;
+
+    if (pte_dirty(pte) && !pte_special(pte) && !(vma->vm_flags & (VM_PFNMAP | VM_MIXEDMAP)) && pfn_valid(pte_pfn(pte))) {
+        page = pfn_to_page(pte_pfn(pte));
+    }
+    if (page == NULL) {
+        return ptep_test_and_clear_young(vma, addr, ptep);
+    }
+
+    pte = ptep_modify_prot_start(vma, addr, ptep);
+    ptep_modify_prot_commit(vma, addr, ptep, pte, pte_mkclean(pte_mkold(pte)));
+    set_page_dirty(page);
+
+    return 1;
+}
+
+static int clear_pmd_bits(struct vm_area_struct *vma, unsigned long addr, pmd_t *pmdp) {
+    pmd_t pmd = *pmdp;
+
+    if (!pmd_dirty(pmd)) {
+        return pmdp_test_and_clear_young(vma, addr, pmdp);
+    }
+
+    // Same sequence as change_huge_pmd(): invalidate (and flush) first so hardware cannot set A/D bits behind our back
+    pmd = pmdp_invalidate(vma, addr, pmdp);
+    set_pmd_at(vma->vm_mm, addr, pmdp, pmd_mkclean(pmd_mkold(pmd)));
+    set_page_dirty(pmd_page(pmd));
+
+    return 0;
+}
+
+static inline void walk_flush_add(walk_ctx_t *ctx, unsigned long start, unsigned long end) {
+    if (ctx->flush_end == 0) {
+        ctx->flush_start = start;
+    }
+    ctx->flush_end = end;
+}
+
+// post_vma callback: one ranged TLB flush for all entries cleared in the VMA
+static void walk_flush_vma(struct mm_walk *walk) {
+    walk_ctx_t *ctx = walk->private;
+
+    if (ctx->flush_end != 0) {
+        flush_tlb_range(walk->vma, ctx->flush_start, ctx->flush_end);
+    }
+    ctx->flush_start = 0;
+    ctx->flush_end = 0;
+}
+
+// epoch_ms is a snapshot of write_epoch_ms (> 0), which can be written at any time
+static inline unsigned long write_epoch_now(unsigned int epoch_ms) {
+    return div_u64(ktime_to_ms(ktime_get_coarse()), epoch_ms) & HIST_STAMP_MASK;
+}
+
+// Shifts the write registers of all pages of an entry by the write epochs elapsed since it was last updated
+static unsigned long hist_age_writes(unsigned long val, unsigned int epoch_ms) {
+    unsigned long now = write_epoch_now(epoch_ms);
+    unsigned long age = (now - (val >> HIST_STAMP_SHIFT)) & HIST_STAMP_MASK;
+    unsigned long wr;
+    int i;
+
+    if (age == 0) {
+        return val;
+    }
+    for (i = 0; i < HIST_PER_ENTRY; i++) {
+        unsigned int shift = i * HIST_BITS + HIST_EPOCHS;
+
+        wr = (age < HIST_EPOCHS) ? (((val >> shift) << age) & HIST_EPOCH_MASK) : 0;
+        val = (val & ~((unsigned long) HIST_EPOCH_MASK << shift)) | (wr << shift);
+    }
+    return (val & ~(HIST_STAMP_MASK << HIST_STAMP_SHIFT)) | (now << HIST_STAMP_SHIFT);
+}
+
+/*
+ * Per-page history: two HIST_EPOCHS-bit shift registers (accessed bits in the low byte, dirty bits in
+ * the high byte). The accessed register is shifted every time a FIND walk samples the page (access is
+ * set); the clear walk only records writes, so that every accessed sample covers one FIND interval,
+ * or the clear_interval before the FIND when the tier is cleared first. The dirty one is shifted once
+ * per write epoch (write_epoch_ms) and ORs in the samples of the current epoch, so write intensity is
+ * measured over the same time window whichever FIND and clear walks ran in between.
+ * HIST_PER_ENTRY pages share one xarray value entry, indexed by virtual page number so that history
+ * survives migrations, with the write epoch of their last update in the remaining bits. Entries are
+ * erased when their pages are unmapped (see bound_mm_invalidate).
+ */
+static unsigned int hist_update(struct xarray *hist, unsigned long addr, int young, int dirty, int access) {
+    unsigned long vpn = addr >> PAGE_SHIFT;
+    unsigned long idx = vpn / HIST_PER_ENTRY;
+    unsigned int shift = (vpn % HIST_PER_ENTRY) * HIST_BITS;
+    unsigned int epoch_ms = READ_ONCE(write_epoch_ms);
+    unsigned long val = 0;
+    unsigned int h, acc, wr;
+    void *entry;
+
+    xa_lock(hist);
+    entry = xa_load(hist, idx);
+    if (xa_is_value(entry)) {
+        val = xa_to_value(entry);
+    }
+    if (epoch_ms > 0) {
+        val = hist_age_writes(val, epoch_ms);
+    }
+
+    h = (val >> shift) & HIST_MASK;
+    acc = access ? (((h << 1) | (young != 0)) & HIST_EPOCH_MASK) : (h & HIST_EPOCH_MASK);
+    wr = h >> HIST_EPOCHS;
+    if (epoch_ms == 0) {
+        wr <<= 1;
+    }
+    wr = (wr | (dirty != 0)) & HIST_EPOCH_MASK;
+    h = acc | (wr << HIST_EPOCHS);
+
+    val = (val & ~((unsigned long) HIST_MASK << shift)) | ((unsigned long) h << shift);
+    __xa_store(hist, idx, xa_mk_value(val), GFP_NOWAIT); // on failure only this sample is lost
+    xa_unlock(hist);
+
+    return h;
+}
+
+// Forgets the history of the pages in [start, end), so that a new mapping there starts from scratch
+static void hist_erase_range(struct xarray *hist, unsigned long start, unsigned long end) {
+    unsigned long first = start >> PAGE_SHIFT;
+    unsigned long last = (end - 1) >> PAGE_SHIFT;
+    XA_STATE(xas, hist, first / HIST_PER_ENTRY);
+    void *entry;
+    int i;
+
+    xa_lock(hist);
+    xas_for_each(&xas, entry, last / HIST_PER_ENTRY) {
+        unsigned long val = xa_to_value(entry);
+        unsigned long vpn = xas.xa_index * HIST_PER_ENTRY;
+
+        // Entries at both ends may also hold pages outside the range
+        for (i = 0; i < HIST_PER_ENTRY; i++) {
+            if ((vpn + i >= first) && (vpn + i <= last)) {
+                val &= ~((unsigned long) HIST_MASK << (i * HIST_BITS));
+            }
+        }
+        if ((val & ~(HIST_STAMP_MASK << HIST_STAMP_SHIFT)) == 0) {
+            xas_store(&xas, NULL);
+        }
+        else {
+            xas_store(&xas, xa_mk_value(val));
+        }
+    }
+    xa_unlock(hist);
+}
+
+// Single-sample history (used when no history is kept for the walked task)
+static inline unsigned int hist_sample(int young, int dirty) {
+    return (young != 0) | ((dirty != 0) << HIST_EPOCHS);
+}
+
+#define HIST_YOUNG(h) ((h) & 1)
+#define HIST_ACCESS_FREQ(h) ((int) hweight32((h) & HIST_EPOCH_MASK))
+#define HIST_WRITE_FREQ(h) ((int) hweight32((h) >> HIST_EPOCHS))
+
+static inline int hist_hot(unsigned int h) {
+    return HIST_YOUNG(h) && (HIST_ACCESS_FREQ(h) >= hist_hot_freq);
+}
+
+static inline int hist_cold(unsigned int h) {
+    return !HIST_YOUNG(h) && (HIST_ACCESS_FREQ(h) <= hist_cold_freq);
+}
+
+static inline int hist_write_hot(unsigned int h) {
+    return HIST_WRITE_FREQ(h) >= hist_write_freq;
+}
+
+/*
+ * Selection functions: decide from a page's R/M bit history whether it is a candidate (or backup),
+ * shared by the PTE and huge PMD callbacks. Return 1 if the R/M bits should be cleared.
+ */
+typedef int (*select_fn_t)(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge);
 
-    // If found all save last addr
-    if (n_found == n_to_find) {
-        last_addr_dram = addr;
+// Callback return values that stop walk_page_range(): all candidates found, or slice spent (see walk_range_sliced)
+#define WALK_FOUND_ALL 1
+#define WALK_SLICE_END 2
+
+static inline void walk_count_entry(walk_ctx_t *ctx, struct vm_area_struct *vma) {
+    ctx->stats.entries++;
+    if (vma != ctx->last_vma) {
+        ctx->last_vma = vma;
+        ctx->stats.vmas++;
+    }
+}
+
+static inline int walk_slice_end(walk_ctx_t *ctx, unsigned long addr) {
+    if ((scan_slice > 0) && (++ctx->scanned > scan_slice)) {
+        ctx->resume = addr;
         return 1;
     }
+    return 0;
+}
 
-    // If page is not present, write protected, or not in DRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
-        return 0;
+/*
+ * Common PTE/PMD callback bodies. Huge PMDs are handled as a single 2MB entry and their PTE
+ * level is not walked (and therefore not split).
+ */
+static int walk_pte(pte_t *ptep, unsigned long addr, struct mm_walk *walk, select_fn_t select) {
+    walk_ctx_t *ctx = walk->private;
+
+    unsigned int hist;
+
+    // If found all stop walking this range, addr has not been sampled
+    if ((select != NULL) && (ctx->n_found == ctx->n_to_find)) {
+        ctx->resume = addr;
+        return WALK_FOUND_ALL;
+    }
+    if (walk_slice_end(ctx, addr)) {
+        return WALK_SLICE_END;
     }
 
-    if (!pte_young(*ptep)) {
+    walk_count_entry(ctx, walk->vma);
 
-        // Send to NVRAM
-        found_addrs[n_found].addr = addr;
-        found_addrs[n_found++].pid_retval = curr_pid;
+    // If page is not present, write protected, or not in the walked tier
+    if ((ptep == NULL) || !pte_present(*ptep)) {
+        ctx->stats.not_present++;
+        return 0;
+    }
+    if (!pte_write(*ptep)) {
+        ctx->stats.read_only++;
+        return 0;
+    }
+    if (!pfn_walked(ctx, pte_pfn(*ptep))) {
+        ctx->stats.wrong_tier++;
         return 0;
     }
 
-    if (!pte_dirty(*ptep) && (n_backup < (n_to_find - n_found))) {
-            // Add to backup list
-            backup_addrs[n_backup].addr = addr;
-            backup_addrs[n_backup++].pid_retval = curr_pid;
+    if ((ctx != NULL) && (ctx->hist != NULL)) {
+        hist = hist_update(ctx->hist, addr, pte_young(*ptep), pte_dirty(*ptep), select != NULL);
+    }
+    else {
+        hist = hist_sample(pte_young(*ptep), pte_dirty(*ptep));
     }
 
-    pte_t old_pte = ptep_modify_prot_start(walk->vma, addr, ptep);
-    *ptep = pte_mkold(old_pte); // unset modified bit
-    *ptep = pte_mkclean(old_pte); // unset dirty bit
-    ptep_modify_prot_commit(walk->vma, addr, ptep, old_pte, *ptep);
+    if ((select == NULL) || select(ctx, addr, hist, 0)) {
+        if ((pte_young(*ptep) || pte_dirty(*ptep)) && clear_pte_bits(walk->vma, addr, ptep)) {
+            walk_flush_add(ctx, addr, addr + PAGE_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+static int walk_huge_pmd(pmd_t *pmdp, unsigned long addr, struct mm_walk *walk, select_fn_t select) {
+    walk_ctx_t *ctx = walk->private;
+    spinlock_t *ptl;
+    unsigned int hist;
+    pmd_t pmd;
+
+    ptl = pmd_trans_huge_lock(pmdp, walk->vma);
+    if (ptl == NULL) {
+        return 0; // regular page table, walk its PTEs
+    }
+    walk->action = ACTION_CONTINUE;
+
+    // If found all stop walking this range, addr has not been sampled
+    if ((select != NULL) && (ctx->n_found == ctx->n_to_find)) {
+        spin_unlock(ptl);
+        ctx->resume = addr;
+        return WALK_FOUND_ALL;
+    }
+    if (walk_slice_end(ctx, addr)) {
+        spin_unlock(ptl);
+        return WALK_SLICE_END;
+    }
+
+    walk_count_entry(ctx, walk->vma);
+
+    pmd = *pmdp;
+    if (!pmd_present(pmd)) {
+        ctx->stats.not_present++;
+    }
+    else if (!pmd_write(pmd)) {
+        ctx->stats.read_only++;
+    }
+    else if (!pfn_walked(ctx, pmd_pfn(pmd))) {
+        ctx->stats.wrong_tier++;
+    }
+    else {
+        addr &= HPAGE_PMD_MASK;
+        if ((ctx != NULL) && (ctx->hist != NULL)) {
+            hist = hist_update(ctx->hist, addr, pmd_young(pmd), pmd_dirty(pmd), select != NULL);
+        }
+        else {
+            hist = hist_sample(pmd_young(pmd), pmd_dirty(pmd));
+        }
+
+        if ((select == NULL) || select(ctx, addr, hist, 1)) {
+            if ((pmd_young(pmd) || pmd_dirty(pmd)) && clear_pmd_bits(walk->vma, addr, pmdp)) {
+                walk_flush_add(ctx, addr, addr + HPAGE_PMD_SIZE);
+            }
+        }
+    }
 
+    spin_unlock(ptl);
     return 0;
 }
 
+static int select_mem(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge) {
+    if (!HIST_YOUNG(hist)) {
+        if (hist_cold(hist)) {
+            // Send to NVRAM
+            add_candidate(ctx->found, &ctx->n_found, addr, ctx->curr_pid, huge);
+        }
+        else if (ctx->n_backup < (ctx->n_to_find - ctx->n_found)) {
+            // Idle now but used in recent epochs: add to backup list
+            add_candidate(ctx->backup, &ctx->n_backup, addr, ctx->curr_pid, huge);
+        }
+        return 0;
+    }
+
+    if (!hist_write_hot(hist) && (ctx->n_backup < (ctx->n_to_find - ctx->n_found))) {
+        // Add to backup list
+        add_candidate(ctx->backup, &ctx->n_backup, addr, ctx->curr_pid, huge);
+    }
+
+    return 1;
+}
+
+static int pte_callback_mem(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, select_mem);
+}
+
+static int pmd_callback_mem(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, select_mem);
+}
+
 /*static int pte_callback_mem_bal(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
 
@@ -258,66 +1079,68 @@ static int pte_callback_mem_force(pte_t *ptep, unsigned long addr, unsigned long
 }
 */
 
-static int pte_callback_nvram_force(pte_t *ptep, unsigned long addr, unsigned long next,
-                        struct mm_walk *walk) {
-
-    // If found all save last addr
-    if (n_found == n_to_find) {
-        last_addr_nvram = addr;
-        return 1;
+static int select_nvram_force(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge) {
+    if (hist_hot(hist) && hist_write_hot(hist)) {
+        // Send to DRAM (priority)
+        add_candidate(ctx->found, &ctx->n_found, addr, ctx->curr_pid, huge);
+        return 0;
     }
 
-    // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
-        return 0;
+    if (ctx->n_backup < (ctx->n_to_find - ctx->n_found)) {
+        // Add to backup list
+        add_candidate(ctx->backup, &ctx->n_backup, addr, ctx->curr_pid, huge);
     }
 
-    if(pte_young(*ptep) && pte_dirty(*ptep)) {
-        // Send to DRAM (priority)
-        found_addrs[n_found].addr = addr;
-        found_addrs[n_found++].pid_retval = curr_pid;
-        return 0;
-    }
+    return 1;
+}
 
-    if (n_backup < (n_to_find - n_found)) {
-        // Add to backup list
-        backup_addrs[n_backup].addr = addr;
-        backup_addrs[n_backup++].pid_retval = curr_pid;
-    }
+static int pte_callback_nvram_force(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, select_nvram_force);
+}
 
-    pte_t old_pte = ptep_modify_prot_start(walk->vma, addr, ptep);
-    *ptep = pte_mkold(old_pte); // unset modified bit
-    *ptep = pte_mkclean(old_pte); // unset dirty bit
-    ptep_modify_prot_commit(walk->vma, addr, ptep, old_pte, *ptep);
+static int pmd_callback_nvram_force(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, select_nvram_force);
+}
+
+// Write-hot pages (NVRAM_WRITE_MODE, sent by ctl when NVRAM write bandwidth is high), recently written ones first
+static int select_nvram_write(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge) {
+    if (hist_write_hot(hist)) {
+        if (HIST_YOUNG(hist)) {
+            // Send to DRAM (priority)
+            add_candidate(ctx->found, &ctx->n_found, addr, ctx->curr_pid, huge);
+        }
+        else if (ctx->n_backup < (ctx->n_to_find - ctx->n_found)) {
+            // Add to backup list
+            add_candidate(ctx->backup, &ctx->n_backup, addr, ctx->curr_pid, huge);
+        }
+    }
 
     return 0;
 }
 
-// used only for debug in ctl (NVRAM_WRITE_MODE)
 static int pte_callback_nvram_write(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, select_nvram_write);
+}
 
-    // If found all save last addr
-    if (n_found == n_to_find) {
-        last_addr_nvram = addr;
-        return 1;
-    }
-
-    // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
-        return 0;
-    }
+static int pmd_callback_nvram_write(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, select_nvram_write);
+}
 
-    if (pte_dirty(*ptep)) {
-        if (pte_young(*ptep)) {
+static int select_nvram_intensive(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge) {
+    if (hist_hot(hist)) {
+        if (hist_write_hot(hist)) {
             // Send to DRAM (priority)
-            found_addrs[n_found].addr = addr;
-            found_addrs[n_found++].pid_retval = curr_pid;
+            add_candidate(ctx->found, &ctx->n_found, addr, ctx->curr_pid, huge);
+            return 0;
         }
-        else if (n_backup < (n_to_find - n_found)) {
+
+        if (ctx->n_backup < (ctx->n_to_find - ctx->n_found)) {
             // Add to backup list
-            backup_addrs[n_backup].addr = addr;
-            backup_addrs[n_backup++].pid_retval = curr_pid;
+            add_candidate(ctx->backup, &ctx->n_backup, addr, ctx->curr_pid, huge);
         }
     }
 
@@ -326,79 +1149,145 @@ static int pte_callback_nvram_write(pte_t *ptep, unsigned long addr, unsigned lo
 
 static int pte_callback_nvram_intensive(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, select_nvram_intensive);
+}
 
-    // If found all save last addr
-    if (n_found == n_to_find) {
-        last_addr_nvram = addr;
-        return 1;
-    }
-
-    // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
-        return 0;
-    }
+static int pmd_callback_nvram_intensive(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, select_nvram_intensive);
+}
 
-    if(pte_young(*ptep)) {
-        if (pte_dirty(*ptep)) {
+static int select_nvram_switch(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge) {
+    if (hist_hot(hist)) {
+        if (hist_write_hot(hist)) {
             // Send to DRAM (priority)
-            found_addrs[n_found].addr = addr;
-            found_addrs[n_found++].pid_retval = curr_pid;
-            return 0;
+            add_candidate(ctx->found, &ctx->n_found, addr, ctx->curr_pid, huge);
         }
 
-        if (n_backup < (n_to_find - n_found)) {
-            // Add to backup list
-            backup_addrs[n_backup].addr = addr;
-            backup_addrs[n_backup++].pid_retval = curr_pid;
+        // Add to backup list
+        else if (ctx->n_switch_backup < (ctx->n_to_find - ctx->n_found)) {
+            add_candidate(ctx->switch_backup, &ctx->n_switch_backup, addr, ctx->curr_pid, huge);
         }
     }
 
     return 0;
 }
+
 static int pte_callback_nvram_switch(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, select_nvram_switch);
+}
+
+static int pmd_callback_nvram_switch(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, select_nvram_switch);
+}
 
-    // If found all save last addr
-    if (n_found == n_to_find) {
-        last_addr_nvram = addr;
-        return 1;
+// Clear R/M bits of every NVRAM page (no selection)
+static int pte_callback_nvram_clear(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, NULL);
+}
+
+static int pmd_callback_nvram_clear(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, NULL);
+}
+
+// Region sampling: every page of a region selected for its access level is a candidate (bits are left alone)
+static int select_region(walk_ctx_t *ctx, unsigned long addr, unsigned int hist, int huge) {
+    add_candidate(ctx->found, &ctx->n_found, addr, ctx->curr_pid, huge);
+    return 0;
+}
+
+static int pte_callback_region(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_pte(ptep, addr, walk, select_region);
+}
+
+static int pmd_callback_region(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    return walk_huge_pmd(pmdp, addr, walk, select_region);
+}
+
+/*
+ * Region sampling: test and clear the accessed bit of a sampled page (walk->private counts the young
+ * ones). As with page_idle, the TLB is not flushed: a stale TLB entry only hides an access to that page.
+ */
+static int pte_callback_region_sample(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    int *young = walk->private;
+
+    if (pte_present(*ptep) && ptep_test_and_clear_young(walk->vma, addr, ptep)) {
+        (*young)++;
     }
 
-    // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    return 0;
+}
+
+static int pmd_callback_region_sample(pmd_t *pmdp, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    int *young = walk->private;
+    spinlock_t *ptl;
+
+    ptl = pmd_trans_huge_lock(pmdp, walk->vma);
+    if (ptl == NULL) {
         return 0;
     }
+    walk->action = ACTION_CONTINUE;
 
-    if(pte_young(*ptep)) {
-        if (pte_dirty(*ptep)) {
-            // Send to DRAM (priority)
-            found_addrs[n_found].addr = addr;
-            found_addrs[n_found++].pid_retval = curr_pid;
-        }
+    if (pmd_present(*pmdp) && pmdp_test_and_clear_young(walk->vma, addr & HPAGE_PMD_MASK, pmdp)) {
+        (*young)++;
+    }
 
-        // Add to backup list
-        else if (n_switch_backup < (n_to_find - n_found)) {
-            switch_backup_addrs[n_switch_backup].addr = addr;
-            switch_backup_addrs[n_switch_backup++].pid_retval = curr_pid;
-        }
+    spin_unlock(ptl);
+    return 0;
+}
+
+// Count resident base pages per tier into ctx->tier_pages
+static int pte_callback_count(pte_t *ptep, unsigned long addr, unsigned long next,
+                        struct mm_walk *walk) {
+    walk_ctx_t *ctx = walk->private;
+    int tier;
+
+    if (walk_slice_end(ctx, addr)) {
+        return WALK_SLICE_END;
+    }
+    if ((ptep == NULL) || !pte_present(*ptep)) {
+        return 0;
+    }
+    tier = pfn_tier(pte_pfn(*ptep));
+    if (tier >= 0) {
+        ctx->tier_pages[tier]++;
     }
 
     return 0;
 }
 
-static int pte_callback_nvram_clear(pte_t *ptep, unsigned long addr, unsigned long next,
+static int pmd_callback_count(pmd_t *pmdp, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
+    walk_ctx_t *ctx = walk->private;
+    spinlock_t *ptl;
+    int tier;
 
-    // If  page is not present, write protected, or page is not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    ptl = pmd_trans_huge_lock(pmdp, walk->vma);
+    if (ptl == NULL) {
         return 0;
     }
+    walk->action = ACTION_CONTINUE;
 
-    pte_t old_pte = ptep_modify_prot_start(walk->vma, addr, ptep);
-    *ptep = pte_mkold(old_pte); // unset modified bit
-    *ptep = pte_mkclean(old_pte); // unset dirty bit
-    ptep_modify_prot_commit(walk->vma, addr, ptep, old_pte, *ptep);
+    if (walk_slice_end(ctx, addr)) {
+        spin_unlock(ptl);
+        return WALK_SLICE_END;
+    }
+    if (pmd_present(*pmdp)) {
+        tier = pfn_tier(pmd_pfn(*pmdp));
+        if (tier >= 0) {
+            ctx->tier_pages[tier] += HPAGE_PMD_NR;
+        }
+    }
 
+    spin_unlock(ptl);
     return 0;
 }
 
@@ -440,82 +1329,403 @@ PAGE WALKERS
 
 
 
-static int do_page_walk(struct mm_walk_ops mem_walk_ops, int last_pid, unsigned long last_addr) {
-    struct mm_struct *mm;
-    int i;
-    // begin at last_pid->last_addr
-    mm = task_items[last_pid]->mm;
-    curr_pid = task_items[last_pid]->pid;
+static inline ktime_t walk_deadline(void) {
+    return scan_budget_us ? ktime_add_us(ktime_get(), scan_budget_us) : KTIME_MAX;
+}
+
+static void walk_stats_add(walk_stats_t *sum, const walk_stats_t *st) {
+    sum->entries += st->entries;
+    sum->vmas += st->vmas;
+    sum->not_present += st->not_present;
+    sum->read_only += st->read_only;
+    sum->wrong_tier += st->wrong_tier;
+}
 
-    if(mm != NULL) {
+// Per-task walk cost, shown in debugfs. Caller holds req_mutex.
+static inline void walk_account_task(bound_task_t *bt, unsigned long entries, u64 ns) {
+    bt->walk_entries += entries;
+    bt->walk_ns += ns;
+}
+
+/*
+ * Walks [start, end) of an mm in slices of scan_slice entries. The mmap lock is dropped and the walker
+ * reschedules between slices, so that page faults and mmap calls of the walked process are not stalled
+ * behind a whole address space walk. Stops early once the deadline has passed.
+ * Returns end if the range was walked, the first address not sampled otherwise (the callbacks found
+ * all candidates or the deadline passed).
+ */
+static unsigned long walk_range_sliced(struct mm_struct *mm, unsigned long start, unsigned long end,
+                        const struct mm_walk_ops *ops, walk_ctx_t *ctx, ktime_t deadline) {
+    unsigned long addr = start;
+
+    while (addr < end) {
+        int ret;
+
+        ctx->scanned = 0;
         mmap_read_lock(mm);
-        walk_page_range(mm, last_addr, MAX_ADDRESS, &mem_walk_ops, NULL);
+        ret = walk_page_range(mm, addr, end, ops, ctx);
         mmap_read_unlock(mm);
+        if (ret == WALK_FOUND_ALL) {
+            return ctx->resume;
+        }
+        if (ret != WALK_SLICE_END) {
+            return end;
+        }
+
+        addr = ctx->resume;
+        cond_resched();
+        if (ktime_after(ktime_get(), deadline)) {
+            break;
+        }
     }
+    return addr;
+}
 
-    if (n_found >= n_to_find) {
-        return last_pid;
+static void run_walk_jobs(walk_worker_t *w, int worker_id) {
+    walk_ctx_t *ctx = &w->ctx;
+    int j;
+
+    ctx->n_found = 0;
+    ctx->n_backup = 0;
+    ctx->n_switch_backup = 0;
+    ctx->n_to_find = walk_quota;
+    ctx->tier = walk_tier;
+    ctx->nodes = walk_nodes;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->last_vma = NULL;
+
+    while ((j = atomic_inc_return(&next_walk_job) - 1) < n_walk_jobs) {
+        walk_job_t *job = &walk_jobs[j];
+        unsigned long entries = ctx->stats.entries;
+        ktime_t t0;
+
+        job->worker = worker_id;
+        job->found_start = ctx->n_found;
+        job->backup_start = ctx->n_backup;
+        job->switch_backup_start = ctx->n_switch_backup;
+
+        // Skip remaining jobs once the pool as a whole has found enough or the scan budget is spent
+        job->resume = job->start;
+        job->ns = 0;
+        if ((atomic_read(&walk_total) < walk_quota) && (ctx->n_found < ctx->n_to_find) &&
+            !ktime_after(ktime_get(), walk_expires)) {
+            ctx->curr_pid = job->pid;
+            ctx->hist = job->hist;
+            t0 = ktime_get();
+            job->resume = walk_range_sliced(job->mm, job->start, job->end, walk_ops, ctx, walk_expires);
+            job->ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+        }
+        job->entries = ctx->stats.entries - entries;
+
+        job->n_found = ctx->n_found - job->found_start;
+        job->n_backup = ctx->n_backup - job->backup_start;
+        job->n_switch_backup = ctx->n_switch_backup - job->switch_backup_start;
+        atomic_add(job->n_found, &walk_total);
     }
+}
 
-    for (i=last_pid+1; i<n_pids; i++) {
+static int walk_worker_fn(void *data) {
+    walk_worker_t *w = data;
+    int worker_id = w - walkers;
 
-        mm = task_items[i]->mm;
-        curr_pid = task_items[i]->pid;
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(walk_wq, (READ_ONCE(walk_gen) != w->seen_gen) || kthread_should_stop());
+        if (kthread_should_stop()) {
+            break;
+        }
+        w->seen_gen = READ_ONCE(walk_gen);
+        smp_rmb(); // pairs with smp_wmb() in do_page_walk
 
-        if(mm != NULL) {
-            mmap_read_lock(mm);
-            walk_page_range(mm, 0, MAX_ADDRESS, &mem_walk_ops, NULL);
-            mmap_read_unlock(mm);
+        run_walk_jobs(w, worker_id);
+
+        if (atomic_dec_and_test(&walkers_pending)) {
+            complete(&walk_done);
         }
+    }
 
-        if (n_found >= n_to_find) {
-            return i;
+    return 0;
+}
+
+static void add_walk_job(struct mm_struct *mm, int task_idx, unsigned long start, unsigned long end) {
+    walk_job_t *job = &walk_jobs[n_walk_jobs++];
+
+    job->mm = mm;
+    job->hist = &bound_tasks[task_idx]->hist;
+    job->task_idx = task_idx;
+    job->pid = bound_tasks[task_idx]->pid;
+    job->start = start;
+    job->end = end;
+    job->resume = start;
+    job->entries = 0;
+    job->ns = 0;
+}
+
+// Splits [start, end) of a bound mm into at most n_walkers jobs of similar mapped size
+static void add_mm_jobs(struct mm_struct **mms, int task_idx, unsigned long start, unsigned long end) {
+    struct mm_struct *mm = mms[task_idx];
+    struct vm_area_struct *vma;
+    unsigned long total = 0;
+    unsigned long chunk, acc = 0;
+    unsigned long job_start = start;
+    int n_mm_jobs = 1;
+
+    if ((mm == NULL) || (start >= end)) {
+        return;
+    }
+
+    mmap_read_lock(mm);
+    for (vma = mm->mmap; vma != NULL; vma = vma->vm_next) {
+        unsigned long vstart = max(vma->vm_start, start);
+        unsigned long vend = min(vma->vm_end, end);
+        if (vstart < vend) {
+            total += vend - vstart;
         }
     }
 
-    for (i = 0; i < last_pid; i++) {
-        mm = task_items[i]->mm;
-        curr_pid = task_items[i]->pid;
+    chunk = max(total / n_walkers, (unsigned long) WALK_MIN_CHUNK);
 
-        if(mm != NULL) {
-            mmap_read_lock(mm);
-            walk_page_range(mm, 0, MAX_ADDRESS, &mem_walk_ops, NULL);
-            mmap_read_unlock(mm);
+    for (vma = mm->mmap; (vma != NULL) && (n_mm_jobs < n_walkers); vma = vma->vm_next) {
+        unsigned long vstart = max(vma->vm_start, start);
+        unsigned long vend = min(vma->vm_end, end);
+        if (vstart >= vend) {
+            continue;
         }
-        if (n_found >= n_to_find) {
-            return i;
+
+        // Cut inside large VMAs so that a single big heap is still split across workers
+        while (n_mm_jobs < n_walkers) {
+            unsigned long cut = ALIGN(vstart + (chunk - acc), PMD_SIZE);
+            if (cut >= vend) {
+                break;
+            }
+            add_walk_job(mm, task_idx, job_start, cut);
+            n_mm_jobs++;
+            job_start = vstart = cut;
+            acc = 0;
+        }
+
+        acc += vend - vstart;
+        if ((acc >= chunk) && (n_mm_jobs < n_walkers)) {
+            add_walk_job(mm, task_idx, job_start, vend);
+            n_mm_jobs++;
+            job_start = vend;
+            acc = 0;
         }
     }
+    mmap_read_unlock(mm);
 
-    // finish cycle at last_pid->last_addr
-    mm = task_items[last_pid]->mm;
-    curr_pid = task_items[last_pid]->pid;
+    add_walk_job(mm, task_idx, job_start, end);
+}
 
-    if(mm != NULL) {
-        mmap_read_lock(mm);
-        walk_page_range(mm, 0, last_addr+1, &mem_walk_ops, NULL);
-        mmap_read_unlock(mm);
+/*
+ * Walks all bound processes with the worker pool, beginning at last_pid->last_addr, and appends the
+ * per-worker candidates to found_addrs/backup_addrs/switch_backup_addrs in walk order.
+ * Workers only check the quota between jobs, so jobs past the last candidate taken may have been walked
+ * too: their bits are cleared and their history shifted. last_pid/last_addr are therefore moved to the
+ * end of the furthest range walked, not after the last candidate, so that the next walk does not sample
+ * those pages again right away (their candidates are dropped and found again on the next cycle).
+ */
+static void do_page_walk(const struct mm_walk_ops *mem_walk_ops, int *last_pid, unsigned long *last_addr) {
+    struct mm_struct **mms;
+    int i, j, k;
+    int furthest = -1; // last job walked, jobs are started in walk order
+
+    mms = kmalloc_array(n_pids, sizeof(struct mm_struct *), GFP_KERNEL);
+    walk_jobs = kvmalloc_array((n_pids + 1) * n_walkers, sizeof(walk_job_t), GFP_KERNEL);
+    if ((mms == NULL) || (walk_jobs == NULL)) {
+        pr_err("PLACEMENT: Failed to allocate page walk jobs.\n");
+        kfree(mms);
+        kvfree(walk_jobs);
+        return;
+    }
+
+    for (i = 0; i < n_pids; i++) {
+        mms[i] = mmget_not_zero(bound_tasks[i]->mm) ? bound_tasks[i]->mm : NULL;
+    }
+
+    // begin at last_pid->last_addr and finish cycle at last_pid->last_addr
+    n_walk_jobs = 0;
+    add_mm_jobs(mms, *last_pid, *last_addr, MAX_ADDRESS);
+    for (i = *last_pid + 1; i < n_pids; i++) {
+        add_mm_jobs(mms, i, 0, MAX_ADDRESS);
+    }
+    for (i = 0; i < *last_pid; i++) {
+        add_mm_jobs(mms, i, 0, MAX_ADDRESS);
+    }
+    add_mm_jobs(mms, *last_pid, 0, *last_addr);
+
+    walk_ops = mem_walk_ops;
+    walk_quota = n_to_find - n_found;
+    walk_expires = walk_deadline();
+    atomic_set(&next_walk_job, 0);
+    atomic_set(&walk_total, 0);
+    atomic_set(&walkers_pending, n_walkers);
+    reinit_completion(&walk_done);
+
+    smp_wmb();
+    WRITE_ONCE(walk_gen, walk_gen + 1);
+    wake_up_all(&walk_wq);
+    wait_for_completion(&walk_done);
+
+    for (i = 0; i < n_walkers; i++) {
+        walk_stats_add(&req_stats, &walkers[i].ctx.stats);
+    }
+    for (j = 0; j < n_walk_jobs; j++) {
+        walk_job_t *job = &walk_jobs[j];
+
+        if (job->ns > 0) {
+            walk_account_task(bound_tasks[job->task_idx], job->entries, job->ns);
+            trace_ambix_walk_job(job->pid, job->start, job->end, job->resume, job->entries,
+                                 job->n_found, job->n_backup + job->n_switch_backup, job->ns);
+        }
+    }
+
+    // Merge per-worker lists in walk order
+    for (j = 0; (j < n_walk_jobs) && (n_found < n_to_find); j++) {
+        walk_job_t *job = &walk_jobs[j];
+        walk_ctx_t *ctx = &walkers[job->worker].ctx;
+
+        for (k = 0; (k < job->n_found) && (n_found < n_to_find); k++) {
+            found_addrs[n_found++] = ctx->found[job->found_start + k];
+        }
+    }
+    for (j = 0; (j < n_walk_jobs) && (n_backup < (n_to_find - n_found)); j++) {
+        walk_job_t *job = &walk_jobs[j];
+        walk_ctx_t *ctx = &walkers[job->worker].ctx;
+
+        for (k = 0; (k < job->n_backup) && (n_backup < (n_to_find - n_found)); k++) {
+            backup_addrs[n_backup++] = ctx->backup[job->backup_start + k];
+        }
     }
+    for (j = 0; (j < n_walk_jobs) && (n_switch_backup < (n_to_find - n_found)); j++) {
+        walk_job_t *job = &walk_jobs[j];
+        walk_ctx_t *ctx = &walkers[job->worker].ctx;
 
-    return last_pid;
+        for (k = 0; (k < job->n_switch_backup) && (n_switch_backup < (n_to_find - n_found)); k++) {
+            switch_backup_addrs[n_switch_backup++] = ctx->switch_backup[job->switch_backup_start + k];
+        }
+    }
+
+    // Resume where the furthest job stopped: its end, or the first page it left unsampled (found all or
+    // out of budget). A huge page is not resumed inside, walk_huge_pmd stops before sampling it.
+    for (j = 0; j < n_walk_jobs; j++) {
+        if (walk_jobs[j].resume > walk_jobs[j].start) {
+            furthest = j;
+        }
+    }
+    if (furthest >= 0) {
+        *last_pid = walk_jobs[furthest].task_idx;
+        *last_addr = walk_jobs[furthest].resume;
+    }
+
+    for (i = 0; i < n_pids; i++) {
+        if (mms[i] != NULL) {
+            mmput(mms[i]);
+        }
+    }
+    kfree(mms);
+    kvfree(walk_jobs);
+    walk_jobs = NULL;
 }
 
-static int mem_walk(int n, int mode) {
-    struct mm_walk_ops mem_walk_ops = {};
-    int dram_walk = 0;
+typedef struct region_ref {
+    bound_task_t *bt;
+    region_t region; // copy, the sampler may reshape the regions meanwhile
+} region_ref_t;
+
+static int cmp_region_cold(const void *a, const void *b) {
+    const region_ref_t *ra = a, *rb = b;
+
+    return (int) ra->region.last_accesses - (int) rb->region.last_accesses;
+}
+
+static int cmp_region_hot(const void *a, const void *b) {
+    return cmp_region_cold(b, a);
+}
+
+/*
+ * FIND with region sampling: takes the pages of walk_tier in the coldest regions (DEMOTE_WALK) or the
+ * hottest ones (PROMOTE_WALK) of all bound processes, so the walk only covers the regions needed to
+ * fill the reply. Regions that are neither hot nor cold are skipped. Caller holds req_mutex.
+ */
+static void region_find(int dir) {
+    struct mm_walk_ops ops = {.pmd_entry = pmd_callback_region, .pte_entry = pte_callback_region};
+    walk_ctx_t ctx = {.found = found_addrs, .n_found = n_found, .n_to_find = n_to_find, .tier = walk_tier,
+                      .nodes = walk_nodes};
+    ktime_t deadline = walk_deadline();
+    ktime_t t0;
+    unsigned long entries;
+    region_ref_t *refs;
+    int n_refs = 0, total = 0;
+    int i, r;
+
+    for (i = 0; i < n_pids; i++) {
+        total += READ_ONCE(bound_tasks[i]->n_regions);
+    }
+    refs = kvmalloc_array(total, sizeof(region_ref_t), GFP_KERNEL);
+    if (refs == NULL) {
+        return;
+    }
+
+    for (i = 0; i < n_pids; i++) {
+        bound_task_t *bt = bound_tasks[i];
+
+        mutex_lock(&bt->regions_lock);
+        // The sampler may have added regions since they were counted
+        for (r = 0; (r < bt->n_regions) && (n_refs < total); r++) {
+            int acc = bt->regions[r].last_accesses;
+            if ((dir == DEMOTE_WALK) ? (acc <= region_cold_accesses) : (acc >= region_hot_accesses)) {
+                refs[n_refs].bt = bt;
+                refs[n_refs++].region = bt->regions[r];
+            }
+        }
+        mutex_unlock(&bt->regions_lock);
+    }
+    sort(refs, n_refs, sizeof(region_ref_t), (dir == DEMOTE_WALK) ? cmp_region_cold : cmp_region_hot, NULL);
+
+    for (i = 0; (i < n_refs) && (ctx.n_found < ctx.n_to_find); i++) {
+        struct mm_struct *mm = refs[i].bt->mm;
+        region_t *reg = &refs[i].region;
+        unsigned long addr;
+
+        if (!mmget_not_zero(mm)) {
+            continue;
+        }
+        ctx.curr_pid = refs[i].bt->pid;
+        entries = ctx.stats.entries;
+        t0 = ktime_get();
+        addr = walk_range_sliced(mm, reg->start, reg->end, &ops, &ctx, deadline);
+        walk_account_task(refs[i].bt, ctx.stats.entries - entries, ktime_to_ns(ktime_sub(ktime_get(), t0)));
+        mmput(mm);
+        if (addr < reg->end) {
+            break; // out of budget, or found all
+        }
+    }
+
+    n_found = ctx.n_found;
+    walk_stats_add(&req_stats, &ctx.stats);
+    kvfree(refs);
+}
+
+static int mem_walk(int n, int mode, int tier, unsigned long long nodes) {
+    struct mm_walk_ops mem_walk_ops = {.post_vma = walk_flush_vma};
+    int dir = PROMOTE_WALK;
 
     switch (mode) {
         case DRAM_MODE:
+            mem_walk_ops.pmd_entry = pmd_callback_mem;
             mem_walk_ops.pte_entry = pte_callback_mem;
-            dram_walk = 1;
+            dir = DEMOTE_WALK;
             break;
         case NVRAM_MODE:
+            mem_walk_ops.pmd_entry = pmd_callback_nvram_force;
             mem_walk_ops.pte_entry = pte_callback_nvram_force;
             break;
         case NVRAM_INTENSIVE_MODE:
+            mem_walk_ops.pmd_entry = pmd_callback_nvram_intensive;
             mem_walk_ops.pte_entry = pte_callback_nvram_intensive;
             break;
         case NVRAM_WRITE_MODE:
+            mem_walk_ops.pmd_entry = pmd_callback_nvram_write;
             mem_walk_ops.pte_entry = pte_callback_nvram_write;
             break;
         default:
@@ -523,15 +1733,25 @@ static int mem_walk(int n, int mode) {
             return 0;
     }
 
+    // Pages move between adjacent tiers only
+    if (((dir == DEMOTE_WALK) && (tier == tiers.n_tiers - 1)) || ((dir == PROMOTE_WALK) && (tier == 0))) {
+        pr_info("PLACEMENT: No adjacent tier to move tier %d pages to.\n", tier);
+        return -1;
+    }
+
     n_to_find = n;
     n_backup = 0;
 
-    if (dram_walk) {
-        last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
+    mutex_lock(&walk_mutex);
+    walk_tier = tier;
+    walk_nodes = nodes;
+    if (region_sampling) {
+        region_find(dir);
     }
     else {
-        last_pid_nvram = do_page_walk(mem_walk_ops, last_pid_nvram, last_addr_nvram);
+        do_page_walk(&mem_walk_ops, &last_pid[tier][dir], &last_addr[tier][dir]);
     }
+    mutex_unlock(&walk_mutex);
 
     if (n_found >= n_to_find) {
         return 0;
@@ -541,8 +1761,7 @@ static int mem_walk(int n, int mode) {
         int i;
 
         for (i=0; (i < remaining) && (i < n_backup); i++) {
-            found_addrs[n_found].addr = backup_addrs[i].addr;
-            found_addrs[n_found++].pid_retval = backup_addrs[i].pid_retval;
+            found_addrs[n_found++] = backup_addrs[i];
         }
 
         if (n_found >= n_to_find) {
@@ -552,19 +1771,62 @@ static int mem_walk(int n, int mode) {
     return -1;
 }
 
-static int clear_walk(int mode) {
+// Clears the R/M bits of the tier's pages, within the scan budget (the next clear resumes where this one stopped)
+static int clear_walk(int tier) {
     struct mm_struct *mm;
-    struct mm_walk_ops mem_walk_ops = {.pte_entry = pte_callback_nvram_clear};
+    struct mm_walk_ops mem_walk_ops = {.pmd_entry = pmd_callback_nvram_clear, .pte_entry = pte_callback_nvram_clear,
+                                       .post_vma = walk_flush_vma};
+
+    walk_ctx_t ctx = {.tier = tier};
+    int *cur_pid = &last_pid[tier][CLEAR_WALK];
+    unsigned long *cur_addr = &last_addr[tier][CLEAR_WALK];
+    int first = *cur_pid;
+    unsigned long first_addr = *cur_addr;
+    ktime_t deadline = walk_deadline();
+    ktime_t t0;
+    unsigned long entries;
+    u64 ns;
+
+    // The region sampler clears the bits of the pages it samples
+    if (region_sampling || (n_pids == 0)) {
+        return 0;
+    }
 
-    int i;
-    for (i=0; i < n_pids; i++) {
-        mm = task_items[i]->mm;
-        spin_lock(&mm->page_table_lock);
-        curr_pid = task_items[i]->pid;
-        walk_page_range(mm, 0, MAX_ADDRESS, &mem_walk_ops, NULL);
-        spin_unlock(&mm->page_table_lock);
+    // begin at the cursor and finish cycle at the cursor
+    int n;
+    for (n = 0; n <= n_pids; n++) {
+        int i = (first + n) % n_pids;
+        unsigned long start = (n == 0) ? first_addr : 0;
+        unsigned long end = (n == n_pids) ? first_addr : MAX_ADDRESS;
+        unsigned long addr;
+
+        if (ktime_after(ktime_get(), deadline)) {
+            *cur_pid = i;
+            *cur_addr = start;
+            break;
+        }
+
+        mm = bound_tasks[i]->mm;
+        if ((start >= end) || !mmget_not_zero(mm)) {
+            continue;
+        }
+        ctx.hist = &bound_tasks[i]->hist; // clearing records the dirty bits it clears (see hist_update)
+        entries = ctx.stats.entries;
+        t0 = ktime_get();
+        addr = walk_range_sliced(mm, start, end, &mem_walk_ops, &ctx, deadline);
+        ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+        walk_account_task(bound_tasks[i], ctx.stats.entries - entries, ns);
+        trace_ambix_walk_job(bound_tasks[i]->pid, start, end, addr, ctx.stats.entries - entries, 0, 0, ns);
+        mmput(mm);
+
+        if (addr < end) {
+            *cur_pid = i;
+            *cur_addr = addr;
+            break;
+        }
     }
 
+    walk_stats_add(&req_stats, &ctx.stats);
     return 0;
 }
 
@@ -605,93 +1867,804 @@ static int clear_walk(int mode) {
     }
     printk(KERN_CONT " BALANCE FOUND: %d pages\n", pages_found);
 
-    return pages_found * n / 1000;
-} */
+    return pages_found * n / 1000;
+} */
+
+// Exchanges hot pages of the given tier (on nodes, if not 0) with cold pages of the previous (faster) one
+static int switch_walk(int n, int tier, unsigned long long nodes) {
+    struct mm_walk_ops mem_walk_ops = {.pmd_entry = pmd_callback_nvram_switch, .pte_entry = pte_callback_nvram_switch,
+                                       .post_vma = walk_flush_vma};
+
+    if (tier == 0) {
+        pr_info("PLACEMENT: No faster tier to switch tier 0 pages with.\n");
+        return -1;
+    }
+
+    n_to_find = n;
+    n_switch_backup = 0;
+
+    mutex_lock(&walk_mutex);
+    walk_tier = tier;
+    walk_nodes = nodes;
+    if (region_sampling) {
+        region_find(PROMOTE_WALK);
+    }
+    else {
+        do_page_walk(&mem_walk_ops, &last_pid[tier][PROMOTE_WALK], &last_addr[tier][PROMOTE_WALK]);
+    }
+    mutex_unlock(&walk_mutex);
+
+    found_addrs[n_found].pid_retval = 0; // fill separator after
+    if ((n_found == 0) && (n_switch_backup == 0)) {
+        n_found++;
+        return -1;
+    }
+
+    int nvram_found = n_found; // store the number of ideal nvram pages found
+    int dram_to_find = int_min(nvram_found + n_switch_backup, n);
+    n_found++;
+    n_to_find = n_found + dram_to_find; // try to find the same amount of dram addrs
+    n_backup = 0;
+
+    mem_walk_ops.pmd_entry = pmd_callback_mem;
+    mem_walk_ops.pte_entry = pte_callback_mem;
+    mutex_lock(&walk_mutex);
+    walk_tier = tier - 1;
+    walk_nodes = 0;
+    if (region_sampling) {
+        region_find(DEMOTE_WALK);
+    }
+    else {
+        do_page_walk(&mem_walk_ops, &last_pid[tier - 1][DEMOTE_WALK], &last_addr[tier - 1][DEMOTE_WALK]);
+    }
+    mutex_unlock(&walk_mutex);
+    int dram_found = n_found - nvram_found - 1;
+    // found equal number of dram and nvram entries
+    if (dram_found == nvram_found) {
+        return 0;
+    }
+    else if ((dram_found < nvram_found) && (n_backup > 0)) {
+        int remaining = nvram_found - dram_found;
+        int to_add;
+
+        if (n_backup < remaining) {
+            // shift left dram entries (discard excess nvram addrs)
+            int old_dram_start = nvram_found + 1;
+            nvram_found = dram_found + n_backup; // update nvram_found and discard other entries
+            int new_dram_start = nvram_found + 1;
+            found_addrs[nvram_found].pid_retval = 0; // fill separator after nvram pages
+
+            int i;
+            for (i = 0; i < dram_found; i++) {
+                found_addrs[new_dram_start + i] = found_addrs[old_dram_start + i];
+            }
+            to_add = n_backup;
+            n_found = new_dram_start + dram_found;
+        }
+        else {
+            to_add = remaining;
+        }
+        int i;
+        for (i = 0; i < to_add; i++) {
+            found_addrs[n_found++] = backup_addrs[i];
+        }
+
+    }
+    else if ((nvram_found < dram_found) && (n_switch_backup > 0)) {
+        int remaining = dram_found - nvram_found;
+        int to_add = int_min(n_switch_backup, remaining);
+        int i;
+        int old_dram_start = nvram_found + 1;
+        int new_dram_start = old_dram_start + to_add;
+        dram_found = nvram_found + to_add;
+
+        // shift right dram entries
+        for (i = dram_found - 1; i >= 0; i--) {
+            found_addrs[new_dram_start + i] = found_addrs[old_dram_start + i];
+        }
+
+        for (i = 0; i < to_add; i++) {
+            found_addrs[nvram_found++] = switch_backup_addrs[i];
+        }
+        found_addrs[nvram_found].pid_retval = 0;
+        n_found = nvram_found * 2 + 1; // discard last entries
+    }
+    else {
+        found_addrs[0].pid_retval = 0;
+        n_found = 1;
+    }
+
+
+    return 0;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+REGION SAMPLING
+
+-------------------------------------------------------------------------------
+*/
+
+
+
+/*
+ * DAMON-style access sampling (region_sampling=1): each bound mm is split into regions whose pages are
+ * assumed to be accessed alike. Every sample_us the sampler thread checks the accessed bit of one random
+ * page per region, and every aggr_us adjacent regions with similar access counts are merged and the
+ * rest split in two, so that the regions follow the access pattern. Monitoring costs O(max_regions) per
+ * process and interval regardless of its size. FIND requests then walk the hottest/coldest regions
+ * only (see region_find). The sampler does not take req_mutex: it pins one task at a time (see
+ * get_sampled_task) and works on its regions under the task's regions_lock, which region_find takes
+ * only to copy them. Areas and regions are never empty, so every region has a page to sample.
+ */
+
+typedef struct addr_range {
+    unsigned long start, end;
+} addr_range_t;
+
+struct task_struct *region_sampler;
+int n_aggrs = 0;
+
+static const struct mm_walk_ops region_sample_ops = {
+    .pmd_entry = pmd_callback_region_sample,
+    .pte_entry = pte_callback_region_sample,
+};
+
+// Caller holds the mmap lock
+static int region_young(struct mm_struct *mm, unsigned long addr) {
+    int young = 0;
+
+    walk_page_range(mm, addr, addr + PAGE_SIZE, &region_sample_ops, &young);
+    return young;
+}
+
+static inline unsigned long region_pages(const region_t *reg) {
+    return (reg->end - reg->start) >> PAGE_SHIFT;
+}
+
+// Caller makes sure the region is not empty
+static inline unsigned long region_random_addr(const region_t *reg) {
+    return reg->start + ((get_random_long() % region_pages(reg)) << PAGE_SHIFT);
+}
+
+// Mapped part of an mm, as its whole range minus the two largest gaps between VMAs. Caller holds the mmap lock.
+static int mm_areas(struct mm_struct *mm, addr_range_t *areas) {
+    struct vm_area_struct *vma, *prev = NULL;
+    addr_range_t gaps[REGION_AREAS - 1] = {}; // largest first
+    unsigned long start;
+    int n = 0, g;
+
+    if (mm->mmap == NULL) {
+        return 0;
+    }
+
+    for (vma = mm->mmap; vma != NULL; prev = vma, vma = vma->vm_next) {
+        if (prev == NULL) {
+            continue;
+        }
+        for (g = 0; g < REGION_AREAS - 1; g++) {
+            if ((vma->vm_start - prev->vm_end) > (gaps[g].end - gaps[g].start)) {
+                memmove(&gaps[g + 1], &gaps[g], sizeof(addr_range_t) * (REGION_AREAS - 2 - g));
+                gaps[g].start = prev->vm_end;
+                gaps[g].end = vma->vm_start;
+                break;
+            }
+        }
+    }
+
+    // Areas in address order
+    if (gaps[0].start > gaps[1].start) {
+        swap(gaps[0], gaps[1]);
+    }
+    start = mm->mmap->vm_start;
+    for (g = 0; g < REGION_AREAS - 1; g++) {
+        if (gaps[g].end > gaps[g].start) {
+            areas[n].start = start;
+            areas[n++].end = gaps[g].start;
+            start = gaps[g].end;
+        }
+    }
+    areas[n].start = start;
+    areas[n++].end = prev->vm_end;
+
+    return n;
+}
+
+static void add_region(bound_task_t *bt, unsigned long start, unsigned long end) {
+    region_t *reg = &bt->regions[bt->n_regions++];
+
+    reg->start = start;
+    reg->end = end;
+    reg->sample = 0;
+    reg->nr_accesses = 0;
+    reg->last_accesses = 0;
+}
+
+// Regions of a newly sampled task: its areas split evenly into min_regions regions
+static int init_regions(bound_task_t *bt, struct mm_struct *mm) {
+    addr_range_t areas[REGION_AREAS];
+    int n_areas, a, k;
+
+    bt->regions = kmalloc_array(2 * max_regions, sizeof(region_t), GFP_KERNEL);
+    if (bt->regions == NULL) {
+        return -ENOMEM;
+    }
+    bt->n_regions = 0;
+
+    mmap_read_lock(mm);
+    n_areas = mm_areas(mm, areas);
+    mmap_read_unlock(mm);
+
+    for (a = 0; a < n_areas; a++) {
+        unsigned long pages = (areas[a].end - areas[a].start) >> PAGE_SHIFT;
+        unsigned long pieces, step;
+
+        if (pages == 0) {
+            continue;
+        }
+        pieces = min((unsigned long) max(min_regions / n_areas, 1), pages);
+        step = (pages / pieces) << PAGE_SHIFT;
+
+        for (k = 0; k < pieces; k++) {
+            unsigned long start = areas[a].start + k * step;
+            add_region(bt, start, (k == pieces - 1) ? areas[a].end : start + step);
+        }
+    }
+    return 0;
+}
+
+// Fits the regions to the current areas of the mm, dropping unmapped ones and growing with new mappings
+static void update_regions(bound_task_t *bt, struct mm_struct *mm) {
+    addr_range_t areas[REGION_AREAS];
+    region_t *old = bt->regions;
+    int n_old = bt->n_regions;
+    int n_areas, a, r;
+
+    mmap_read_lock(mm);
+    n_areas = mm_areas(mm, areas);
+    mmap_read_unlock(mm);
+
+    bt->regions = kmalloc_array(2 * max_regions, sizeof(region_t), GFP_KERNEL);
+    if (bt->regions == NULL) {
+        bt->regions = old;
+        return;
+    }
+    bt->n_regions = 0;
+
+    for (a = 0; a < n_areas; a++) {
+        int first = bt->n_regions;
+
+        if (areas[a].end <= areas[a].start) {
+            continue;
+        }
+        for (r = 0; (r < n_old) && (bt->n_regions < 2 * max_regions - 1); r++) {
+            region_t *reg = &bt->regions[bt->n_regions];
+
+            if ((old[r].end <= areas[a].start) || (old[r].start >= areas[a].end)) {
+                continue;
+            }
+            *reg = old[r];
+            reg->start = max(reg->start, areas[a].start);
+            reg->end = min(reg->end, areas[a].end);
+            if (region_pages(reg) == 0) {
+                continue; // less than a page of it left in the area
+            }
+            if ((reg->sample < reg->start) || (reg->sample >= reg->end)) {
+                reg->sample = 0;
+            }
+            bt->n_regions++;
+        }
+
+        if (bt->n_regions == first) {
+            add_region(bt, areas[a].start, areas[a].end);
+        }
+        else {
+            bt->regions[first].start = areas[a].start;
+            bt->regions[bt->n_regions - 1].end = areas[a].end;
+        }
+    }
+    kfree(old);
+}
+
+// One sample per region: count it as accessed if its last sampled page was, then clear a new random page
+static void sample_regions(bound_task_t *bt, struct mm_struct *mm) {
+    int r;
+
+    if ((bt->regions == NULL) && init_regions(bt, mm)) {
+        return;
+    }
+
+    mmap_read_lock(mm);
+    for (r = 0; r < bt->n_regions; r++) {
+        region_t *reg = &bt->regions[r];
+
+        if (region_pages(reg) == 0) {
+            continue;
+        }
+        if ((reg->sample != 0) && region_young(mm, reg->sample)) {
+            reg->nr_accesses++;
+        }
+        reg->sample = region_random_addr(reg);
+        region_young(mm, reg->sample);
+    }
+    mmap_read_unlock(mm);
+}
+
+// Merges adjacent regions whose access counts differ by at most thresh (never below min_regions)
+static void merge_regions(bound_task_t *bt, unsigned int thresh) {
+    region_t *regs = bt->regions;
+    int n = 0, r;
+
+    for (r = 0; r < bt->n_regions; r++) {
+        region_t *prev = (n > 0) ? &regs[n - 1] : NULL;
+
+        if ((prev != NULL) && (prev->end == regs[r].start) && (n + (bt->n_regions - r) > min_regions) &&
+            (abs((int) prev->nr_accesses - (int) regs[r].nr_accesses) <= (int) thresh)) {
+            unsigned long prev_pages = region_pages(prev);
+            unsigned long pages = region_pages(&regs[r]);
+
+            prev->nr_accesses = (prev->nr_accesses * prev_pages + regs[r].nr_accesses * pages) / (prev_pages + pages);
+            prev->end = regs[r].end;
+            if (prev->sample == 0) {
+                prev->sample = regs[r].sample;
+            }
+        }
+        else {
+            regs[n++] = regs[r];
+        }
+    }
+    bt->n_regions = n;
+}
+
+// Splits every region in two at a random page, while that keeps the count under max_regions
+static void split_regions(bound_task_t *bt) {
+    region_t *regs = bt->regions;
+    int n = bt->n_regions;
+    int out = n;
+    int r;
+
+    if (n > max_regions / 2) {
+        return;
+    }
+
+    for (r = 0; r < n; r++) {
+        if (region_pages(&regs[r]) >= 2) {
+            out++;
+        }
+    }
+    bt->n_regions = out;
+
+    // Fill from the back, so that no region is overwritten before it is moved
+    for (r = n - 1; r >= 0; r--) {
+        region_t reg = regs[r];
+
+        if (region_pages(&reg) >= 2) {
+            unsigned long cut = reg.start + ((1 + get_random_long() % (region_pages(&reg) - 1)) << PAGE_SHIFT);
+
+            regs[--out] = reg;
+            regs[out].start = cut;
+            regs[--out] = reg;
+            regs[out].end = cut;
+            if (reg.sample >= cut) {
+                regs[out].sample = 0;
+            }
+            else {
+                regs[out + 1].sample = 0;
+            }
+        }
+        else {
+            regs[--out] = reg;
+        }
+    }
+}
+
+static void aggregate_regions(bound_task_t *bt, struct mm_struct *mm) {
+    unsigned int max_accesses = max(aggr_us / max(sample_us, 1U), 1U);
+    int r;
+
+    if (bt->regions == NULL) {
+        return;
+    }
+
+    merge_regions(bt, max(max_accesses / 10, 1U));
+    for (r = 0; r < bt->n_regions; r++) {
+        bt->regions[r].last_accesses = bt->regions[r].nr_accesses;
+        bt->regions[r].nr_accesses = 0;
+    }
+    split_regions(bt);
+
+    if ((n_aggrs % REGION_UPDATE_AGGRS) == 0) {
+        update_regions(bt, mm);
+    }
+}
+
+/*
+ * Pins the first bound task from index *i on whose mm is still alive, with a reference on both (drop them
+ * with mmput() and put_bound_task()). Tasks moved by a concurrent unbind may be skipped or sampled twice
+ * in a pass, which only costs a sample.
+ */
+static bound_task_t *get_sampled_task(int *i, struct mm_struct **mm) {
+    bound_task_t *bt = NULL;
+
+    mutex_lock(&bound_lock);
+    for (; *i < n_pids; (*i)++) {
+        // The registry's notifier keeps mm_count, so the mm can be looked at while the task is bound
+        if (mmget_not_zero(bound_tasks[*i]->mm)) {
+            bt = bound_tasks[*i];
+            *mm = bt->mm;
+            refcount_inc(&bt->ref);
+            break;
+        }
+    }
+    mutex_unlock(&bound_lock);
+    return bt;
+}
+
+static int region_sampler_fn(void *data) {
+    ktime_t next_aggr = ktime_add_us(ktime_get(), aggr_us);
+    struct mm_struct *mm;
+    bound_task_t *bt;
+    int aggr, i;
+
+    while (!kthread_should_stop()) {
+        aggr = ktime_after(ktime_get(), next_aggr);
+        if (aggr) {
+            n_aggrs++;
+        }
+        for (i = 0; (bt = get_sampled_task(&i, &mm)) != NULL; i++) {
+            mutex_lock(&bt->regions_lock);
+            sample_regions(bt, mm);
+            if (aggr) {
+                aggregate_regions(bt, mm);
+            }
+            mutex_unlock(&bt->regions_lock);
+            mmput(mm);
+            put_bound_task(bt);
+        }
+        if (aggr) {
+            next_aggr = ktime_add_us(ktime_get(), aggr_us);
+        }
+
+        schedule_timeout_interruptible(max(usecs_to_jiffies(sample_us), 1UL));
+    }
+
+    return 0;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+BIND/UNBIND FUNCTIONS
+
+-------------------------------------------------------------------------------
+*/
+
+
+
+static int bind_pid(pid_t pid) {
+    if ((pid <= 0) || (pid > MAX_PID_N)) {
+        pr_info("PLACEMENT: Invalid pid value in bind command.\n");
+        return -1;
+    }
+    if (!add_bound_task(pid, NULL)) {
+        pr_info("PLACEMENT: Could not bind pid=%d.\n", pid);
+        return -1;
+    }
+
+    pr_info("PLACEMENT: Bound pid=%d.\n", pid);
+    return 0;
+}
+
+static int unbind_pid(pid_t pid) {
+    if ((pid <= 0) || (pid > MAX_PID_N)) {
+        pr_info("PLACEMENT: Invalid pid value in unbind command.\n");
+        return -1;
+    }
+
+    bound_task_t *bt = bound_lookup(pid);
+    if (bt == NULL) {
+        pr_info("PLACEMENT: Could not unbind pid=%d.\n", pid);
+        return -1;
+    }
+
+    remove_bound_task(bt);
+    pr_info("PLACEMENT: Unbound pid=%d.\n", pid);
+    return 0;
+}
+
+static bound_cgroup_t *find_cgroup(const char *path) {
+    bound_cgroup_t *cg;
+
+    list_for_each_entry(cg, &bound_cgroups, node) {
+        if (!strcmp(cg->path, path)) {
+            return cg;
+        }
+    }
+    return NULL;
+}
+
+// Binds every process in a cgroup v2 (path relative to the cgroup2 mount), now and as they are created
+static int bind_cgroup(const char *path) {
+    bound_cgroup_t *cg;
+    struct cgroup *cgrp;
+
+    if (find_cgroup(path) != NULL) {
+        pr_info("PLACEMENT: Already managing cgroup %s.\n", path);
+        return -EEXIST;
+    }
+
+    cgrp = cgroup_get_from_path(path);
+    if (IS_ERR(cgrp)) {
+        pr_info("PLACEMENT: Could not find cgroup %s.\n", path);
+        return PTR_ERR(cgrp);
+    }
+
+    cg = kzalloc(sizeof(bound_cgroup_t), GFP_KERNEL);
+    if (cg == NULL) {
+        cgroup_put(cgrp);
+        return -ENOMEM;
+    }
+    cg->cgrp = cgrp;
+    strscpy(cg->path, path, CGROUP_PATH_MAX);
+    list_add_tail(&cg->node, &bound_cgroups);
+
+    scan_cgroup(cg);
+    schedule_delayed_work(&cgroup_scan_work, msecs_to_jiffies(CGROUP_RESCAN_MS));
+    pr_info("PLACEMENT: Bound cgroup %s.\n", path);
+    return 0;
+}
+
+static void remove_cgroup(bound_cgroup_t *cg) {
+    int i;
+
+    // Backwards, so the task swapped into a freed slot has already been checked
+    for (i = n_pids - 1; i >= 0; i--) {
+        if (bound_tasks[i]->cg == cg) {
+            remove_bound_task(bound_tasks[i]);
+        }
+    }
+
+    list_del(&cg->node);
+    cgroup_put(cg->cgrp);
+    kfree(cg);
+}
+
+static int unbind_cgroup(const char *path) {
+    bound_cgroup_t *cg = find_cgroup(path);
+
+    if (cg == NULL) {
+        pr_info("PLACEMENT: Could not unbind cgroup %s.\n", path);
+        return -ENOENT;
+    }
+
+    remove_cgroup(cg);
+    pr_info("PLACEMENT: Unbound cgroup %s.\n", path);
+    return 0;
+}
+
+/*
+ * Number of bound processes in a cgroup and the base pages they have resident on each tier. Walks are
+ * sliced and share one scan budget like FIND walks; once it runs out the counts are partial (n_walked).
+ */
+static int cgroup_stats(cgroup_req_t *creq) {
+    struct mm_walk_ops count_ops = {.pmd_entry = pmd_callback_count, .pte_entry = pte_callback_count};
+    bound_cgroup_t *cg = find_cgroup(creq->path);
+    walk_ctx_t ctx = {.tier_pages = creq->tier_pages};
+    ktime_t deadline = walk_deadline();
+    int i;
+
+    if (cg == NULL) {
+        return -ENOENT;
+    }
+
+    creq->n_procs = 0;
+    creq->n_walked = 0;
+    memset(creq->tier_pages, 0, sizeof(creq->tier_pages));
+
+    for (i = 0; i < n_pids; i++) {
+        struct mm_struct *mm = bound_tasks[i]->mm;
+
+        if ((bound_tasks[i]->cg != cg) || !mmget_not_zero(mm)) {
+            continue;
+        }
+        creq->n_procs++;
+
+        if (!ktime_after(ktime_get(), deadline) &&
+            (walk_range_sliced(mm, 0, MAX_ADDRESS, &count_ops, &ctx, deadline) == MAX_ADDRESS)) {
+            creq->n_walked++;
+        }
+        mmput(mm);
+    }
+
+    return 0;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+IN-KERNEL MIGRATION
+
+-------------------------------------------------------------------------------
+*/
+
+
+
+extern int isolate_lru_page(struct page *page); // mm/internal.h, exported by the patched kernel
 
-static int switch_walk(int n) {
-    struct mm_walk_ops mem_walk_ops = {.pte_entry = pte_callback_nvram_switch};
+// migrate_pages() allocation callback: fills the nodes of the destination tier in order, without reclaim
+static struct page *alloc_tier_page(struct page *page, unsigned long tier) {
+    int nodes[MAX_TIER_NODES];
+    int n_nodes = tier_nodes(&tiers, tier, nodes);
+    struct page *new_page;
+    int i;
 
-    n_to_find = n;
-    n_switch_backup = 0;
+    for (i = 0; i < n_nodes; i++) {
+        if (PageTransHuge(page)) {
+            new_page = alloc_pages_node(nodes[i], (GFP_TRANSHUGE_LIGHT | __GFP_THISNODE), HPAGE_PMD_ORDER);
+            if (new_page != NULL) {
+                prep_transhuge_page(new_page);
+                return new_page;
+            }
+        }
+        else {
+            new_page = __alloc_pages_node(nodes[i], (GFP_HIGHUSER_MOVABLE | __GFP_THISNODE | __GFP_NOMEMALLOC |
+                                          __GFP_NORETRY | __GFP_NOWARN) & ~__GFP_RECLAIM, 0);
+            if (new_page != NULL) {
+                return new_page;
+            }
+        }
+    }
 
-    last_pid_nvram = do_page_walk(mem_walk_ops, last_pid_nvram, last_addr_nvram);
+    return NULL;
+}
 
-    found_addrs[n_found].pid_retval = 0; // fill separator after
-    if ((n_found == 0) && (n_switch_backup == 0)) {
-        n_found++;
-        return -1;
+/*
+ * Takes the page mapped at addr off its LRU list (same steps as add_page_for_migration() in mm/migrate.c).
+ * THPs go to thp_list so that migrate_pages() failure counts can be converted to base pages.
+ * Returns the number of base pages isolated. Caller holds the mmap lock.
+ */
+static int isolate_candidate(struct mm_struct *mm, addr_info_t *c, int tier, struct list_head *page_list,
+                             struct list_head *thp_list, migrate_stats_t *stats) {
+    struct vm_area_struct *vma;
+    struct page *page, *head;
+    int nr = c->huge ? HPAGE_PMD_NR : 1;
+
+    vma = find_vma(mm, c->addr);
+    if ((vma == NULL) || (c->addr < vma->vm_start) || !vma_migratable(vma)) {
+        stats->n_not_present += nr;
+        return 0;
     }
 
-    int nvram_found = n_found; // store the number of ideal nvram pages found
-    int dram_to_find = int_min(nvram_found + n_switch_backup, n);
-    n_found++;
-    n_to_find = n_found + dram_to_find; // try to find the same amount of dram addrs
-    n_backup = 0;
+    page = follow_page(vma, c->addr, FOLL_GET | FOLL_DUMP);
+    if (IS_ERR_OR_NULL(page)) {
+        stats->n_not_present += nr;
+        return 0;
+    }
 
-    mem_walk_ops.pte_entry = pte_callback_mem;
-    last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
-    int dram_found = n_found - nvram_found - 1;
-    // found equal number of dram and nvram entries
-    if (dram_found == nvram_found) {
+    head = compound_head(page);
+    nr = hpage_nr_pages(head);
+    if (node_tier[page_to_nid(head)] == tier) {
+        put_page(page); // already placed
+        return 0;
+    }
+    if (is_zone_device_page(page) || isolate_lru_page(head)) {
+        put_page(page);
+        stats->n_isolate_failed += nr;
         return 0;
     }
-    else if ((dram_found < nvram_found) && (n_backup > 0)) {
-        int remaining = nvram_found - dram_found;
-        int to_add;
 
-        if (n_backup < remaining) {
-            // shift left dram entries (discard excess nvram addrs)
-            int old_dram_start = nvram_found + 1;
-            nvram_found = dram_found + n_backup; // update nvram_found and discard other entries
-            int new_dram_start = nvram_found + 1;
-            found_addrs[nvram_found].pid_retval = 0; // fill separator after nvram pages
+    list_add_tail(&head->lru, PageTransHuge(head) ? thp_list : page_list);
+    mod_node_page_state(page_pgdat(head), NR_ISOLATED_ANON + page_is_file_lru(head), nr);
+    put_page(page); // isolate_lru_page() holds its own reference
 
-            int i;
-            for (i = 0; i < dram_found; i++) {
-                found_addrs[new_dram_start + i].addr = found_addrs[old_dram_start + i].addr;
-                found_addrs[new_dram_start + i].pid_retval = found_addrs[old_dram_start + i].pid_retval;
-            }
-            to_add = n_backup;
-            n_found = new_dram_start + dram_found;
+    return nr;
+}
+
+static void migrate_list(struct list_head *list, int tier, int nr_per_page, int n_isolated, migrate_stats_t *stats) {
+    struct page *page;
+    int n_left = 0;
+    int ret;
+
+    if (list_empty(list)) {
+        return;
+    }
+
+    ret = migrate_pages(list, alloc_tier_page, NULL, tier, MIGRATE_SYNC, MR_SYSCALL);
+    if (ret < 0) {
+        // pages left on the list were never attempted
+        list_for_each_entry(page, list, lru) {
+            n_left += nr_per_page;
         }
-        else {
-            to_add = remaining;
+        if (ret == -ENOMEM) {
+            stats->n_nomem += n_left;
         }
-        int i;
-        for (i = 0; i < to_add; i++) {
-            found_addrs[n_found].addr = backup_addrs[i].addr;
-            found_addrs[n_found++].pid_retval = backup_addrs[i].pid_retval;
+        else {
+            stats->n_failed += n_left;
         }
+    }
+    else {
+        n_left = ret * nr_per_page;
+        stats->n_failed += n_left;
+    }
 
+    if (!list_empty(list)) {
+        putback_movable_pages(list);
     }
-    else if ((nvram_found < dram_found) && (n_switch_backup > 0)) {
-        int remaining = dram_found - nvram_found;
-        int to_add = int_min(n_switch_backup, remaining);
-        int i;
-        int old_dram_start = nvram_found + 1;
-        int new_dram_start = old_dram_start + to_add;
-        dram_found = nvram_found + to_add;
+    stats->n_migrated += n_isolated - n_left;
+}
 
-        // shift right dram entries
-        for (i = dram_found - 1; i >= 0; i--) {
-            found_addrs[new_dram_start + i].addr = found_addrs[old_dram_start + i].addr;
-            found_addrs[new_dram_start + i].pid_retval = found_addrs[old_dram_start + i].pid_retval;
+// Migrates n candidates (grouped by pid, as returned by the walkers) to the given tier
+static void migrate_candidates(addr_info_t *cands, int n, int tier, migrate_stats_t *stats) {
+    LIST_HEAD(page_list);
+    LIST_HEAD(thp_list);
+    int n_isolated = 0;
+    int i = 0;
+
+    while (i < n) {
+        int pid = cands[i].pid_retval;
+        struct mm_struct *mm = NULL;
+        bound_task_t *bt;
+
+        rcu_read_lock();
+        bt = bound_lookup(pid);
+        if ((bt != NULL) && mmget_not_zero(bt->mm)) {
+            mm = bt->mm;
         }
+        rcu_read_unlock();
 
-        for (i = 0; i < to_add; i++) {
-            found_addrs[nvram_found].addr = switch_backup_addrs[i].addr;
-            found_addrs[nvram_found++].pid_retval = switch_backup_addrs[i].pid_retval;
+        if (mm != NULL) {
+            mmap_read_lock(mm);
+        }
+        for (; (i < n) && (cands[i].pid_retval == pid); i++) {
+            if (mm == NULL) {
+                stats->n_not_present += cands[i].huge ? HPAGE_PMD_NR : 1;
+                continue;
+            }
+            n_isolated += isolate_candidate(mm, &cands[i], tier, &page_list, &thp_list, stats);
+        }
+        if (mm != NULL) {
+            mmap_read_unlock(mm);
+            mmput(mm);
         }
-        found_addrs[nvram_found].pid_retval = 0;
-        n_found = nvram_found * 2 + 1; // discard last entries
     }
-    else {
-        found_addrs[0].pid_retval = 0;
-        n_found = 1;
+
+    int n_thp = 0;
+    struct page *page;
+    list_for_each_entry(page, &thp_list, lru) {
+        n_thp += HPAGE_PMD_NR;
     }
 
+    migrate_list(&thp_list, tier, HPAGE_PMD_NR, n_thp, stats);
+    migrate_list(&page_list, tier, 1, n_isolated - n_thp, stats);
+}
 
-    return 0;
+// Moves the reply of the last FIND request to the adjacent tier, demoting before promoting on a switch
+static void migrate_found(int mode, int tier, migrate_stats_t *stats) {
+    int n = 0;
+
+    while ((n < n_found) && (found_addrs[n].pid_retval > 0)) {
+        n++;
+    }
+
+    switch (mode) {
+        case DRAM_MODE:
+            migrate_candidates(found_addrs, n, tier + 1, stats);
+            break;
+        case SWITCH_MODE:
+            // the faster tier's section after the separator holds as many entries as the first one
+            migrate_candidates(found_addrs + n + 1, n, tier, stats);
+            migrate_candidates(found_addrs, n, tier - 1, stats);
+            break;
+        default:
+            migrate_candidates(found_addrs, n, tier - 1, stats);
+    }
 }
 
 
@@ -699,50 +2672,152 @@ static int switch_walk(int n) {
 /*
 -------------------------------------------------------------------------------
 
-BIND/UNBIND FUNCTIONS
+WALK STATISTICS
 
 -------------------------------------------------------------------------------
 */
 
 
 
-static int bind_pid(pid_t pid) {
-    if ((pid <= 0) || (pid > MAX_PID_N)) {
-        pr_info("PLACEMENT: Invalid pid value in bind command.\n");
-        return -1;
+/*
+ * Cost of FIND requests: every request fires the ambix_find tracepoint and every walked range (a worker
+ * job, or a process for clear walks) fires ambix_walk_job. Totals per FIND mode and log2 histograms of
+ * walk time and candidates found are kept for /sys/kernel/debug/ambix/stats, and the walk cost of each
+ * bound process for /sys/kernel/debug/ambix/tasks. Everything is updated and read under req_mutex.
+ */
+
+typedef struct find_stats {
+    unsigned long n_reqs;
+    unsigned long n_requested; // pages asked for
+    unsigned long n_found; // candidates returned (backups included)
+    unsigned long n_backup; // backups found by the walks
+    walk_stats_t walk;
+    u64 ns;
+} find_stats_t;
+
+static const char *find_mode_names[N_FIND_MODES] = {"dram", "nvram", "nvram_intensive", "switch", "clear", "nvram_write"};
+
+find_stats_t find_stats[N_FIND_MODES];
+unsigned long find_time_buckets[STATS_BUCKETS]; // FIND requests by walk time (microseconds)
+unsigned long find_found_buckets[STATS_BUCKETS]; // FIND requests by candidates returned
+
+struct dentry *stats_dir;
+
+// Bucket b holds values in [2^(b-1), 2^b), bucket 0 holds zero and the last one everything above
+static inline int stats_bucket(u64 val) {
+    return min(fls64(val), STATS_BUCKETS - 1);
+}
+
+static void find_stats_account(req_t *req, int n_requested, u64 ns) {
+    find_stats_t *st;
+    int found = n_found;
+
+    if ((req->mode < 0) || (req->mode >= N_FIND_MODES)) {
+        return;
     }
-    if (!find_target_process(pid)) {
-        pr_info("PLACEMENT: Could not bind pid=%d.\n", pid);
-        return -1;
+    if ((req->mode == SWITCH_MODE) && (found > 0)) {
+        found--; // separator
     }
 
-    pr_info("PLACEMENT: Bound pid=%d.\n", pid);
-    return 0;
+    st = &find_stats[req->mode];
+    st->n_reqs++;
+    st->n_requested += n_requested;
+    st->n_found += found;
+    st->n_backup += n_backup + n_switch_backup;
+    walk_stats_add(&st->walk, &req_stats);
+    st->ns += ns;
+    find_time_buckets[stats_bucket(div_u64(ns, NSEC_PER_USEC))]++;
+    find_found_buckets[stats_bucket(found)]++;
+
+    trace_ambix_find(req->mode, req->tier, n_requested, found, n_backup + n_switch_backup, req_stats.entries,
+                     req_stats.vmas, req_stats.not_present, req_stats.read_only, req_stats.wrong_tier, ns);
 }
 
-static int unbind_pid(pid_t pid) {
-    if ((pid <= 0) || (pid > MAX_PID_N)) {
-        pr_info("PLACEMENT: Invalid pid value in unbind command.\n");
-        return -1;
+static void stats_show_buckets(struct seq_file *m, const char *title, const unsigned long *buckets) {
+    int b;
+
+    seq_printf(m, "\n%s\n", title);
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        if (buckets[b] == 0) {
+            continue;
+        }
+        if (b == 0) {
+            seq_printf(m, "%12s %lu\n", "0", buckets[b]);
+        }
+        else if (b == STATS_BUCKETS - 1) {
+            seq_printf(m, "%11llu+ %lu\n", 1ULL << (b - 1), buckets[b]);
+        }
+        else {
+            seq_printf(m, "%5llu-%-6llu %lu\n", 1ULL << (b - 1), (1ULL << b) - 1, buckets[b]);
+        }
     }
+}
 
-    // Find which task to remove
+static int stats_show(struct seq_file *m, void *v) {
     int i;
-    for (i = 0; i < n_pids; i++) {
-        if ((task_items[i] != NULL) && (task_items[i]->pid == pid)) {
-            break;
-        }
+
+    mutex_lock(&req_mutex);
+    seq_printf(m, "%-16s %8s %10s %10s %10s %12s %8s %12s %10s %12s %10s\n", "mode", "requests", "requested",
+               "found", "backups", "entries", "vmas", "not_present", "read_only", "wrong_tier", "time_ms");
+    for (i = 0; i < N_FIND_MODES; i++) {
+        find_stats_t *st = &find_stats[i];
+
+        seq_printf(m, "%-16s %8lu %10lu %10lu %10lu %12lu %8lu %12lu %10lu %12lu %10llu\n", find_mode_names[i],
+                   st->n_reqs, st->n_requested, st->n_found, st->n_backup, st->walk.entries, st->walk.vmas,
+                   st->walk.not_present, st->walk.read_only, st->walk.wrong_tier, div_u64(st->ns, NSEC_PER_MSEC));
     }
+    stats_show_buckets(m, "Walk time per request (us):", find_time_buckets);
+    stats_show_buckets(m, "Candidates per request:", find_found_buckets);
+    mutex_unlock(&req_mutex);
 
-    if (i == n_pids) {
-        pr_info("PLACEMENT: Could not unbind pid=%d.\n", pid);
-        return -1;
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, stats_show, inode->i_private);
+}
+
+static int tasks_show(struct seq_file *m, void *v) {
+    int i;
+
+    mutex_lock(&req_mutex);
+    seq_printf(m, "%8s %12s %10s\n", "pid", "entries", "time_ms");
+    for (i = 0; i < n_pids; i++) {
+        seq_printf(m, "%8d %12lu %10llu\n", bound_tasks[i]->pid, bound_tasks[i]->walk_entries,
+                   div_u64(bound_tasks[i]->walk_ns, NSEC_PER_MSEC));
     }
+    mutex_unlock(&req_mutex);
 
-    update_pid_list(i);
-    pr_info("PLACEMENT: Unbound pid=%d.\n", pid);
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(tasks);
+
+// Writing anything to the stats file resets the totals and histograms (not the per-task counters)
+static ssize_t stats_reset_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+    mutex_lock(&req_mutex);
+    memset(find_stats, 0, sizeof(find_stats));
+    memset(find_time_buckets, 0, sizeof(find_time_buckets));
+    memset(find_found_buckets, 0, sizeof(find_found_buckets));
+    mutex_unlock(&req_mutex);
+
+    return len;
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .write = stats_reset_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// debugfs is optional: failures are ignored, as the debugfs API expects
+static void stats_debugfs_init(void) {
+    stats_dir = debugfs_create_dir(AMBIX_DEV_NAME, NULL);
+    debugfs_create_file("stats", 0644, stats_dir, NULL, &stats_fops);
+    debugfs_create_file("tasks", 0444, stats_dir, NULL, &tasks_fops);
+}
 
 
 
@@ -770,26 +2845,35 @@ static void process_req(req_t *req) {
         switch (req->op_code) {
             case FIND_OP:
                 refresh_pids();
-                if (n_pids > 0) {
+                if ((req->tier < 0) || (req->tier >= tiers.n_tiers)) {
+                    pr_info("PLACEMENT: Invalid tier %d.\n", req->tier);
+                }
+                else if (n_pids > 0) {
+                    ktime_t t0 = ktime_get();
                     int n = 0;
+
+                    memset(&req_stats, 0, sizeof(req_stats));
+                    n_backup = 0;
+                    n_switch_backup = 0;
                     switch (req->mode) {
                         case DRAM_MODE:
                         case NVRAM_MODE:
                         case NVRAM_WRITE_MODE:
                         case NVRAM_INTENSIVE_MODE:
                             n = int_min(MAX_N_FIND, req->pid_n);
-                            ret = mem_walk(n, req->mode);
+                            ret = mem_walk(n, req->mode, req->tier, req->nodes);
                             break;
                         case NVRAM_CLEAR:
-                            clear_walk(req->mode);
+                            clear_walk(req->tier);
                             break;
                         case SWITCH_MODE:
                             n = int_min(MAX_N_SWITCH, req->pid_n);
-                            ret = switch_walk(n);
+                            ret = switch_walk(n, req->tier, req->nodes);
                             break;
                         default:
                             pr_info("PLACEMENT: Unrecognized mode.\n");
                     }
+                    find_stats_account(req, n, ktime_to_ns(ktime_sub(ktime_get(), t0)));
                 }
                 break;
             case BIND_OP:
@@ -825,6 +2909,8 @@ static void placement_nl_process_msg(struct sk_buff *skb) {
     in_req = (req_t *) NLMSG_DATA(nlmh);
     sender_pid = nlmh->nlmsg_pid;
 
+    mutex_lock(&req_mutex);
+    found_addrs = nl_addrs;
     process_req(in_req);
 
 
@@ -839,6 +2925,7 @@ static void placement_nl_process_msg(struct sk_buff *skb) {
     skb_out = nlmsg_new(NLMSG_LENGTH(MAX_PAYLOAD) * required_packets, GFP_KERNEL);
     if (!skb_out) {
         pr_err("Failed to allocate new skb.\n");
+        mutex_unlock(&req_mutex);
         return;
     }
 
@@ -854,6 +2941,7 @@ static void placement_nl_process_msg(struct sk_buff *skb) {
     nlmh_array[i] = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, rem_size, 0);
     memset(NLMSG_DATA(nlmh_array[i]), 0, rem_size);
     memcpy(NLMSG_DATA(nlmh_array[i]), found_addrs + i*MAX_N_PER_PACKET, rem_size);
+    mutex_unlock(&req_mutex);
 
     NETLINK_CB(skb_out).dst_group = 0; // unicast
 
@@ -870,6 +2958,205 @@ static void placement_nl_process_msg(struct sk_buff *skb) {
 
 
 
+/*
+-------------------------------------------------------------------------------
+
+CANDIDATE RING DEVICE
+
+-------------------------------------------------------------------------------
+*/
+
+
+
+static atomic_t dev_open = ATOMIC_INIT(0); // the ring has a single consumer
+
+// Replies expose pids and addresses of other processes and opening resets the ring: root only, one opener at a time
+static int ambix_dev_open(struct inode *inode, struct file *file) {
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (atomic_cmpxchg(&dev_open, 0, 1) != 0) {
+        return -EBUSY;
+    }
+
+    mutex_lock(&req_mutex);
+    ring_hdr->head = 0;
+    ring_hdr->tail = 0;
+    ring_hdr->batch_start = 0;
+    ring_hdr->batch_len = 0;
+    mutex_unlock(&req_mutex);
+
+    return 0;
+}
+
+static int ambix_dev_release(struct inode *inode, struct file *file) {
+    atomic_set(&dev_open, 0);
+    return 0;
+}
+
+static int ambix_dev_mmap(struct file *file, struct vm_area_struct *vma) {
+    return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+/*
+ * FIND doorbell: walks and writes the reply (same layout as the netlink reply) straight into the ring.
+ * Each reply takes a whole slot of RING_SLOT_ENTRIES, so a FIND can run while ctl still migrates the
+ * previous reply. The consumer releases a reply by setting tail to the end of its slot (head after the
+ * FIND), and FIND fails with -EBUSY while every slot holds an unreleased reply.
+ */
+static long ambix_dev_find(unsigned long arg) {
+    req_t req;
+    unsigned long pos;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *) arg, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.op_code != FIND_OP) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&req_mutex);
+    if ((ring_hdr->head - READ_ONCE(ring_hdr->tail)) > (RING_ENTRIES - RING_SLOT_ENTRIES)) {
+        mutex_unlock(&req_mutex);
+        return -EBUSY; // no slot released yet
+    }
+
+    pos = ring_hdr->head % RING_ENTRIES;
+    found_addrs = ring_entries + pos;
+    process_req(&req);
+
+    ring_hdr->batch_start = pos;
+    ring_hdr->batch_len = n_found;
+    smp_wmb(); // publish entries before head
+    WRITE_ONCE(ring_hdr->head, ring_hdr->head + RING_SLOT_ENTRIES);
+    ret = n_found;
+    mutex_unlock(&req_mutex);
+
+    return ret;
+}
+
+/*
+ * FIND and migrate in the module: the reply never leaves the kernel, only the statistics are copied back.
+ * Returns the number of base pages migrated.
+ */
+static long ambix_dev_migrate(unsigned long arg) {
+    migrate_req_t mreq;
+
+    if (copy_from_user(&mreq, (void __user *) arg, sizeof(mreq))) {
+        return -EFAULT;
+    }
+    if ((mreq.req.op_code != FIND_OP) || (mreq.req.mode == NVRAM_CLEAR)) {
+        return -EINVAL;
+    }
+    memset(&mreq.stats, 0, sizeof(mreq.stats));
+
+    mutex_lock(&req_mutex);
+    found_addrs = nl_addrs;
+    process_req(&mreq.req);
+    migrate_found(mreq.req.mode, mreq.req.tier, &mreq.stats);
+    mutex_unlock(&req_mutex);
+
+    if (copy_to_user((void __user *) arg, &mreq, sizeof(mreq))) {
+        return -EFAULT;
+    }
+
+    return mreq.stats.n_migrated;
+}
+
+static long ambix_dev_get_tiers(unsigned long arg) {
+    tier_cfg_t cfg;
+
+    mutex_lock(&req_mutex);
+    cfg = tiers;
+    mutex_unlock(&req_mutex);
+
+    if (copy_to_user((void __user *) arg, &cfg, sizeof(cfg))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+static long ambix_dev_set_tiers(unsigned long arg) {
+    tier_cfg_t cfg;
+    long ret;
+
+    if (copy_from_user(&cfg, (void __user *) arg, sizeof(cfg))) {
+        return -EFAULT;
+    }
+
+    mutex_lock(&req_mutex);
+    ret = set_tiers(&cfg);
+    mutex_unlock(&req_mutex);
+
+    return ret;
+}
+
+static long ambix_dev_cgroup(unsigned int cmd, unsigned long arg) {
+    cgroup_req_t creq;
+    long ret;
+
+    if (copy_from_user(&creq, (void __user *) arg, sizeof(creq))) {
+        return -EFAULT;
+    }
+    creq.path[CGROUP_PATH_MAX - 1] = '\0';
+
+    mutex_lock(&req_mutex);
+    refresh_pids();
+    switch (cmd) {
+        case AMBIX_IOC_BIND_CGROUP:
+            ret = bind_cgroup(creq.path);
+            break;
+        case AMBIX_IOC_UNBIND_CGROUP:
+            ret = unbind_cgroup(creq.path);
+            break;
+        default:
+            ret = cgroup_stats(&creq);
+    }
+    mutex_unlock(&req_mutex);
+
+    if ((cmd == AMBIX_IOC_CGROUP_STATS) && (ret == 0) && copy_to_user((void __user *) arg, &creq, sizeof(creq))) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
+static long ambix_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    switch (cmd) {
+        case AMBIX_IOC_FIND:
+            return ambix_dev_find(arg);
+        case AMBIX_IOC_MIGRATE:
+            return ambix_dev_migrate(arg);
+        case AMBIX_IOC_GET_TIERS:
+            return ambix_dev_get_tiers(arg);
+        case AMBIX_IOC_SET_TIERS:
+            return ambix_dev_set_tiers(arg);
+        case AMBIX_IOC_BIND_CGROUP:
+        case AMBIX_IOC_UNBIND_CGROUP:
+        case AMBIX_IOC_CGROUP_STATS:
+            return ambix_dev_cgroup(cmd, arg);
+        default:
+            return -ENOTTY;
+    }
+}
+
+static const struct file_operations ambix_fops = {
+    .owner = THIS_MODULE,
+    .open = ambix_dev_open,
+    .release = ambix_dev_release,
+    .mmap = ambix_dev_mmap,
+    .unlocked_ioctl = ambix_dev_ioctl,
+};
+
+static struct miscdevice ambix_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = AMBIX_DEV_NAME,
+    .fops = &ambix_fops,
+    .mode = 0600,
+};
+
+
+
 /*
 -------------------------------------------------------------------------------
 
@@ -880,15 +3167,68 @@ MODULE INIT/EXIT
 
 
 
+static void stop_walkers(void) {
+    int i;
+
+    for (i = 0; i < n_walkers; i++) {
+        if (walkers[i].thread != NULL) {
+            kthread_stop(walkers[i].thread);
+        }
+        vfree(walkers[i].ctx.found);
+        vfree(walkers[i].ctx.backup);
+        vfree(walkers[i].ctx.switch_backup);
+    }
+    kfree(walkers);
+    walkers = NULL;
+}
+
 static int __init _on_module_init(void) {
     pr_info("PLACEMENT-HYB: Hello from module!\n");
 
-    task_items = kmalloc(sizeof(struct task_struct *) * MAX_PIDS, GFP_KERNEL);
-    found_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_FIND, GFP_KERNEL);
+    tier_cfg_t tier_cfg;
+    if (parse_tiers(tiers_param, &tier_cfg) || set_tiers(&tier_cfg)) {
+        pr_alert("PLACEMENT: Invalid tier topology \"%s\".\n", tiers_param);
+        return -EINVAL;
+    }
+
+    nl_addrs = kmalloc(sizeof(addr_info_t) * (MAX_N_FIND + 1), GFP_KERNEL);
+    found_addrs = nl_addrs;
     backup_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_FIND, GFP_KERNEL);
     switch_backup_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_SWITCH, GFP_KERNEL);
     nlmh_array = kmalloc(sizeof(struct nlmsghdr *) * MAX_PACKETS, GFP_KERNEL);
 
+    if (n_walkers <= 0) {
+        n_walkers = num_online_cpus();
+    }
+    n_walkers = int_min(n_walkers, MAX_WALKERS);
+
+    walkers = kcalloc(n_walkers, sizeof(walk_worker_t), GFP_KERNEL);
+    if (!walkers) {
+        pr_alert("PLACEMENT: Error allocating page walk workers.\n");
+        return 1;
+    }
+
+    int i;
+    for (i = 0; i < n_walkers; i++) {
+        walkers[i].ctx.found = vmalloc(sizeof(addr_info_t) * MAX_N_FIND);
+        walkers[i].ctx.backup = vmalloc(sizeof(addr_info_t) * MAX_N_FIND);
+        walkers[i].ctx.switch_backup = vmalloc(sizeof(addr_info_t) * MAX_N_SWITCH);
+        if (!walkers[i].ctx.found || !walkers[i].ctx.backup || !walkers[i].ctx.switch_backup) {
+            pr_alert("PLACEMENT: Error allocating page walk worker buffers.\n");
+            stop_walkers();
+            return 1;
+        }
+
+        walkers[i].thread = kthread_run(walk_worker_fn, &walkers[i], "ambix_walk/%d", i);
+        if (IS_ERR(walkers[i].thread)) {
+            pr_alert("PLACEMENT: Error creating page walk worker thread.\n");
+            walkers[i].thread = NULL;
+            stop_walkers();
+            return 1;
+        }
+    }
+    pr_info("PLACEMENT: Started %d page walk workers.\n", n_walkers);
+
     struct netlink_kernel_cfg cfg = {
         .input = placement_nl_process_msg,
     };
@@ -896,18 +3236,67 @@ static int __init _on_module_init(void) {
     nl_sock = netlink_kernel_create(&init_net, NETLINK_USER, &cfg);
     if (!nl_sock) {
         pr_alert("PLACEMENT: Error creating netlink socket.\n");
+        stop_walkers();
+        return 1;
+    }
+
+    ring = vmalloc_user(RING_SIZE);
+    if (!ring) {
+        pr_alert("PLACEMENT: Error allocating candidate ring.\n");
+        netlink_kernel_release(nl_sock);
+        stop_walkers();
+        return 1;
+    }
+    ring_hdr = ring;
+    ring_entries = ring + RING_HDR_SIZE;
+
+    if (misc_register(&ambix_misc)) {
+        pr_alert("PLACEMENT: Error registering candidate ring device.\n");
+        vfree(ring);
+        netlink_kernel_release(nl_sock);
+        stop_walkers();
         return 1;
     }
 
+    stats_debugfs_init();
+
+    if (region_sampling) {
+        min_regions = max(min_regions, REGION_AREAS);
+        max_regions = max(max_regions, 2 * min_regions);
+        region_sampler = kthread_run(region_sampler_fn, NULL, "ambix_sample");
+        if (IS_ERR(region_sampler)) {
+            pr_alert("PLACEMENT: Error creating region sampler thread, walking all pages instead.\n");
+            region_sampler = NULL;
+            region_sampling = 0;
+        }
+    }
+
     return 0;
 }
 
 static void __exit _on_module_exit(void) {
     pr_info("PLACEMENT-HYB: Goodbye from module!\n");
+    if (region_sampler != NULL) {
+        kthread_stop(region_sampler);
+    }
+    debugfs_remove_recursive(stats_dir);
+    misc_deregister(&ambix_misc);
     netlink_kernel_release(nl_sock);
+    stop_walkers();
+    vfree(ring);
+    cancel_delayed_work_sync(&cgroup_scan_work);
 
-    kfree(task_items);
-    kfree(found_addrs);
+    while (!list_empty(&bound_cgroups)) {
+        remove_cgroup(list_first_entry(&bound_cgroups, bound_cgroup_t, node));
+    }
+    while (n_pids > 0) {
+        remove_bound_task(bound_tasks[n_pids - 1]);
+    }
+    reap_exited_tasks();
+    mmu_notifier_synchronize(); // wait for bound_mm_free() before the code goes away
+    rcu_barrier(); // and for kfree_rcu()
+    kfree(bound_tasks);
+    kfree(nl_addrs);
     kfree(backup_addrs);
     kfree(switch_backup_addrs);
     kfree(nlmh_array);
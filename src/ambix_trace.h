@@ -0,0 +1,93 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ambix
+
+#if !defined(_AMBIX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AMBIX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// One per FIND request, after its walks (see WALK STATISTICS in ambix_hyb-mod.c)
+TRACE_EVENT(ambix_find,
+
+    TP_PROTO(int mode, int tier, int n_requested, int n_found, int n_backup, unsigned long entries,
+             unsigned long vmas, unsigned long not_present, unsigned long read_only, unsigned long wrong_tier, u64 ns),
+
+    TP_ARGS(mode, tier, n_requested, n_found, n_backup, entries, vmas, not_present, read_only, wrong_tier, ns),
+
+    TP_STRUCT__entry(
+        __field(int, mode)
+        __field(int, tier)
+        __field(int, n_requested)
+        __field(int, n_found)
+        __field(int, n_backup)
+        __field(unsigned long, entries)
+        __field(unsigned long, vmas)
+        __field(unsigned long, not_present)
+        __field(unsigned long, read_only)
+        __field(unsigned long, wrong_tier)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->mode = mode;
+        __entry->tier = tier;
+        __entry->n_requested = n_requested;
+        __entry->n_found = n_found;
+        __entry->n_backup = n_backup;
+        __entry->entries = entries;
+        __entry->vmas = vmas;
+        __entry->not_present = not_present;
+        __entry->read_only = read_only;
+        __entry->wrong_tier = wrong_tier;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("mode=%d tier=%d requested=%d found=%d backups=%d entries=%lu vmas=%lu not_present=%lu read_only=%lu wrong_tier=%lu ns=%llu",
+              __entry->mode, __entry->tier, __entry->n_requested, __entry->n_found, __entry->n_backup,
+              __entry->entries, __entry->vmas, __entry->not_present, __entry->read_only, __entry->wrong_tier,
+              __entry->ns)
+);
+
+// One per walked range of a bound process: a worker job, or a process walked by a clear request
+TRACE_EVENT(ambix_walk_job,
+
+    TP_PROTO(int pid, unsigned long start, unsigned long end, unsigned long resume, unsigned long entries,
+             int n_found, int n_backup, u64 ns),
+
+    TP_ARGS(pid, start, end, resume, entries, n_found, n_backup, ns),
+
+    TP_STRUCT__entry(
+        __field(int, pid)
+        __field(unsigned long, start)
+        __field(unsigned long, end)
+        __field(unsigned long, resume)
+        __field(unsigned long, entries)
+        __field(int, n_found)
+        __field(int, n_backup)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->start = start;
+        __entry->end = end;
+        __entry->resume = resume;
+        __entry->entries = entries;
+        __entry->n_found = n_found;
+        __entry->n_backup = n_backup;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("pid=%d range=%lx-%lx resume=%lx entries=%lu found=%d backups=%d ns=%llu",
+              __entry->pid, __entry->start, __entry->end, __entry->resume, __entry->entries,
+              __entry->n_found, __entry->n_backup, __entry->ns)
+);
+
+#endif
+
+// The header is not in include/trace/events: point define_trace.h at this directory (-I$(src) in the Makefile)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ambix_trace
+#include <trace/define_trace.h>
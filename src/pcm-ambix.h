@@ -2,8 +2,17 @@
 #define _PCM_AMBIX_H
 
 #define MAX_SOCKETS 2
-#define PCM_FILE_NAME "memdata"
-#define PCM_DELAY 1
+#define MAX_NODES 16 // NUMA nodes with a bandwidth breakdown in memdata
+#define PCM_SHM_NAME "/ambix-pcm"
+#define PCM_SHM_SAMPLES 128 // Samples kept in the shared memory ring
+#define PCM_SHM_VERSION 4
+#define PCM_SHM_RETRIES 1000 // Attempts at a consistent read before ctl takes pcm-memory.x for dead
+#define PCM_DELAY 1 // Default sampling interval of pcm-memory.x in seconds, a shorter one can be given as argument
+#define PCM_MIN_DELAY_MS 10
+#define PCM_EWMA_MS 250 // Time constant of the smoothed bandwidth
+#define PCM_WINDOW_MS 1000 // Samples the max and percentiles are computed over (at most PCM_SHM_SAMPLES - 1)
+#define PCM_LAT_PERIOD_MS 250 // Memory controller latency is measured at most this often
+#define PCM_LAT_PROBE_MS 10 // for this long per tier, during which bandwidth is not counted
 #define PMM_MIXED 1
 
 #include <stdint.h>
@@ -12,8 +21,81 @@ typedef struct memdata {
     float sys_dramReads, sys_dramWrites;
     float sys_pmmReads, sys_pmmWrites;
     float sys_pmmAppBW, sys_pmmMemBW;
+    float sys_ipc; // instructions per cycle over all cores, 0 if core counters are not available
+
+    // Average time (ns) requests spend in the memory controller queues, from the last latency probe
+    // (0 if not measured or there was no traffic)
+    float sys_dramReadLat, sys_dramWriteLat;
+    float sys_pmmReadLat, sys_pmmWriteLat;
+    float sys_llcMissLat; // LLC read miss latency seen by the cores (either tier), 0 if not available
     uint64_t total_rDram, total_wDram, total_rOptane, total_wOptane;
+
+    // Per socket
+    int32_t n_sockets;
+    float skt_dramReads[MAX_SOCKETS], skt_dramWrites[MAX_SOCKETS];
+    float skt_pmmReads[MAX_SOCKETS], skt_pmmWrites[MAX_SOCKETS];
+
+    // Per NUMA node: nodes with CPUs carry their socket's DRAM traffic and memory-only nodes its PMM traffic,
+    // split evenly between the socket's nodes of the same kind
+    int32_t node_socket[MAX_NODES]; // -1 if the node does not exist
+    float node_reads[MAX_NODES], node_writes[MAX_NODES];
 } memdata_t;
 
+// One pcm sample in the shared memory ring, written under a seqlock
+typedef struct pcm_sample {
+    uint64_t seq; // odd while the sample is being written
+    uint64_t no; // sample number, from 1
+    uint64_t ts_ns; // CLOCK_MONOTONIC when the sample was taken
+    uint64_t interval_ns; // time the sample covers
+    uint64_t cost_ns; // CPU time spent reading the counters for it
+    memdata_t md;
+} pcm_sample_t;
+
+// Bandwidth metrics smoothed in pcm_summary_t
+enum pcm_metric {
+    PCM_DRAM_READS,
+    PCM_DRAM_WRITES,
+    PCM_PMM_READS,
+    PCM_PMM_WRITES,
+    PCM_PMM_APP_BW,
+    PCM_N_METRICS
+};
+
+typedef struct pcm_stat {
+    float ewma;
+    float max, p50, p95, p99; // over the window
+} pcm_stat_t;
+
+// Statistics over the recent samples, recomputed after every sample (same seqlock protocol)
+typedef struct pcm_summary {
+    uint64_t seq;
+    uint64_t no; // last sample included
+    uint32_t n_window; // samples the max and percentiles cover
+    float sample_us; // average CPU time spent reading the counters per sample
+    float overhead; // share of a CPU spent reading the counters
+    pcm_stat_t stat[PCM_N_METRICS];
+} pcm_summary_t;
+
+typedef struct pcm_shm {
+    uint32_t version;
+    uint32_t size; // sizeof(pcm_shm_t) of the writer, readers with another layout ignore the ring
+    uint64_t head; // samples published, the last one is ring[(head - 1) % PCM_SHM_SAMPLES]
+    pcm_summary_t summary;
+    pcm_sample_t ring[PCM_SHM_SAMPLES];
+} pcm_shm_t;
+
+// Sampler in pcm-mod/pcm-ambix.cpp (part of libPCM.a)
+#ifdef __cplusplus
+extern "C" {
+#endif
+int pcm_sampler_open(void);
+void pcm_sampler_read(memdata_t *out, uint64_t *interval_us);
+void pcm_sampler_close(void);
+pcm_shm_t *pcm_shm_create(void);
+void pcm_shm_publish(pcm_shm_t *shm, const memdata_t *sample, uint64_t interval_us, uint64_t cost_ns);
+#ifdef __cplusplus
+}
+#endif
+
 
 #endif
@@ -0,0 +1,490 @@
+/*
+
+   Copyright (c) 2009-2020, Intel Corporation
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*!     \file pcm-ambix.cpp
+  \brief Memory bandwidth sampler used by Ambix: pcm-memory.x publishes its samples in shared memory, ctl built with
+         AMBIX_PCM links it from libPCM.a and samples the counters itself
+  */
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include "cpucounters.h"
+#include "utils.h"
+#include "../pcm-ambix.h"
+
+
+using namespace std;
+using namespace pcm;
+
+static uint32 max_imc_channels = ServerUncoreCounterState::maxChannels;
+static const uint32 max_imc_controllers = ServerUncoreCounterState::maxControllers;
+
+static PCM *m = NULL;
+static uint32 numSockets;
+static ServerUncoreCounterState * BeforeState;
+static ServerUncoreCounterState * AfterState;
+static uint64 BeforeTime;
+static uint64 AfterTime;
+static SystemCounterState BeforeSysState;
+static SystemCounterState AfterSysState;
+static bool coreCounters = false;
+static bool latencyMetrics = false;
+static uint64 LatTime = 0;
+
+static bool pmm = (PMM_MIXED == 0 ? true : false);
+static bool pmmMixed = !pmm;
+
+static memdata_t md;
+static bool node_has_cpus[MAX_NODES];
+static double ewma[PCM_N_METRICS];
+
+
+// Socket of every NUMA node: that of its first CPU, or of the closest node with CPUs for memory-only (PMM) nodes
+static void map_nodes()
+{
+    bool exists[MAX_NODES];
+    int distance[MAX_NODES][MAX_NODES];
+    char path[128];
+
+    for (int n = 0; n < MAX_NODES; ++n)
+    {
+        md.node_socket[n] = -1;
+        node_has_cpus[n] = false;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *f = fopen(path, "r");
+        if (!(exists[n] = (f != NULL)))
+            continue;
+        int cpu;
+        if ((fscanf(f, "%d", &cpu) == 1) && (cpu >= 0) && ((uint32) cpu < m->getNumCores()))
+        {
+            node_has_cpus[n] = true;
+            md.node_socket[n] = m->getSocketId(cpu);
+        }
+        fclose(f);
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", n);
+        f = fopen(path, "r");
+        for (int o = 0; o < MAX_NODES; ++o)
+        {
+            if ((f == NULL) || (fscanf(f, "%d", &distance[n][o]) != 1))
+                distance[n][o] = INT32_MAX;
+        }
+        if (f != NULL)
+            fclose(f);
+    }
+
+    for (int n = 0; n < MAX_NODES; ++n)
+    {
+        if (!exists[n] || node_has_cpus[n])
+            continue;
+        int best = -1;
+        for (int o = 0; o < MAX_NODES; ++o)
+        {
+            if (node_has_cpus[o] && ((best < 0) || (distance[n][o] < distance[n][best])))
+                best = o;
+        }
+        md.node_socket[n] = (best < 0) ? 0 : md.node_socket[best];
+    }
+}
+
+// Splits each socket's DRAM traffic between its nodes with CPUs and its PMM traffic between its memory-only nodes
+static void node_bandwidth()
+{
+    int n_kind[MAX_SOCKETS][2] = {{0}}; // [socket][has cpus]
+
+    for (int n = 0; n < MAX_NODES; ++n)
+    {
+        if ((md.node_socket[n] >= 0) && (md.node_socket[n] < MAX_SOCKETS))
+            n_kind[md.node_socket[n]][node_has_cpus[n]]++;
+    }
+    for (int n = 0; n < MAX_NODES; ++n)
+    {
+        int skt = md.node_socket[n];
+        md.node_reads[n] = md.node_writes[n] = 0.0;
+        if ((skt < 0) || (skt >= MAX_SOCKETS))
+            continue;
+        if (node_has_cpus[n])
+        {
+            md.node_reads[n] = md.skt_dramReads[skt] / n_kind[skt][1];
+            md.node_writes[n] = md.skt_dramWrites[skt] / n_kind[skt][1];
+        }
+        else
+        {
+            md.node_reads[n] = md.skt_pmmReads[skt] / n_kind[skt][0];
+            md.node_writes[n] = md.skt_pmmWrites[skt] / n_kind[skt][0];
+        }
+    }
+}
+
+
+static void calculate_bandwidth(const ServerUncoreCounterState uncState1[], const ServerUncoreCounterState uncState2[], const uint64 elapsedTime)
+{
+    //uint64 pmmMemoryModeCleanMisses = 0, pmmMemoryModeDirtyMisses = 0;
+
+    md.sys_dramReads = 0.0;
+    md.sys_dramWrites = 0.0;
+    md.sys_pmmReads = 0.0;
+    md.sys_pmmWrites = 0.0;
+
+    md.sys_pmmAppBW = 0.0;
+    md.sys_pmmMemBW = 0.0;
+
+    memset(md.skt_dramReads, 0, sizeof(md.skt_dramReads));
+    memset(md.skt_dramWrites, 0, sizeof(md.skt_dramWrites));
+    memset(md.skt_pmmReads, 0, sizeof(md.skt_pmmReads));
+    memset(md.skt_pmmWrites, 0, sizeof(md.skt_pmmWrites));
+
+    auto toBW = [&elapsedTime](const uint64 nEvents)
+    {
+        return (float)(nEvents * 64 / 1000000.0 / (elapsedTime / 1000000.0));
+    };
+    auto toMEv = [](const uint64 nEvents)
+    {
+        return (uint64)(nEvents / 1000000);
+    };
+
+    for(uint32 skt=0; skt < numSockets; ++skt)
+    {
+        for (uint32 channel = 0; channel < max_imc_channels; ++channel)
+        {
+            uint64 reads = 0, writes = 0, pmmReads = 0, pmmWrites = 0, pmmMemoryModeCleanMisses = 0, pmmMemoryModeDirtyMisses = 0;
+
+            reads = getMCCounter(channel, ServerPCICFGUncore::EventPosition::READ, uncState1[skt], uncState2[skt]);
+            writes = getMCCounter(channel, ServerPCICFGUncore::EventPosition::WRITE, uncState1[skt], uncState2[skt]);
+
+            if (pmm) {
+                pmmReads = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_READ, uncState1[skt], uncState2[skt]);
+                pmmWrites = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_WRITE, uncState1[skt], uncState2[skt]);
+            }
+            else if (pmmMixed) {
+                pmmMemoryModeCleanMisses = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_MM_MISS_CLEAN, uncState1[skt], uncState2[skt]);
+                pmmMemoryModeDirtyMisses = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_MM_MISS_DIRTY, uncState1[skt], uncState2[skt]);
+            }
+
+            if ((reads + writes + pmmReads + pmmWrites + pmmMemoryModeCleanMisses + pmmMemoryModeDirtyMisses) == 0)
+            {
+                continue;
+            }
+
+            md.total_rDram += toMEv(reads);
+            md.total_wDram += toMEv(writes);
+
+            md.skt_dramReads[skt] += toBW(reads);
+            md.skt_dramWrites[skt] += toBW(writes);
+
+            if (pmm) {
+                md.total_rOptane += toMEv(pmmReads);
+                md.total_wOptane += toMEv(pmmWrites);
+
+                md.skt_pmmReads[skt] += toBW(pmmReads);
+                md.skt_pmmWrites[skt] += toBW(pmmWrites);
+            }
+            else if (pmmMixed) {
+                md.sys_pmmMemBW += toBW(pmmMemoryModeCleanMisses + 2 * pmmMemoryModeDirtyMisses);
+            }
+        }
+
+        if (pmmMixed) {
+            for(uint32 c = 0; c < max_imc_controllers; ++c) {
+                uint64 pmmReads = 0, pmmWrites = 0;
+                pmmReads = getM2MCounter(c, ServerPCICFGUncore::EventPosition::PMM_READ, uncState1[skt],uncState2[skt]);
+                pmmWrites = getM2MCounter(c, ServerPCICFGUncore::EventPosition::PMM_WRITE, uncState1[skt],uncState2[skt]);
+
+                md.total_rOptane += toMEv(pmmReads);
+                md.total_wOptane += toMEv(pmmWrites);
+
+                md.skt_pmmReads[skt] += toBW(pmmReads);
+                md.skt_pmmWrites[skt] += toBW(pmmWrites);
+            }
+        }
+
+        md.sys_dramReads += md.skt_dramReads[skt];
+        md.sys_dramWrites += md.skt_dramWrites[skt];
+        md.sys_pmmReads += md.skt_pmmReads[skt];
+        md.sys_pmmWrites += md.skt_pmmWrites[skt];
+    }
+    node_bandwidth();
+
+    if (pmmMixed) {
+        md.sys_pmmAppBW = max(md.sys_pmmReads + md.sys_pmmWrites - md.sys_pmmMemBW, float(0.0));
+    }
+}
+
+// Counters programmed by programServerUncoreLatencyMetrics, as in pcm-latency
+enum { RPQ_OCC, RPQ_INS, WPQ_OCC, WPQ_INS };
+
+// Reprograms the memory controllers to count read and write queue occupancy, for the DRAM channels and then for
+// the PMM ones, PCM_LAT_PROBE_MS each, and restores the bandwidth events. Occupancy is counted in DRAM clocks.
+static void probe_latency()
+{
+    float *lat[2][2] = { { &md.sys_dramReadLat, &md.sys_dramWriteLat }, { &md.sys_pmmReadLat, &md.sys_pmmWriteLat } };
+
+    for (int tier = 0; tier < 2; ++tier)
+    {
+        double occupancy_ns[2] = { 0, 0 }, inserts[2] = { 0, 0 }; // [read, write]
+
+        m->programServerUncoreLatencyMetrics(tier == 1);
+        uint64 before = m->getTickCount(1000000);
+        for (uint32 i = 0; i < numSockets; ++i)
+            BeforeState[i] = m->getServerUncoreCounterState(i);
+        MySleepMs(PCM_LAT_PROBE_MS);
+        uint64 after = m->getTickCount(1000000);
+        for (uint32 i = 0; i < numSockets; ++i)
+            AfterState[i] = m->getServerUncoreCounterState(i);
+
+        for (uint32 skt = 0; skt < numSockets; ++skt)
+        {
+            const double clocks_per_ns = getDRAMClocks(0, BeforeState[skt], AfterState[skt]) / 1000.0 / std::max(after - before, (uint64) 1);
+            if (clocks_per_ns <= 0)
+                continue;
+            for (uint32 channel = 0; channel < max_imc_channels; ++channel)
+            {
+                occupancy_ns[0] += getMCCounter(channel, RPQ_OCC, BeforeState[skt], AfterState[skt]) / clocks_per_ns;
+                inserts[0] += getMCCounter(channel, RPQ_INS, BeforeState[skt], AfterState[skt]);
+                occupancy_ns[1] += getMCCounter(channel, WPQ_OCC, BeforeState[skt], AfterState[skt]) / clocks_per_ns;
+                inserts[1] += getMCCounter(channel, WPQ_INS, BeforeState[skt], AfterState[skt]);
+            }
+        }
+        for (int w = 0; w < 2; ++w)
+            *lat[tier][w] = (inserts[w] > 0) ? occupancy_ns[w] / inserts[w] : 0;
+    }
+
+    m->programServerUncoreMemoryMetrics(-1, -1, pmm || pmmMixed, pmmMixed);
+}
+
+extern "C" int pcm_sampler_open(void)
+{
+    m = PCM::getInstance();
+    m->disableJKTWorkaround();
+
+    if (!m->hasPCICFGUncore())
+    {
+        cerr << "Unsupported processor model (" << m->getCPUModel() << ").\n";
+        return PCM::UnknownError;
+    }
+    if ((m->PMMTrafficMetricsAvailable()) == false)
+    {
+        cerr << "PMM traffic metrics are not available on your processor.\n";
+        return PCM::UnknownError;
+    }
+    // Core counters only provide IPC (used by ctl to throttle migrations), bandwidth is reported without them
+    coreCounters = (m->program() == PCM::Success);
+    if (!coreCounters)
+    {
+        cerr << "Core counters are not available, IPC will not be reported.\n";
+    }
+
+    PCM::ErrorCode status = m->programServerUncoreMemoryMetrics(-1, -1, pmm || pmmMixed, pmmMixed);
+    if (status != PCM::Success)
+    {
+        return status;
+    }
+    latencyMetrics = m->DDRLatencyMetricsAvailable();
+    if (!latencyMetrics)
+    {
+        cerr << "Memory controller latency metrics are not available, latency will not be reported.\n";
+    }
+
+    numSockets = m->getNumSockets();
+    if(numSockets > MAX_SOCKETS)
+    {
+        cerr << "Only systems with up to " << MAX_SOCKETS << " sockets are supported!\n";
+        return PCM::UnknownError;
+    }
+
+    max_imc_channels = m->getMCChannelsPerSocket();
+
+    BeforeState = new ServerUncoreCounterState[numSockets];
+    AfterState = new ServerUncoreCounterState[numSockets];
+
+    m->setBlocked(false);
+
+    for(uint32 i=0; i<numSockets; ++i)
+        BeforeState[i] = m->getServerUncoreCounterState(i);
+
+    BeforeTime = m->getTickCount(1000000);
+    if (coreCounters)
+        BeforeSysState = m->getSystemCounterState();
+
+    memset(&md, 0, sizeof(md));
+    md.n_sockets = numSockets;
+    map_nodes();
+    return PCM::Success;
+}
+
+// Bandwidth since the previous call (or pcm_sampler_open), interval_us is the time it covers. Latency comes from
+// the last probe, repeated at most every PCM_LAT_PERIOD_MS.
+extern "C" void pcm_sampler_read(memdata_t *out, uint64_t *interval_us)
+{
+    AfterTime = m->getTickCount(1000000);
+    for(uint32 i=0; i<numSockets; ++i)
+        AfterState[i] = m->getServerUncoreCounterState(i);
+
+    calculate_bandwidth(BeforeState,AfterState,AfterTime-BeforeTime);
+    if (coreCounters)
+    {
+        AfterSysState = m->getSystemCounterState();
+        md.sys_ipc = max(getIPC(BeforeSysState, AfterSysState), 0.0);
+        const double llcMissLat = getLLCReadMissLatency(BeforeSysState, AfterSysState);
+        md.sys_llcMissLat = (llcMissLat > 0) ? llcMissLat : 0; // -1 if not available, NaN without misses
+        swap(BeforeSysState, AfterSysState);
+    }
+    *interval_us = AfterTime - BeforeTime;
+
+    swap(BeforeTime, AfterTime);
+    swap(BeforeState, AfterState);
+
+    // The next interval starts after the probe, with the bandwidth events programmed again
+    if (latencyMetrics && (BeforeTime - LatTime >= PCM_LAT_PERIOD_MS * 1000))
+    {
+        probe_latency();
+        LatTime = BeforeTime;
+        for(uint32 i=0; i<numSockets; ++i)
+            BeforeState[i] = m->getServerUncoreCounterState(i);
+        BeforeTime = m->getTickCount(1000000);
+    }
+    *out = md;
+}
+
+extern "C" void pcm_sampler_close(void)
+{
+    delete[] BeforeState;
+    delete[] AfterState;
+    m->cleanup();
+}
+
+// Creates (or recreates) the shared memory ring read by ctl
+extern "C" pcm_shm_t *pcm_shm_create(void)
+{
+    shm_unlink(PCM_SHM_NAME); // readers still mapping an old ring see it go stale and map the new one
+
+    int fd = shm_open(PCM_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        cerr << "Could not create shared memory " << PCM_SHM_NAME << ": " << strerror(errno) << "\n";
+        return NULL;
+    }
+    fchmod(fd, 0644); // not narrowed by umask, ctl need not run as root
+    if (ftruncate(fd, sizeof(pcm_shm_t)) < 0)
+    {
+        cerr << "Could not size shared memory " << PCM_SHM_NAME << ": " << strerror(errno) << "\n";
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(pcm_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        cerr << "Could not map shared memory " << PCM_SHM_NAME << ": " << strerror(errno) << "\n";
+        return NULL;
+    }
+
+    pcm_shm_t *shm = (pcm_shm_t *) p;
+    shm->version = PCM_SHM_VERSION;
+    shm->size = sizeof(pcm_shm_t);
+    return shm;
+}
+
+static float metric(const memdata_t *sample, int i)
+{
+    switch (i)
+    {
+        case PCM_DRAM_READS:
+            return sample->sys_dramReads;
+        case PCM_DRAM_WRITES:
+            return sample->sys_dramWrites;
+        case PCM_PMM_READS:
+            return sample->sys_pmmReads;
+        case PCM_PMM_WRITES:
+            return sample->sys_pmmWrites;
+        default:
+            return sample->sys_pmmAppBW;
+    }
+}
+
+// Recomputes the summary after sample no: EWMA, then max and percentiles over the last PCM_WINDOW_MS
+static void update_summary(pcm_shm_t *shm, uint64_t no, uint64_t interval_us)
+{
+    pcm_summary_t *sum = &shm->summary;
+    float values[PCM_SHM_SAMPLES];
+    uint64_t cost_ns = 0, window_ns = 0;
+    uint64_t n = std::max((uint64_t) 1, (uint64_t) PCM_WINDOW_MS * 1000 / std::max(interval_us, (uint64_t) 1));
+    double alpha = 1 - exp(-(double) interval_us / (PCM_EWMA_MS * 1000.0));
+
+    n = std::min(n, std::min(no, (uint64_t) PCM_SHM_SAMPLES - 1));
+
+    __atomic_store_n(&sum->seq, sum->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (uint64_t k = 0; k < n; ++k)
+    {
+        const pcm_sample_t *s = &shm->ring[(no - 1 - k) % PCM_SHM_SAMPLES];
+        cost_ns += s->cost_ns;
+        window_ns += s->interval_ns;
+    }
+    for (int i = 0; i < PCM_N_METRICS; ++i)
+    {
+        const memdata_t *last = &shm->ring[(no - 1) % PCM_SHM_SAMPLES].md;
+        ewma[i] = (no == 1) ? metric(last, i) : (1 - alpha) * ewma[i] + alpha * metric(last, i);
+
+        for (uint64_t k = 0; k < n; ++k)
+            values[k] = metric(&shm->ring[(no - 1 - k) % PCM_SHM_SAMPLES].md, i);
+        std::sort(values, values + n);
+
+        pcm_stat_t *st = &sum->stat[i];
+        st->ewma = ewma[i];
+        st->max = values[n - 1];
+        st->p50 = values[(uint64_t) ceil(0.50 * n) - 1];
+        st->p95 = values[(uint64_t) ceil(0.95 * n) - 1];
+        st->p99 = values[(uint64_t) ceil(0.99 * n) - 1];
+    }
+    sum->no = no;
+    sum->n_window = n;
+    sum->sample_us = cost_ns / 1000.0 / n;
+    sum->overhead = window_ns ? (float) cost_ns / window_ns : 0;
+
+    __atomic_store_n(&sum->seq, sum->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Writes the next ring slot under its seqlock, publishes it by advancing head and updates the summary
+extern "C" void pcm_shm_publish(pcm_shm_t *shm, const memdata_t *sample, uint64_t interval_us, uint64_t cost_ns)
+{
+    uint64_t no = shm->head + 1;
+    pcm_sample_t *s = &shm->ring[(no - 1) % PCM_SHM_SAMPLES];
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->no = no;
+    s->ts_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    s->interval_ns = interval_us * 1000;
+    s->cost_ns = cost_ns;
+    s->md = *sample;
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&shm->head, no, __ATOMIC_RELEASE);
+
+    update_summary(shm, no, interval_us);
+}
@@ -21,6 +21,7 @@
 #include <iostream>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/time.h> // for gettimeofday()
 #include <math.h>
 #include <iomanip>
@@ -37,18 +38,8 @@
 using namespace std;
 using namespace pcm;
 
-uint32 max_imc_channels = ServerUncoreCounterState::maxChannels;
-const uint32 max_imc_controllers = ServerUncoreCounterState::maxControllers;
-
 PCM *m = PCM::getInstance();
-uint32 numSockets;
-ServerUncoreCounterState * BeforeState;
-ServerUncoreCounterState * AfterState;
-uint32 BeforeTime;
-uint32 AfterTime;
-
-bool pmm = (PMM_MIXED == 0 ? true : false);
-bool pmmMixed = !pmm;
+pcm_shm_t *shm;
 
 memdata_t md;
 
@@ -56,13 +47,14 @@ void print_help(const string prog_name)
 {
     cerr << "\n Usage: \n " << prog_name
          << " --help | [delay] [options] [-- external_program [external_program_options]]\n";
-    cerr << "   <delay>                           => time interval to sample performance counters.\n";
-    cerr << "                                        If not specified, or 0, with external program given\n";
-    cerr << "                                        will read counters only after external program finishes\n";
+    cerr << "   <delay>                           => time interval to sample performance counters, in seconds\n";
+    cerr << "                                        (default " << PCM_DELAY << ", at least " << PCM_MIN_DELAY_MS << " ms). Shorter intervals are\n";
+    cerr << "                                        smoothed for ctl, the output is still printed once per second\n";
     cerr << " Supported <options> are: \n";
     cerr << "  -h    | --help  | /h               => print this help and exit\n";
     cerr << " Examples:\n";
     cerr << "  " << prog_name << " 1                  => print counters every second without core and socket output\n";
+    cerr << "  " << prog_name << " 0.05               => sample every 50 ms\n";
     cerr << "\n";
 }
 
@@ -77,7 +69,11 @@ void display_sys_bandwidth(memdata_t *md)
         \r|--                   DRAM Read Throughput(MB/s):" << setw(14) << md->sys_dramReads <<                                           "                --|\n\
         \r|--                  DRAM Write Throughput(MB/s):" << setw(14) << md->sys_dramWrites <<                                          "                --|\n\
         \r|--                    PMM Read Throughput(MB/s):" << setw(14) << md->sys_pmmReads <<                                            "                --|\n\
-        \r|--                   PMM Write Throughput(MB/s):" << setw(14) << md->sys_pmmWrites <<                                           "                --|\n";
+        \r|--                   PMM Write Throughput(MB/s):" << setw(14) << md->sys_pmmWrites <<                                           "                --|\n\
+        \r|--                                          IPC:" << setw(14) << md->sys_ipc <<                                                 "                --|\n\
+        \r|--                  DRAM Read/Write Latency(ns):" << setw(10) << md->sys_dramReadLat << setw(10) << md->sys_dramWriteLat <<   "          --|\n\
+        \r|--                   PMM Read/Write Latency(ns):" << setw(10) << md->sys_pmmReadLat << setw(10) << md->sys_pmmWriteLat <<     "          --|\n\
+        \r|--                         LLC Miss Latency(ns):" << setw(14) << md->sys_llcMissLat <<                                          "                --|\n";
 
     if (PMM_MIXED) {
         cout << "\
@@ -93,108 +89,30 @@ void display_sys_bandwidth(memdata_t *md)
         \r|--                    Total Optane Read (MEv):" << setw(14) << md->total_rOptane << "                --|\n\
         \r|--                   Total Optane Write (MEv):" << setw(14) << md->total_wOptane << "                --|\n\
         \r|---------------------------------------||---------------------------------------|\n";
-}
-
-void write_memdata(memdata_t md) {
-
-    FILE * out_file;
-    out_file = fopen("memdata.tmp", "w");
-    fwrite(&md, sizeof(md), 1, out_file);
-    fclose(out_file);
-
-    rename("memdata.tmp", PCM_FILE_NAME);
-
-    FILE * txt_file;
-    txt_file = fopen("pcmEvents.tmp", "w");
-    fprintf(txt_file, "R_DRAM: %lu\nW_DRAM: %lu\nR_OPT: %lu\nW_OPT: %lu\n", md.total_rDram, md.total_wDram, md.total_rOptane, md.total_wOptane);
-    fclose(txt_file);
-
-    rename("pcmEvents.tmp", "pcmEvents.txt");
-}
-
-
-memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const ServerUncoreCounterState uncState2[], const uint64 elapsedTime)
-{
-    //uint64 pmmMemoryModeCleanMisses = 0, pmmMemoryModeDirtyMisses = 0;
 
-    md.sys_dramReads = 0.0;
-    md.sys_dramWrites = 0.0;
-    md.sys_pmmReads = 0.0;
-    md.sys_pmmWrites = 0.0;
-
-    md.sys_pmmAppBW = 0.0;
-    md.sys_pmmMemBW = 0.0;
-
-    auto toBW = [&elapsedTime](const uint64 nEvents)
+    if (md->n_sockets > 1)
     {
-        return (float)(nEvents * 64 / 1000000.0 / (elapsedTime / 1000.0));
-    };
-    auto toMEv = [&elapsedTime](const uint64 nEvents)
-    {
-        return (uint64)(nEvents / 1000000);
-    };
-
-    for(uint32 skt=0; skt < numSockets; ++skt)
-    {
-        for (uint32 channel = 0; channel < max_imc_channels; ++channel)
+        for (int32_t skt = 0; skt < md->n_sockets; ++skt)
         {
-            uint64 reads = 0, writes = 0, pmmReads = 0, pmmWrites = 0, pmmMemoryModeCleanMisses = 0, pmmMemoryModeDirtyMisses = 0;
-
-            reads = getMCCounter(channel, ServerPCICFGUncore::EventPosition::READ, uncState1[skt], uncState2[skt]);
-            writes = getMCCounter(channel, ServerPCICFGUncore::EventPosition::WRITE, uncState1[skt], uncState2[skt]);
-
-            if (pmm) {
-                pmmReads = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_READ, uncState1[skt], uncState2[skt]);
-                pmmWrites = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_WRITE, uncState1[skt], uncState2[skt]);
-            }
-            else if (pmmMixed) {
-                pmmMemoryModeCleanMisses = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_MM_MISS_CLEAN, uncState1[skt], uncState2[skt]);
-                pmmMemoryModeDirtyMisses = getMCCounter(channel, ServerPCICFGUncore::EventPosition::PMM_MM_MISS_DIRTY, uncState1[skt], uncState2[skt]);
-            }
-
-            if ((reads + writes + pmmReads + pmmWrites + pmmMemoryModeCleanMisses + pmmMemoryModeDirtyMisses) == 0)
-            {
-                continue;
-            }
-
-            md.total_rDram += toMEv(reads);
-            md.total_wDram += toMEv(writes);
-
-            md.sys_dramReads += toBW(reads);
-            md.sys_dramWrites += toBW(writes);
-
-            if (pmm) {
-                md.total_rOptane += toMEv(pmmReads);
-                md.total_wOptane += toMEv(pmmWrites);
-
-                md.sys_pmmReads += toBW(pmmReads);
-                md.sys_pmmWrites += toBW(pmmWrites);
-            }
-            else if (pmmMixed) {
-                md.sys_pmmMemBW += toBW(pmmMemoryModeCleanMisses + 2 * pmmMemoryModeDirtyMisses);
-            }
-        }
-
-        if (pmmMixed) {
-            for(uint32 c = 0; c < max_imc_controllers; ++c) {
-                uint64 pmmReads = 0, pmmWrites = 0;
-                pmmReads = getM2MCounter(c, ServerPCICFGUncore::EventPosition::PMM_READ, uncState1[skt],uncState2[skt]);
-                pmmWrites = getM2MCounter(c, ServerPCICFGUncore::EventPosition::PMM_WRITE, uncState1[skt],uncState2[skt]);
-
-                md.total_rOptane += toMEv(pmmReads);
-                md.total_wOptane += toMEv(pmmWrites);
-
-                md.sys_pmmReads += toBW(pmmReads);
-                md.sys_pmmWrites += toBW(pmmWrites);
-            }
+            cout << "\r|-- Socket " << skt << "   DRAM R/W (MB/s):" << setw(10) << md->skt_dramReads[skt] << setw(10) << md->skt_dramWrites[skt]
+                 << "   PMM R/W (MB/s):" << setw(10) << md->skt_pmmReads[skt] << setw(10) << md->skt_pmmWrites[skt] << "\n";
         }
     }
+}
 
-    if (pmmMixed) {
-        md.sys_pmmAppBW = max(md.sys_pmmReads + md.sys_pmmWrites - md.sys_pmmMemBW, float(0.0));
-    }
+void display_summary(pcm_summary_t *sum)
+{
+    const char *names[PCM_N_METRICS] = { "DRAM Read", "DRAM Write", "PMM Read", "PMM Write", "PMM AD" };
 
-    return md;
+    cout << "\r|--  Last " << setw(3) << sum->n_window << " samples (MB/s):      EWMA       p50       p95       p99       max  --|\n";
+    for (int i = 0; i < PCM_N_METRICS; ++i)
+    {
+        pcm_stat_t *st = &sum->stat[i];
+        cout << "\r|--  " << setw(10) << names[i] << "                " << setw(10) << st->ewma << setw(10) << st->p50
+             << setw(10) << st->p95 << setw(10) << st->p99 << setw(10) << st->max << "  --|\n";
+    }
+    cout << "\r|--  Sampling cost: " << setw(8) << sum->sample_us << " us per sample, " << setw(6) << sum->overhead * 100
+         << "% of a CPU                 --|\n";
 }
 
 int main(int argc, char * argv[])
@@ -215,6 +133,7 @@ int main(int argc, char * argv[])
     cerr << "\n";
 
     string program = string(argv[0]);
+    int delay_ms = PCM_DELAY * 1000;
 
 
     if (argc > 1) do
@@ -228,23 +147,20 @@ int main(int argc, char * argv[])
             print_help(program);
             exit(EXIT_FAILURE);
         }
+        else
+        {
+            double delay = atof(*argv);
+            if (delay * 1000 < PCM_MIN_DELAY_MS)
+            {
+                cerr << "Invalid delay " << *argv << ", the minimum is " << PCM_MIN_DELAY_MS << " ms.\n";
+                exit(EXIT_FAILURE);
+            }
+            delay_ms = (int) (delay * 1000);
+        }
     } while(argc > 1); // end of command line parsing loop
 
-    m->disableJKTWorkaround();
     print_cpu_details();
-    if (!m->hasPCICFGUncore())
-    {
-        cerr << "Unsupported processor model (" << m->getCPUModel() << ").\n";
-        if (m->memoryTrafficMetricsAvailable())
-            cerr << "For processor-level memory bandwidth statistics please use pcm.x\n";
-        exit(EXIT_FAILURE);
-    }
-    if ((m->PMMTrafficMetricsAvailable()) == false)
-    {
-        cerr << "PMM traffic metrics are not available on your processor.\n";
-        exit(EXIT_FAILURE);
-    }
-    PCM::ErrorCode status = m->programServerUncoreMemoryMetrics(-1, -1, pmm || pmmMixed, pmmMixed);
+    PCM::ErrorCode status = (PCM::ErrorCode) pcm_sampler_open();
     switch (status)
     {
         case PCM::Success:
@@ -268,62 +184,34 @@ int main(int argc, char * argv[])
             exit(EXIT_FAILURE);
     }
 
-    numSockets = m->getNumSockets();
-    if(numSockets > MAX_SOCKETS)
+    if ((shm = pcm_shm_create()) == NULL)
     {
-        cerr << "Only systems with up to " << MAX_SOCKETS << " sockets are supported! Program aborted\n";
         exit(EXIT_FAILURE);
     }
 
-    max_imc_channels = m->getMCChannelsPerSocket();
-
-    BeforeState = new ServerUncoreCounterState[numSockets];
-    AfterState = new ServerUncoreCounterState[numSockets];
-    BeforeTime = 0;
-    AfterTime = 0;
-
-    m->setBlocked(false);
-
-    cerr << "Update every " << PCM_DELAY << " seconds\n";
-
-    for(uint32 i=0; i<numSockets; ++i)
-        BeforeState[i] = m->getServerUncoreCounterState(i);
+    cerr << "Update every " << delay_ms << " ms\n";
 
-    BeforeTime = m->getTickCount();
-
-    // Init MD
-
-    md.sys_dramReads = 0.0;
-    md.sys_dramWrites = 0.0;
-    md.sys_pmmReads = 0.0;
-    md.sys_pmmWrites = 0.0;
-
-    md.sys_pmmAppBW = 0.0;
-    md.sys_pmmMemBW = 0.0;
-
-    md.total_rDram = 0;
-    md.total_wDram = 0;
-    md.total_rOptane = 0;
-    md.total_wOptane = 0;
-
-    while (true)
+    int display_every = max(1000 / delay_ms, 1);
+    for (uint64_t n = 1; ; ++n)
     {
-        MySleep(PCM_DELAY);
+        uint64_t interval_us;
+        struct timespec before, after;
 
-        AfterTime = m->getTickCount();
-        for(uint32 i=0; i<numSockets; ++i)
-            AfterState[i] = m->getServerUncoreCounterState(i);
+        MySleepMs(delay_ms);
 
-        calculate_bandwidth(BeforeState,AfterState,AfterTime-BeforeTime);
-        write_memdata(md);
-        display_sys_bandwidth(&md);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+        pcm_sampler_read(&md, &interval_us);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
 
-        swap(BeforeTime, AfterTime);
-        swap(BeforeState, AfterState);
+        pcm_shm_publish(shm, &md, interval_us, (after.tv_sec - before.tv_sec) * 1000000000ULL + after.tv_nsec - before.tv_nsec);
+        if (n % display_every == 0)
+        {
+            display_sys_bandwidth(&md);
+            display_summary(&shm->summary);
+        }
     }
 
-    delete[] BeforeState;
-    delete[] AfterState;
+    pcm_sampler_close();
 
     exit(EXIT_SUCCESS);
 }